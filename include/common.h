@@ -6,6 +6,7 @@
 #include <fs.h>
 #include <simpleio.h>
 #include <spcap.h>
+#include <stream.h>
 
 // Spdk
 #include "spdk/env.h"
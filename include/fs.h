@@ -8,44 +8,163 @@
 #include <string.h>
 
 // FS config
-#define CURVERSION 1
-#define NAMELENGTH 26
-#define MAXFILES 12
+#define CURVERSION 5
+#define NAMELENGTH 96
 #define MAXDISKS 8
+#define MAXWEIGHT 16  // stripes of a disk in each cycle of the stripe map
+#define GROWLENGTH (1024lu * 1024lu * 1024lu)  // bytes a growing file reserves each time
 
 // Meta sectors
 #define MAGICNUMBER 0xCACA0FE0
-#define SECTORLENGTH 512lu
-#define METASECTORLENGTH SECTORLENGTH
+#define METASECTORLENGTH 512lu  // stored at the beginning of the first sector of every disk
+#define METAAREALENGTH 4096lu   // meta sector, and the file table after it
+#define METAREGIONLENGTH (4lu * 1024lu * 1024lu)  // whole stripes before the data of every disk
+#define FILEEXTENTS 4  // extents per file the file table is sized for
+#define JOURNALMAGIC 0x4A524E4C43414341lu
 
-// Super sectors
-#define SUPERSECTORLENGTH (128lu * 1024lu)  // 128K that is the best for performance
-#define SUPERSECTORNUM (SUPERSECTORLENGTH / METASECTORLENGTH)
+// Until version 3, the files were in the meta sectors, and their next extents right after them
+#define NAMELENGTHV3 26
+#define MAXFILESV3 11
+#define MAXEXTENTSV3 210
+
+// Sectors (LBAs). Every disk of the raid must be formatted with the same LBA size
+#define DEFAULTSECTORLENGTH 512lu
+#define MAXSECTORLENGTH 4096lu
+#define SECTORLENGTH ((uint64_t)raid->sectorLength)
+
+// Super sectors (stripes). Their size is chosen when formatting and kept in the meta sectors
+#define DEFAULTSTRIPELENGTH (128lu * 1024lu)  // 128K, the best for the drives we started with
+#define MINSTRIPELENGTH (4lu * 1024lu)
+#define MAXSTRIPELENGTH (2lu * 1024lu * 1024lu)
+#define SUPERSECTORLENGTH ((uint64_t)raid->stripeLength)
+#define SUPERSECTORNUM (SUPERSECTORLENGTH / SECTORLENGTH)
 
 // Giga sectors
 #define GIGASECTORLENGTH (SUPERSECTORLENGTH * raid->numdisks)
 #define GIGASECTORNUM (SUPERSECTORNUM * raid->numdisks)
 
 typedef struct __attribute__ ((__packed__)) {
-	char name[NAMELENGTH];
+	char name[NAMELENGTHV3];
 	uint64_t startBlock;
 	uint64_t endBlock;
-} metaFile;
+} metaFileV3;
+
+typedef struct __attribute__ ((__packed__)) {
+	uint64_t startBlock;
+	uint64_t endBlock;
+	uint8_t file;  // index in content + 1 of the owner, 0 if free
+} metaExtentV3;
 
 typedef struct __attribute__ ((__packed__)) {
 	uint32_t MAGIC;
 	uint8_t version;
 	uint8_t diskId;
 	uint8_t totalDisks;
-	uint8_t totalFiles;
-	metaFile content[MAXFILES];
+	uint8_t totalFiles;                // until version 3
+	metaFileV3 content[MAXFILESV3];    // until version 3
+	uint32_t stripeLength;  // bytes (since version 2)
+	uint32_t sectorLength;  // bytes, 0 means 512
+	uint8_t weights[MAXDISKS];  // of every disk in the stripe map, 0 means 1
+	uint8_t mirrored;           // disk diskId ^ 1 keeps a replica of every stripe
+	uint16_t metaStripes;       // stripes of each disk before the data (since version 4), 0 is 1
+	uint32_t journalLength;     // bytes after the file table (since version 5), 0 if none
+	uint8_t expandDisks;              // disks before an unfinished expansion, 0 if none
+	uint8_t expandWeights[MAXDISKS];  // and their stripe map
+	uint64_t expandStripe;            // stripes already moved to the new stripe map
+	uint8_t expandBackup;             // the first ones are being moved from the backup rows
+	uint8_t reserved[1];
 } metaSector;
 
+// File table, the same in every disk after its meta area (since version 4): the files, and then
+// the extents. Files are made of extents, the first one is in their metaFile and the next ones
+// are in the extents of the table, in order. Those are kept packed (the used ones first)
+typedef struct __attribute__ ((__packed__)) {
+	char name[NAMELENGTH];
+	uint64_t startBlock;
+	uint64_t endBlock;
+	uint64_t indexBlock;   // block of the file where its index starts (captures, see spcap.h)
+	uint32_t indexBlocks;  // 0 if it has none
+	uint8_t layout;        // of the data of a capture (spcap.h)
+	uint8_t reserved[3];
+} metaFile;
+
+typedef struct __attribute__ ((__packed__)) {
+	uint64_t startBlock;
+	uint64_t endBlock;
+	uint32_t file;  // index in the files + 1 of the owner, 0 if free
+} metaExtent;
+
+// Journal of the file table, in every disk after it (since version 5). The table sectors of an
+// update are written there, with this header and their indexes before them, and then in place.
+// On start-up, the valid journal with the highest seq is written in place again where a disk
+// does not have it
+typedef struct __attribute__ ((__packed__)) {
+	uint64_t MAGIC;
+	uint64_t seq;
+	uint32_t sectors;   // of the table in this update, their uint32_t indexes follow
+	uint32_t checksum;  // of the header sectors and the table sectors, with this field as 0
+} metaJournal;
+
 typedef struct {
+	uint64_t start;
+	uint64_t count;
+} metaRange;
+
+// Async I/O engine
+#define SIO_MAXQDEPTH 1024
+#define SIO_DEFAULTQDEPTH 128
+#define SIO_MAXQUEUES 32  // one per thread/lcore using the disk
+#define SIO_TRIMLENGTH (1lu << 30)  // bytes released by each deallocate command
+
+// Pinned buffers pool, reused by the *_pinit helpers
+#define SIO_MAXSOCKETS 8
+#define SIO_PIPEBUFFS 4                 // gigasector buffers rotating in the raid copies
+#define SIO_DEFAULTBUFFS SIO_PIPEBUFFS  // gigasector buffers preallocated per raid
+#define SIO_TOOLMEMSIZE 256            // MB of hugepages for the short-lived tools (ls, rm)
+
+typedef struct sioBuff {
+	void* mem;
+	uint64_t size;
+	uint32_t socket;       // where it was allocated, and where it returns
+	struct sioBuff* next;  // free list
+} sioBuff;
+
+typedef void (*sio_cb) (void* arg, int error);
+typedef void (*sio_sgl_reset) (void* arg, uint32_t offset);
+typedef int (*sio_sgl_next) (void* arg, void** address, uint32_t* length);
+
+typedef struct sioTask {
+	sio_cb cb;
+	void* arg;
+	sio_sgl_reset sglReset;  // only for vectored commands
+	sio_sgl_next sglNext;
+	void* sglArg;
+	struct sioQueue* queue;
+	struct sioTask* next;  // free list
+} sioTask;
+
+typedef struct sioQueue {
+	struct idisk* disk;
+	void* ctx;          // of the backend: spdk qpair, io_uring...
+	uint32_t qdepth;    // max in-flight tasks
+	uint32_t inflight;  // tasks submitted and not completed
+	uint64_t scheduled;
+	uint64_t completed;
+	uint64_t errors;
+	sioTask* freeTasks;
+	sioTask tasks[SIO_MAXQDEPTH];
+} sioQueue;
+
+typedef struct idisk {
 	metaSector msector;
-	struct spdk_nvme_ctrlr* ctrlr;
+	const struct sioBackend* backend;
+	struct spdk_nvme_ctrlr* ctrlr;  // spdk backend
 	struct spdk_nvme_ns* ns;
-	struct spdk_nvme_qpair* qpair;
+	int fd;  // io_uring backend
+	uint32_t sectorLength;
+	uint64_t numSectors;
+	sioQueue* queue[SIO_MAXQUEUES];
+	int numqueues;
 } idisk;
 
 typedef struct {
@@ -53,29 +172,126 @@ typedef struct {
 	int numdisks;
 	int numFiles;
 	uint64_t totalBlocks;  // unset
+	uint32_t stripeLength;
+	uint32_t sectorLength;
+
+	// Stripe map: stripe i is in disk stripeMap[i % stripeCycle]. Each disk gets weight[disk]
+	// stripes per cycle, stripeRank is the position of the stripe among the ones of its disk
+	uint8_t weight[MAXDISKS];
+	uint32_t stripeCycle;
+	uint8_t stripeMap[MAXWEIGHT * MAXDISKS];
+	uint8_t stripeRank[MAXWEIGHT * MAXDISKS];
+
+	// RAID-10: the stripe map only has the even disks, disk i ^ 1 is the mirror of disk i
+	uint8_t mirrored;
+
+	// Expansion (expandRaid, reshapeRaid): the stripes from expandStripe on are still in the
+	// stripe map of the first expandDisks disks. The raid keeps their capacity until it ends
+	uint8_t expandDisks;
+	uint64_t expandStripe;
+	uint8_t expandWeight[MAXDISKS];
+	uint32_t expandCycle;
+	uint8_t expandMap[MAXWEIGHT * MAXDISKS];
+	uint8_t expandRank[MAXWEIGHT * MAXDISKS];
+
+	// File table, pinned as it is in the disks. Only the dirty sectors are written
+	uint32_t metaStripes;
+	sioBuff* table;
+	uint64_t tableLength;
+	metaFile* files;
+	uint32_t maxFiles;
+	metaExtent* extents;
+	uint32_t maxExtents;
+	uint32_t numExtents;
+	uint8_t* dirty;  // per table sector
+	uint32_t* hash;  // of the names, open addressing: file index + 1, 0 if empty
+	uint32_t hashSize;
+
+	// Group commit: updates between beginUpdate and endUpdate are committed at once, and the
+	// blocks they free are deallocated after that
+	uint32_t journalLength;
+	uint64_t journalSeq;
+	int batch;
+	int pending;    // updates since the last commit
+	int metaDirty;  // the meta sectors changed (format, upgrade)
+	metaRange* trims;
+	uint32_t numTrims;
+	uint32_t maxTrims;
 } nvmeRaid;
 
 void checkMetaConfig (void);
 int checkMeta (metaSector* m);
-void initMeta (metaSector* m, uint8_t diskId, uint8_t totalDisks);
+int checkStripeLength (uint64_t stripeLength);
+void initMeta (metaSector* m,
+               uint8_t diskId,
+               uint8_t totalDisks,
+               uint32_t stripeLength,
+               uint32_t sectorLength,
+               const uint8_t* weights);
+int upgradeMeta (metaSector* m);  // the version it had, 0 if current, -1 on errors
 
+int checkRaidSectors (nvmeRaid* raid);
+void weighRaid (nvmeRaid* raid, const double* perf);  // weights proportional to perf
+void reduceWeights (nvmeRaid* raid);  // the shortest cycle with the same shares (formatRaid)
+void buildStripeMap (nvmeRaid* raid);
 void formatRaid (nvmeRaid* raid);
 void createRaid (nvmeRaid* raid);
+// Adds the disks without meta-data to the raid, with weights (of the new disks, by default the
+// smallest one of the raid). Its files are moved to the new stripe map by reshapeRaid, at up to
+// rate MB/s (0 is unlimited). Both can be interrupted, and the raid is usable meanwhile
+void expandRaid (nvmeRaid* raid, const uint8_t* weights, int nweights);
+int reshapeRaid (nvmeRaid* raid, uint64_t rate);
+// Commits the file table, unless there is a batch open. A batch is a single commit while its
+// updates fit in half the journal, and it is committed after the update that goes beyond
 void updateRaid (nvmeRaid* raid);
+void beginUpdate (nvmeRaid* raid);
+void endUpdate (nvmeRaid* raid);
 
-uint64_t blocksLeft (nvmeRaid* raid);
+uint64_t blocksLeft (nvmeRaid* raid);       // free blocks, in any extent
+uint64_t biggestFreeBlocks (nvmeRaid* raid);  // the biggest contiguous free blocks
 uint64_t rightFreeBlocks (nvmeRaid* raid);  // the rightest contiguous free blocks (the number of)
 uint64_t rightFreeBlock (nvmeRaid* raid);   // the rightest contiguous free block (which is)
 metaFile* findFile (nvmeRaid* raid, const char* const name);
-uint8_t findFileDisk (nvmeRaid* raid, const char* const name);
 metaFile* addFile (nvmeRaid* raid, const char* const name, uint64_t blsize);
 uint8_t delFile (nvmeRaid* raid, const char* const name);
 
+// Extents of a file. fileExtent gives the raid blocks of the nth one, -1 if there is not
+int fileExtent (nvmeRaid* raid, metaFile* file, int n, uint64_t* start, uint64_t* end);
+int fileExtents (nvmeRaid* raid, metaFile* file);
+uint64_t fileBlocks (nvmeRaid* raid, metaFile* file);
+// Raid block of the block offset of the file, and how many follow it in the same extent
+int fileMap (nvmeRaid* raid, metaFile* file, uint64_t offset, uint64_t* lba, uint64_t* count);
+// The streams written per disk (spcap) go through the extents in order: the next one (after *n,
+// so start with -1) with room for a whole stripe in disk, and its disk lbas [first, last). While
+// expanding, each extent is two, before and after the stripes moved (super_getsplit)
+int fileDiskExtent (
+    nvmeRaid* raid, metaFile* file, uint8_t disk, int* n, uint64_t* first, uint64_t* last);
+int truncFile (nvmeRaid* raid, metaFile* file, uint64_t blocks);  // deallocates the rest
+// Appends at least blocks (whole allocation units) to the file: its last extent grows if the
+// blocks after it are free, otherwise it gets new extents. -1 if there is no space
+int growFile (nvmeRaid* raid, metaFile* file, uint64_t blocks);
+// The blocks of the file with its index. truncFile drops it when it cuts them
+void setFileIndex (nvmeRaid* raid, metaFile* file, uint64_t block, uint32_t blocks);
+void setFileLayout (nvmeRaid* raid, metaFile* file, uint8_t layout);
+int deallocFile (nvmeRaid* raid, metaFile* file);
+// Moves extents to the lowest free blocks, so the free space gets contiguous. Returns the moves
+int compactRaid (nvmeRaid* raid);
+
 #include <simpleio.h>
 
 // utility functions
 uint64_t super_getid (nvmeRaid* raid, uint64_t lba);
 uint64_t super_getdisk (nvmeRaid* raid, uint64_t lba);
 uint64_t super_getdisklba (nvmeRaid* raid, uint64_t lba);
+uint64_t super_getfirst (nvmeRaid* raid, uint64_t lba, uint8_t disk);  // first stripe of disk
+// disk lbas [first, last) of a raid range in disk, 0 if the range has no stripes there. The range
+// must follow a single stripe map (super_getsplit)
+int super_getrange (
+    nvmeRaid* raid, uint64_t start, uint64_t end, uint8_t disk, uint64_t* first, uint64_t* last);
+uint64_t super_getraidlba (nvmeRaid* raid, uint8_t disk, uint64_t disklba);  // the inverse
+int super_getmirror (nvmeRaid* raid, uint8_t disk);  // the other replica of disk, or -1
+int super_isreplica (nvmeRaid* raid, uint8_t disk);  // a mirror, not in the stripe map
+// Where [start, end) goes from the stripes an expansion moved to the ones not moved yet, or end
+uint64_t super_getsplit (nvmeRaid* raid, uint64_t start, uint64_t end);
 
 #endif
\ No newline at end of file
@@ -5,6 +5,56 @@
 
 // Simpliest commands
 int sio_sectorSize (idisk* dsk);
+uint64_t sio_numSectors (idisk* dsk);
+
+// Disk set-up, with the spdk NVMe driver or with io_uring (O_DIRECT files or block devices)
+struct spdk_nvme_ctrlr;
+struct spdk_nvme_ns;
+int sio_initnvme (idisk* dsk, struct spdk_nvme_ctrlr* ctrlr, struct spdk_nvme_ns* ns);
+int sio_initfile (idisk* dsk, const char* path);
+int sio_initdisk (idisk* dsk);  // once the backend is set
+void sio_freedisk (idisk* dsk);  // its queues, with nothing pending, and its file
+void sio_setqdepth (nvmeRaid* raid, uint32_t qdepth);
+
+// Pinned buffers. They are kept per NUMA socket and recycled, allocating new ones only when
+// there is no free buffer big enough. sio_initbuffs sizes them from the raid geometry
+int sio_initbuffs (nvmeRaid* raid, int numbuffs);
+sioBuff* sio_getbuff (uint64_t size);
+void sio_putbuff (sioBuff* buff);
+void sio_freebuffs (void);
+
+// Per-thread queues. Queue 0 is created by sio_initdisk
+int sio_allocqueues (nvmeRaid* raid, int numqueues);
+void sio_setqueue (int qid);  // the calling thread will use queue qid of every disk
+
+// Async commands. If the disk queue is full, they wait for it to have room
+int sio_read_async (
+    idisk* dsk, void* payload, uint64_t lba, uint32_t lba_count, sio_cb cb, void* cbarg);
+int sio_write_async (
+    idisk* dsk, void* payload, uint64_t lba, uint32_t lba_count, sio_cb cb, void* cbarg);
+
+// Vectored read, the payload is described by the SGL callbacks (called with sglarg)
+int sio_readv_async (idisk* dsk,
+                     uint64_t lba,
+                     uint32_t lba_count,
+                     sio_sgl_reset sglreset,
+                     sio_sgl_next sglnext,
+                     void* sglarg,
+                     sio_cb cb,
+                     void* cbarg);
+
+// Tell the disk that the data is not needed anymore (deallocate, or write zeroes if it is not
+// supported). cb is called once per command, returns the number of commands
+int sio_deallocate_async (
+    idisk* dsk, uint64_t lba, uint64_t lba_count, sio_cb cb, void* cbarg);
+
+// The writes completed before it are durable when it completes (volatile write caches)
+int sio_flush_async (idisk* dsk, sio_cb cb, void* cbarg);
+
+// Process completions. Returns the number of completed tasks
+int sio_poll (idisk* dsk);
+// Wait until all the disk tasks finishes
+void sio_wait (idisk* dsk);
 
 // Works for pinned memory
 int sio_read (idisk* dsk, void* payload, uint64_t lba, uint32_t lba_count);
@@ -15,7 +65,15 @@ int sio_read_pinit (idisk* dsk, void* payload, uint64_t lba, uint32_t lba_count)
 int sio_write_pinit (idisk* dsk, void* payload, uint64_t lba, uint32_t lba_count);
 
 /* Raid writter */
-// Works for pinned memory
+// Works for pinned memory. cb is called once per command, returns the number of commands
+// (one per stripe, two per written stripe if the raid is mirrored). On errors, the commands
+// queued are done before it returns
+int sio_rread_async (
+    nvmeRaid* raid, void* payload, uint64_t lba, uint32_t lba_count, sio_cb cb, void* cbarg);
+int sio_rwrite_async (
+    nvmeRaid* raid, void* payload, uint64_t lba, uint32_t lba_count, sio_cb cb, void* cbarg);
+
+// Works for pinned memory. They wait for the request, 0 or its error
 int sio_rread (nvmeRaid* raid, void* payload, uint64_t lba, uint32_t lba_count);
 int sio_rwrite (nvmeRaid* raid, void* payload, uint64_t lba, uint32_t lba_count);
 
@@ -23,6 +81,17 @@ int sio_rwrite (nvmeRaid* raid, void* payload, uint64_t lba, uint32_t lba_count)
 int sio_rread_pinit (nvmeRaid* raid, void* payload, uint64_t lba, uint32_t lba_count);
 int sio_rwrite_pinit (nvmeRaid* raid, void* payload, uint64_t lba, uint32_t lba_count);
 
+// Of two replicas, the one with less tasks in flight in this thread queue. b may be NULL
+idisk* sio_replica (idisk* a, idisk* b);
+
+// Deallocate a raid range, all the disks in parallel. It waits for them
+int sio_rdeallocate (nvmeRaid* raid, uint64_t lba, uint64_t lba_count);
+
+// Flush every disk in parallel. It waits for them
+int sio_rflush (nvmeRaid* raid);
+
+// Process completions of every disk
+int sio_rpoll (nvmeRaid* raid);
 // Wait until all tasks finishes
 void sio_waittasks (nvmeRaid* raid);
 
@@ -0,0 +1,42 @@
+#ifndef __siobackend_h__
+#define __siobackend_h__
+
+#include <fs.h>
+
+// Storage backends below the simpleio engine. They only move data, simpleio keeps the tasks
+enum sioOp {
+	SIO_OP_READ = 0,
+	SIO_OP_WRITE,
+	SIO_OP_READV,
+	SIO_OP_DEALLOCATE,
+	SIO_OP_WRITEZEROES,
+	SIO_OP_FLUSH
+};
+
+#define SIO_F_DEALLOCATE 0x1
+#define SIO_F_WRITEZEROES 0x2
+
+typedef struct sioBackend {
+	const char* name;
+	uint32_t (*flags) (idisk* dsk);  // SIO_F_*
+	int (*newQueue) (idisk* dsk, sioQueue* q);
+	void (*freeQueue) (idisk* dsk, sioQueue* q);
+	// -ENOMEM when the backend has no room, it is retried after polling
+	int (*submit) (idisk* dsk,
+	               sioQueue* q,
+	               sioTask* t,
+	               enum sioOp op,
+	               void* payload,
+	               uint64_t lba,
+	               uint32_t lba_count);
+	int (*poll) (sioQueue* q);  // returns the number of completed tasks
+} sioBackend;
+
+// Called by the backends when a task finishes
+void sio_complete (sioTask* t, int error);
+
+// Disks of each backend. The engine queue 0 is created by sio_initdisk afterwards
+int sio_nvme_open (idisk* dsk, struct spdk_nvme_ctrlr* ctrlr, struct spdk_nvme_ns* ns);
+int sio_uring_open (idisk* dsk, const char* path);
+
+#endif
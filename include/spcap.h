@@ -3,18 +3,110 @@
 
 #include <common.h>
 #include <pcap.h>
+#include <stddef.h>
+#include <stream.h>
 
 #define spcap_ext ".scap"
 
-#define NUMBUFS 3
+// Blocks of each disk in flight while the next ones are filled
+#define SPCAPBUFS 2
+
+// Index of a capture, written after its data when it ends (metaFile indexBlock): the summary,
+// then an entry for each second with packets, with the bytes of every disk stream before it,
+// and then an entry for each block of the file (SPCAP_LAYOUT_BLOCKS)
+#define SPCAPINDEXMAGIC 0x7864697061637073lu  // "spcapidx"
+#define SPCAPINDEXINTERVAL 1000000000lu      // ns
+
+typedef struct __attribute__ ((__packed__)) {
+	uint64_t MAGIC;
+	uint64_t packets;
+	uint64_t bytes;      // on the wire
+	uint64_t stored;     // captured
+	uint64_t firstTime;  // ns since the epoch
+	uint64_t lastTime;
+	uint64_t peakRate;  // bytes on the wire in the busiest second
+	uint32_t entries;
+	uint32_t blocks;  // entries of the blocks, 0 if the file has none
+} spcap_stats;
+
+typedef struct __attribute__ ((__packed__)) {
+	uint64_t time;  // ns, of the first packet of the second
+	uint64_t offset[MAXDISKS];
+} spcap_index;
+
+typedef struct __attribute__ ((__packed__)) {
+	uint64_t time;    // of its first packet
+	uint64_t packet;  // number of its first packet in the file, from 0
+} spcap_blockidx;
+
+// Layout of the data (metaFile layout). Until SPCAP_LAYOUT_BLOCKS, each packet went to the disk
+// with less data for its weight, as a stream of its own in the extents of the file
+#define SPCAP_LAYOUT_STREAMS 0
+// The packets fill a stripe at a time, and the stripes go through the file in order, so they
+// follow the stripe map over the disks and the sequence of every block is known. Each stripe
+// starts with a block header, and a packet never spans two. After the data, every disk gets
+// an empty block
+#define SPCAP_LAYOUT_BLOCKS 1
+#define SPCAPBLOCKMAGIC 0x6B636F6C62706373lu  // "spcblock"
+// The header and each packet (with its header) start at a multiple of it, padded with zeros
+#define SPCAPALIGN 64
+#define SPCAPALIGNUP(length, align) ((align) > 1 ? ((length) + (align)-1) / (align) * (align) : (length))
+// Offset of the first packet of a block (the unaligned ones have no time)
+#define SPCAPFIRST(align) \
+	((align) > 1 ? SPCAPALIGNUP (sizeof (spcap_block), align) : offsetof (spcap_block, time))
+
+// Headers of the packets of a block (spcap_block format). SPCAP_FORMAT_FIXED is a spcap_header.
+// SPCAP_FORMAT_VARINT is a LEB128 varint of the length on the wire shifted left by one, with the
+// lowest bit set when the captured bytes are fewer and follow as another varint, and then the ns
+// since the previous packet of the block (or the time of the block), zigzag encoded
+#define SPCAP_FORMAT_FIXED 0
+#define SPCAP_FORMAT_VARINT 1
+#define SPCAPMAXHEADER 16
+
+typedef struct __attribute__ ((__packed__)) {
+	uint64_t MAGIC;
+	uint64_t seq;     // stripe of the file
+	uint32_t used;    // bytes, with this header and the padding. Only them in the empty blocks
+	uint16_t align;   // of the packets, 0 (none) in the blocks written before SPCAPALIGN
+	uint16_t format;  // of their headers
+	uint64_t time;    // ns since the epoch, of the first packet (SPCAP_FORMAT_VARINT)
+	uint32_t packets;  // of the block
+	uint32_t reserved;
+	uint64_t bytes;  // on the wire
+} spcap_block;
+
+// A block of the ring, free again when its commands are done
+typedef struct {
+	char* mem;
+	int cmds;  // submitted, -1 while submitting
+	int done;
+	int error;
+} spcap_buf;
 
 typedef struct {
 	nvmeRaid* raid;
 	metaFile* file;
-	char* buffs[MAXDISKS];
-	char* currPtr[MAXDISKS];
-	uint64_t curlba[MAXDISKS];
-	uint64_t dataWrote[MAXDISKS];
+	sioBuff* pinned;  // of the ring, NULL until it is allocated
+	spcap_buf* ring;
+	uint32_t numbufs;
+	uint32_t cur;  // the block being filled
+	uint32_t used;
+	uint64_t seq;
+	uint64_t lba;  // where it goes
+	uint8_t disk;
+	uint8_t full;  // no room left in the raid
+	uint64_t dataWrote[MAXDISKS];  // bytes of the blocks of each disk
+	uint64_t blockTime;  // of its first packet
+	uint64_t lastTime;   // of its last one
+	uint32_t blockPackets;
+	uint64_t blockBytes;
+	spcap_blockidx* blocks;  // of the blocks written, NULL once there is no memory for them
+	uint64_t maxBlocks;
+
+	spcap_stats stats;
+	spcap_index* index;
+	uint32_t maxIndex;
+	uint64_t secondBytes;
 } spcap;
 
 typedef struct {
@@ -23,21 +115,95 @@ typedef struct {
 	uint16_t esize;
 } spcap_header;
 
+// Reader. Each disk stream is read ahead (rstream_opendisk), and its packets are given in place
+#define SPCAPMAXPKT (SPCAPMAXHEADER + UINT16_MAX)
+
+typedef struct {
+	const void* data;  // valid until the next spcapRead
+	uint16_t len;      // on the wire
+	uint16_t caplen;   // bytes in data
+	uint32_t nsw8;     // of its header (SPCAP_FORMAT_FIXED)
+	uint64_t time;     // ns since the epoch, 0 if the capture has none
+	uint8_t disk;
+} spcap_pkt;
+
+typedef struct {
+	raidStream st;
+	uint64_t offset;    // consumed bytes since the oldest held stripe
+	uint32_t blockend;  // of the packets of the oldest one (blocks), 0 until its header is read
+	uint64_t seq;       // of the oldest one
+	uint16_t align;
+	uint16_t format;
+	uint64_t time;    // of the last packet read
+	uint64_t resync;  // time of the next packet, after a seek (its delta is not from time)
+	uint8_t finished;
+	char tail[SPCAPMAXPKT];  // a packet that wraps around the stripes, copied
+} spcap_disk;
+
+typedef struct {
+	nvmeRaid* raid;
+	metaFile* file;
+	spcap_disk* disk[MAXDISKS];
+	int next;       // disk of the next batch (streams)
+	uint64_t last;  // block where the reading ends (blocks)
+} spcapReader;
+
 /*Common*/
 int initSpcap (spcap* spcapf, nvmeRaid* raid, metaFile* file);
 void freeSpcap (spcap* spcapf);
 
-/*utils*/
-uint_fast16_t spcapDstDisk (spcap* spcapf);
-
 /*Write*/
 void flushBuffs (spcap* spcapf);
-void writeBuff (spcap* spcapf, uint_fast16_t diskid, uint_fast16_t size, void* payload);
+void writeBuff (spcap* spcapf, uint_fast16_t size, void* payload);
+// time in ns since the epoch
 void writePkt (
-    spcap* spcapf, uint_fast32_t nsw8, uint_fast16_t size, uint_fast16_t esize, void* payload);
+    spcap* spcapf, uint64_t time, uint_fast16_t size, uint_fast16_t esize, void* payload);
+// hdr->ts in us, as libpcap gives them by default
 void writePCAPPkt (spcap* spcapf, struct pcap_pkthdr* hdr, void* payload);
+// pcap (us or ns) and pcapng files, with their timestamps in ns
 void writePCAP2raid (spcap* spcapf, char* filename);
 
 /*Read*/
+// From the beginning, or from an entry of the index (spcapSeek)
+int spcapOpen (spcapReader* reader, nvmeRaid* raid, metaFile* file, const spcap_index* start);
+void spcapClose (spcapReader* reader);
+// Up to max packets of one block, in the order they were written (or, in the streams layout,
+// of one disk stream, each batch the next one), waiting for their stripes. 0 at the end of the
+// file, -1 on errors
+int spcapRead (spcapReader* reader, spcap_pkt* pkts, int max);
+// Header of a packet of a block, in the length bytes at p. Its bytes, 0 if it is broken. time
+// goes from the one of the previous packet of the block (or the block) to the one of the packet
+uint_fast8_t spcapParse (
+    const void* p, uint32_t length, uint16_t format, uint64_t* time, spcap_pkt* pkt);
+// Where the packets of a block end (its used), 0 if it is not a block with packets that fits in
+// a stripe of length bytes, as the empty blocks after the capture
+uint32_t spcapBlockEnd (const spcap_block* block, uint64_t length);
+// Only the blocks [first, last) of the file, so several readers can share it
+int spcapOpenBlocks (
+    spcapReader* reader, nvmeRaid* raid, metaFile* file, uint64_t first, uint64_t last);
+// The block with the packet number value (packet set), or the last one with its first packet at
+// or before time value, and its entry. -1 if the file has no index of its blocks
+int spcapSeekBlock (nvmeRaid* raid,
+                    metaFile* file,
+                    uint64_t value,
+                    int packet,
+                    uint64_t* seq,
+                    spcap_blockidx* entry);
+// Where every disk stream starts block seq, as an entry of the index (spcapOpen)
+int spcapBlockStart (nvmeRaid* raid, metaFile* file, uint64_t seq, spcap_index* start);
+// The summary of a capture, -1 if it has no index
+int spcapStats (nvmeRaid* raid, metaFile* file, spcap_stats* stats);
+// The last entry of the index at or before time (ns), or the first one. O(log n) sector reads
+int spcapSeek (nvmeRaid* raid, metaFile* file, uint64_t time, spcap_index* entry);
+// Where the byte offset of the stream of disk is: its extent *n, the disk lbas [*first, *last)
+// from the stripe with it, and the bytes of that stripe before it
+int spcapDiskOffset (nvmeRaid* raid,
+                     metaFile* file,
+                     uint8_t disk,
+                     uint64_t offset,
+                     int* n,
+                     uint64_t* first,
+                     uint64_t* last,
+                     uint32_t* skip);
 
 #endif
\ No newline at end of file
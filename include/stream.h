@@ -0,0 +1,50 @@
+#ifndef __stream_h__
+#define __stream_h__
+
+#include <fs.h>
+
+// Sequential reader of raid files, keeping a window of stripes in flight on every disk
+#define RSTREAM_DEFAULTWINDOW 4  // stripes per disk
+#define RSTREAM_MAXWINDOW 16
+
+typedef struct {
+	char* data;
+	uint32_t length;  // bytes
+	uint64_t lba;     // raid lba of the first sector
+	volatile uint8_t ready;
+	uint8_t error;
+} rstreamSlot;
+
+typedef struct {
+	nvmeRaid* raid;
+	sioBuff* pinned;
+	rstreamSlot slot[RSTREAM_MAXWINDOW * MAXDISKS];
+	uint32_t numslots;
+	uint32_t head;      // oldest slot not released
+	uint32_t held;      // slots returned by rstream_next and not released
+	uint32_t inflight;  // slots submitted after the held ones
+	uint64_t nextlba;
+	uint64_t endlba;
+	metaFile* file;  // its extents, one after the other (rstream_open)
+	int extent;
+	int disk;  // the stream of that disk only (rstream_opendisk), -1 for the raid
+	int error;
+} raidStream;
+
+int rstream_open (raidStream* st, nvmeRaid* raid, metaFile* file, uint32_t window);
+int rstream_openrange (
+    raidStream* st, nvmeRaid* raid, uint64_t startlba, uint64_t endlba, uint32_t window);
+// The stripes of the file in one disk, as spcap writes them (fileDiskExtent), after the first
+// skip ones. Each slot is a whole stripe, right after the one before in memory (except the last)
+int rstream_opendisk (
+    raidStream* st, nvmeRaid* raid, metaFile* file, uint8_t disk, uint64_t skip, uint32_t window);
+void rstream_close (raidStream* st);
+
+// Next stripe of the file, waiting for it if needed. NULL at the end or on errors
+rstreamSlot* rstream_next (raidStream* st);
+// Non blocking version: NULL if the next stripe is not ready yet
+rstreamSlot* rstream_trynext (raidStream* st);
+// The oldest slot got with rstream_next can be reused
+void rstream_release (raidStream* st);
+
+#endif
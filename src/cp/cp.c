@@ -22,15 +22,22 @@ static void app_usage (void) {
 	    "Available options are:\n"
 	    "--help : To show this help info\n"
 	    "--nscap : Interpretate the file as a NVME-SPDK-PCAP / PCAP.\n"
-	    "--from-sys  [filename]: Specifies the origin file from the system\n"
+	    "--from-sys  [filename]: Specifies the origin file from the system, - for the standard input\n"
 	    "--from-raid [filename]: Specifies the origin file from the NVME-RAID-FS\n"
 	    "--to-sys    [filename]: Specifies the destination file to the system\n"
-	    "--to-raid   [filename]: Specifies the destination file to the NVME-RAID-FS\n",
-	    "cp");
+	    "--to-raid   [filename]: Specifies the destination file to the NVME-RAID-FS\n"
+	    "--qdepth    [number]  : Maximum in-flight requests per NVME (default %d)\n"
+	    "--seek      [seconds] : With --nscap --from-raid, starts that far into the capture\n"
+	    "--seek-packet [n]     : With --nscap --from-raid, starts at its nth packet\n",
+	    "cp",
+	    SIO_DEFAULTQDEPTH);
 }
 
 int ffrom_sys = 0, ffrom_raid = 0, fto_sys = 0, fto_raid = 0, fpcap = 0;
 char *cfrom_sys = NULL, *cfrom_raid = NULL, *cto_sys = NULL, *cto_raid = NULL;
+uint32_t qdepth = SIO_DEFAULTQDEPTH;
+int fseek_time = 0, fseek_packet = 0;
+uint64_t cseek_time = 0, cseek_packet = 0;  // ns from the start, packet number from 1
 
 static void app_paramCheck (void) {
 	int stopExecution = 0;
@@ -70,6 +77,10 @@ static void app_paramCheck (void) {
 		printf ("PARAM-ERROR: 2 destinations provided\n");
 		stopExecution = 1;
 	}
+	if ((fseek_time || fseek_packet) && !(fpcap && ffrom_raid)) {
+		printf ("PARAM-ERROR: Only the packets of a capture copied from the raid can seek\n");
+		stopExecution = 1;
+	}
 
 	if (stopExecution) {
 		printf ("\n");
@@ -89,11 +100,14 @@ void app_config (int argc, char **argv, struct spdk_env_opts *conf) {
 		                                       {"from-raid", required_argument, 0, 'f'},
 		                                       {"to-sys", required_argument, 0, 's'},
 		                                       {"to-raid", required_argument, 0, 't'},
+		                                       {"qdepth", required_argument, 0, 'q'},
+		                                       {"seek", required_argument, 0, 'k'},
+		                                       {"seek-packet", required_argument, 0, 'n'},
 		                                       {0, 0, 0, 0}};
 		/* getopt_long stores the option index here. */
 		int option_index = 0;
 
-		c = getopt_long (argc, argv, "hps:t:y:f:", long_options, &option_index);
+		c = getopt_long (argc, argv, "hps:t:y:f:q:k:n:", long_options, &option_index);
 
 		/* Detect the end of the options. */
 		if (c == -1)
@@ -118,8 +132,8 @@ void app_config (int argc, char **argv, struct spdk_env_opts *conf) {
 			case 'f':  // from-raid
 				ffrom_raid = 1;
 				cfrom_raid = strdup (optarg);
-				if (strlen (cfrom_raid) > FILENAME_MAX) {
-					printf ("The raid's filename is too long, limited to %d chars\n", FILENAME_MAX);
+				if (strlen (cfrom_raid) > NAMELENGTH) {
+					printf ("The raid's filename is too long, limited to %d chars\n", NAMELENGTH);
 					exit (-1);
 				}
 				break;
@@ -132,8 +146,16 @@ void app_config (int argc, char **argv, struct spdk_env_opts *conf) {
 			case 't':  // to-raid
 				fto_raid = 1;
 				cto_raid = strdup (optarg);
-				if (strlen (cto_raid) > FILENAME_MAX) {
-					printf ("The raid's filename is too long, limited to %d chars\n", FILENAME_MAX);
+				if (strlen (cto_raid) > NAMELENGTH) {
+					printf ("The raid's filename is too long, limited to %d chars\n", NAMELENGTH);
+					exit (-1);
+				}
+				break;
+
+			case 'q':  // qdepth
+				qdepth = strtoul (optarg, NULL, 0);
+				if (qdepth == 0 || qdepth > SIO_MAXQDEPTH) {
+					printf ("The queue depth must be between 1 and %d\n", SIO_MAXQDEPTH);
 					exit (-1);
 				}
 				break;
@@ -142,6 +164,20 @@ void app_config (int argc, char **argv, struct spdk_env_opts *conf) {
 				fpcap = 1;
 				break;
 
+			case 'k':  // seek
+				fseek_time = 1;
+				cseek_time = strtod (optarg, NULL) * 1e9;
+				break;
+
+			case 'n':  // seek-packet
+				fseek_packet = 1;
+				cseek_packet = strtoull (optarg, NULL, 0);
+				if (cseek_packet == 0) {
+					printf ("The packets are numbered from 1\n");
+					exit (-1);
+				}
+				break;
+
 			case 'h':
 			case '?':
 			default:
@@ -153,14 +189,274 @@ void app_config (int argc, char **argv, struct spdk_env_opts *conf) {
 	return;
 }
 void app_init (nvmeRaid *raid) {
-	UNUSED (raid);
+	sio_setqdepth (raid, qdepth);
 	return;
 }
+
+// Copies blocks between memory and the file, extent by extent
+static int cp_blocks (nvmeRaid *raid, metaFile *file, void *map, uint64_t blocks, int write) {
+	uint64_t offset = 0, lba, count;
+
+	while (offset < blocks) {
+		if (fileMap (raid, file, offset, &lba, &count)) {
+			return -1;
+		}
+		if (count > blocks - offset) {
+			count = blocks - offset;
+		}
+		if (write ? sio_rwrite_pinit (raid, map + offset * SECTORLENGTH, lba, count)
+		          : sio_rread_pinit (raid, map + offset * SECTORLENGTH, lba, count)) {
+			return -1;
+		}
+		offset += count;
+	}
+	return 0;
+}
+static void cp_complete (void *arg, int error) {
+	if (error) {
+		*(int *)arg = -1;
+	}
+}
+
+// A buffer of the stream, free again when its commands are done
+typedef struct {
+	sioBuff *buff;
+	int cmds;  // submitted, -1 while submitting
+	int done;
+	int error;
+} cpChunk;
+
+static void cp_chunk_complete (void *arg, int error) {
+	cpChunk *c = (cpChunk *)arg;
+
+	if (error) {
+		c->error = 1;
+	}
+	c->done++;
+}
+
+static int cp_chunk_wait (nvmeRaid *raid, cpChunk *c) {
+	while (c->done != c->cmds) {
+		sio_rpoll (raid);
+	}
+	return c->error ? -1 : 0;
+}
+
+// Queues the blocks of the chunk at offset of the file
+static int cp_chunk_write (
+    nvmeRaid *raid, metaFile *file, cpChunk *c, uint64_t offset, uint64_t blocks) {
+	uint64_t done, lba, count;
+	int rc, cmds = 0;
+
+	c->cmds  = -1;
+	c->done  = 0;
+	c->error = 0;
+	for (done = 0; done < blocks; done += count) {
+		if (fileMap (raid, file, offset + done, &lba, &count)) {
+			break;
+		}
+		if (count > blocks - done) {
+			count = blocks - done;
+		}
+		rc = sio_rwrite_async (raid,
+		                       (char *)c->buff->mem + done * SECTORLENGTH,
+		                       lba,
+		                       count,
+		                       cp_chunk_complete,
+		                       c);
+		if (rc < 0) {
+			break;
+		}
+		cmds += rc;
+	}
+	if (done < blocks) {
+		// wait for the commands already queued before the buffer is used again
+		sio_waittasks (raid);
+		c->cmds = c->done;
+		return -1;
+	}
+	c->cmds = cmds;
+	return 0;
+}
+
+// Copies a stream of unknown length (a pipe, a live capture) into the file, which grows as the
+// data comes. The blocks it reserved and did not use are free again at the end. The next
+// buffers are read while the ones before are written
+static int cp_stream (nvmeRaid *raid, metaFile *file, FILE *f) {
+	cpChunk chunk[SIO_PIPEBUFFS];
+	uint64_t offset = 0, blocks;
+	uint32_t next = 0, i;
+	size_t got;
+	int error = 0;
+
+	for (i = 0; i < SIO_PIPEBUFFS; i++) {
+		chunk[i].buff = sio_getbuff (GIGASECTORLENGTH);
+		chunk[i].cmds = chunk[i].done = chunk[i].error = 0;
+		if (chunk[i].buff == NULL) {
+			printf ("Not enough pinned memory\n");
+			while (i--) {
+				sio_putbuff (chunk[i].buff);
+			}
+			return -1;
+		}
+	}
+	while (!error) {
+		cpChunk *c = &chunk[next++ % SIO_PIPEBUFFS];
+
+		// its last write, before it is filled again
+		if (cp_chunk_wait (raid, c)) {
+			error = -1;
+			break;
+		}
+		got = fread (c->buff->mem, 1, GIGASECTORLENGTH, f);
+		if (got == 0) {
+			break;
+		}
+		blocks = (got + SECTORLENGTH - 1) / SECTORLENGTH;
+		memset ((char *)c->buff->mem + got, 0, blocks * SECTORLENGTH - got);  // padding
+
+		while (!error && fileBlocks (raid, file) < offset + blocks) {
+			if (growFile (raid, file, GROWLENGTH / SECTORLENGTH)) {
+				printf ("The raid has no room left for the file\n");
+				error = -1;
+			}
+		}
+		if (!error && cp_chunk_write (raid, file, c, offset, blocks)) {
+			error = -1;
+		}
+		if (!error) {
+			offset += blocks;
+		}
+	}
+	sio_waittasks (raid);
+	for (i = 0; i < SIO_PIPEBUFFS; i++) {
+		if (chunk[i].error) {
+			error = -1;
+		}
+		sio_putbuff (chunk[i].buff);
+	}
+
+	printf ("%lu sectors copied into raid\n", offset);
+	if (truncFile (raid, file, offset)) {
+		error = -1;
+	}
+	return error;
+}
+
+// Opens the reader at the block of the packet or the time to seek (the index of the blocks gives
+// it), and the packets of the block before them
+static int cp_seek (
+    nvmeRaid *raid, metaFile *file, spcapReader *reader, uint64_t *skip, uint64_t *from) {
+	spcap_blockidx block;
+	spcap_stats stats;
+	uint64_t seq;
+
+	*skip = *from = 0;
+	if (!fseek_time && !fseek_packet) {
+		return spcapOpen (reader, raid, file, NULL);
+	}
+	if (fseek_packet) {
+		if (spcapSeekBlock (raid, file, cseek_packet - 1, 1, &seq, &block)) {
+			printf ("The file has no index of its blocks\n");
+			return -1;
+		}
+		*skip = cseek_packet - 1 - block.packet;
+	} else {
+		if (spcapStats (raid, file, &stats) ||
+		    spcapSeekBlock (raid, file, stats.firstTime + cseek_time, 0, &seq, &block)) {
+			printf ("The file has no index of its blocks\n");
+			return -1;
+		}
+		*from = stats.firstTime + cseek_time;
+	}
+	return spcapOpenBlocks (reader, raid, file, seq, UINT64_MAX);
+}
+
+// Writes the packets of a capture as a PCAP file, with ns timestamps
+static int cp_topcap (nvmeRaid *raid, metaFile *file, const char *name) {
+	spcap_pkt pkts[256];
+	spcapReader reader;
+	pcap_dumper_t *dumper;
+	uint64_t packets = 0, skip, from;
+	pcap_t *pcap;
+	int n, i;
+
+	pcap = pcap_open_dead_with_tstamp_precision (DLT_EN10MB, UINT16_MAX, PCAP_TSTAMP_PRECISION_NANO);
+	if (pcap == NULL) {
+		return -1;
+	}
+	dumper = pcap_dump_open (pcap, name);
+	if (dumper == NULL) {
+		printf ("Cant open %s for write: %s\n", name, pcap_geterr (pcap));
+		pcap_close (pcap);
+		return -1;
+	}
+	if (cp_seek (raid, file, &reader, &skip, &from)) {
+		pcap_dump_close (dumper);
+		pcap_close (pcap);
+		return -1;
+	}
+
+	while ((n = spcapRead (&reader, pkts, 256)) > 0) {
+		for (i = 0; i < n; i++) {
+			struct pcap_pkthdr header = {.caplen = pkts[i].caplen, .len = pkts[i].len};
+
+			// in the block seeked, before its packet
+			if (skip) {
+				skip--;
+				continue;
+			}
+			if (pkts[i].time < from) {
+				continue;
+			}
+			from = 0;  // every packet after the first one
+
+			header.ts.tv_sec  = pkts[i].time / 1000000000lu;
+			header.ts.tv_usec = pkts[i].time % 1000000000lu;  // ns, for this precision
+			pcap_dump ((u_char *)dumper, &header, pkts[i].data);
+			packets++;
+		}
+	}
+	spcapClose (&reader);
+	pcap_dump_close (dumper);
+	pcap_close (pcap);
+
+	printf ("%lu packets copied from raid\n", packets);
+	return n;
+}
+
 void app_run (nvmeRaid *raid) {
 	uint64_t origin_size;
 	uint64_t origin_size_blks;
 	metaFile *raid_file;
-	if (ffrom_sys && fto_raid) {
+	if (ffrom_sys && fto_raid && !strcmp (cfrom_sys, "-")) {
+		// a stream, the file grows with it
+		if (findFile (raid, cto_raid)) {
+			printf ("The file %s already exists in the raid\n", cto_raid);
+			return;
+		}
+		raid_file = addFile (raid, cto_raid, 0);
+		if (!raid_file) {
+			printf ("Can not allocate a new file in the NVMe-raid\n");
+			return;
+		}
+
+		if (fpcap) {
+			spcap sp;
+
+			printf ("Copying PCAP stream into raid...\n");
+			if (initSpcap (&sp, raid, raid_file)) {
+				printf ("error starting spcap-lib\n");
+				delFile (raid, cto_raid);
+				return;
+			}
+			writePCAP2raid (&sp, cfrom_sys);  // libpcap reads - as the standard input
+			freeSpcap (&sp);
+		} else if (cp_stream (raid, raid_file, stdin)) {
+			printf ("Error writing the stream into raid\n");
+		}
+
+	} else if (ffrom_sys && fto_raid) {
 		// check if origin file exists
 		FILE *f = fopen (cfrom_sys, "r");
 		if (f == NULL) {
@@ -171,19 +467,19 @@ void app_run (nvmeRaid *raid) {
 		origin_size = ftell (f);
 		fseek (f, 0L, SEEK_SET);  // = rewind
 
-		origin_size_blks = origin_size / METASECTORLENGTH;
-		if (origin_size % METASECTORLENGTH != 0) {
+		origin_size_blks = origin_size / SECTORLENGTH;
+		if (origin_size % SECTORLENGTH != 0) {
 			origin_size_blks++;
 			printf ("The file %s is not alligned with sectorsize (%lu), padding may be added\n",
 			        cfrom_sys,
-			        METASECTORLENGTH);
+			        SECTORLENGTH);
 		}
 
 		// check if file exists in the raid
 		raid_file = findFile (raid, cto_raid);
 		if (raid_file) {  // file exists
-			uint64_t fsize = raid_file->endBlock - raid_file->startBlock;
-			fsize *= METASECTORLENGTH;
+			uint64_t fsize = fileBlocks (raid, raid_file);
+			fsize *= SECTORLENGTH;
 
 			// check if new file is smaller or greater than newer one
 			if (origin_size > fsize) {
@@ -198,14 +494,25 @@ void app_run (nvmeRaid *raid) {
 				printf ("Cannot overwrite pcap-file\n");
 				return;
 			}
-			// update file length
-			raid_file->endBlock = raid_file->startBlock + origin_size_blks;
-			updateRaid (raid);
+			// update file length, and the old data is not needed: the disks can forget it
+			// before being overwritten. Its index (if it was a capture) neither. One commit
+			beginUpdate (raid);
+			setFileIndex (raid, raid_file, 0, 0);
+			setFileLayout (raid, raid_file, 0);
+			if (truncFile (raid, raid_file, origin_size_blks)) {
+				printf ("Error truncating the old file\n");
+			}
+			endUpdate (raid);
+			if (raid->pending || deallocFile (raid, raid_file)) {
+				printf ("Error deallocating the old file\n");
+			}
 
 		} else {  // file does not exists
 			raid_file = addFile (raid, cto_raid, origin_size_blks);
 			if (!raid_file) {
 				printf ("Can not allocate a new file in the NVMe-raid\n");
+				fclose (f);
+				return;
 			}
 		}
 
@@ -214,17 +521,35 @@ void app_run (nvmeRaid *raid) {
 			void *map = mmap (NULL, origin_size, PROT_READ, MAP_PRIVATE, fd, 0);
 
 			printf ("Copying %lu sectors into raid...\n", origin_size_blks);
-			if (origin_size % METASECTORLENGTH != 0) {
+			if (origin_size % SECTORLENGTH != 0) {
 				origin_size_blks--;
-				void *padding = spdk_zmalloc (SECTORLENGTH, SECTORLENGTH, NULL);
-				memcpy (padding,
+				sioBuff *padding = sio_getbuff (SECTORLENGTH);
+				if (padding == NULL) {
+					printf ("Not enough pinned memory\n");
+					return;
+				}
+				memset (padding->mem, 0, SECTORLENGTH);
+				memcpy (padding->mem,
 				        map + origin_size_blks * SECTORLENGTH,
 				        origin_size - origin_size_blks * SECTORLENGTH);
-				sio_rwrite (raid, padding, raid_file->startBlock + origin_size_blks, 1);
+				uint64_t lba, count;
+				int error = 0;
+				if (fileMap (raid, raid_file, origin_size_blks, &lba, &count) ||
+				    sio_rwrite_async (raid, padding->mem, lba, 1, cp_complete, &error) < 0) {
+					error = -1;
+				}
+				sio_waittasks (raid);
+				sio_putbuff (padding);
+				if (error) {
+					printf ("Error writing the file into raid\n");
+					munmap (map, origin_size);
+					fclose (f);
+					return;
+				}
 			}
 
-			if (origin_size_blks) {  // only call if there are blocks to write.
-				sio_rwrite_pinit (raid, map, raid_file->startBlock, origin_size_blks);
+			if (cp_blocks (raid, raid_file, map, origin_size_blks, 1)) {
+				printf ("Error writing the file into raid\n");
 			}
 
 			munmap (map, origin_size);
@@ -233,11 +558,12 @@ void app_run (nvmeRaid *raid) {
 
 		if (fpcap) {  // if pcap file
 			spcap sp;
-			raid_file->endBlock = raid_file->startBlock;
 
 			printf ("Copying PCAP into raid...\n");
 			if (initSpcap (&sp, raid, raid_file)) {
 				printf ("error starting spcap-lib\n");
+				delFile (raid, cto_raid);  // a new one, the existing ones are not overwritten
+				return;
 			}
 			writePCAP2raid (&sp, cfrom_sys);
 			freeSpcap (&sp);
@@ -247,7 +573,7 @@ void app_run (nvmeRaid *raid) {
 		// check if origin file exists
 		raid_file = findFile (raid, cfrom_raid);
 		if (raid_file) {  // file exists
-			origin_size_blks = raid_file->endBlock - raid_file->startBlock;
+			origin_size_blks = fileBlocks (raid, raid_file);
 			origin_size      = origin_size_blks * SECTORLENGTH;
 
 		} else {  // file does not exists
@@ -255,6 +581,14 @@ void app_run (nvmeRaid *raid) {
 			return;
 		}
 
+		if (fpcap) {  // its packets
+			printf ("Copying PCAP from raid...\n");
+			if (cp_topcap (raid, raid_file, cto_sys)) {
+				printf ("Error reading the PCAP from raid\n");
+			}
+			return;
+		}
+
 		FILE *f = fopen (cto_sys, "w+");
 		if (f == NULL) {
 			printf ("Cant open %s for write\n", cto_sys);
@@ -271,7 +605,9 @@ void app_run (nvmeRaid *raid) {
 		void *map = mmap (NULL, origin_size, PROT_WRITE, MAP_SHARED, fd, 0);
 
 		printf ("Copying %lu sectors from raid...\n", origin_size_blks);
-		sio_rread_pinit (raid, map, raid_file->startBlock, origin_size_blks);
+		if (cp_blocks (raid, raid_file, map, origin_size_blks, 0)) {
+			printf ("Error reading the file from raid\n");
+		}
 
 		munmap (map, origin_size);
 		fclose (f);
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <rte_config.h>
+#include <rte_eal.h>
+
+#include "spdk/nvme.h"
+#include "spdk/env.h"
+
+#include <common.h>
+
+static void app_usage (void) {
+	printf (
+	    "This is a NVME-DPDK-PCAPReplay %s tool\n"
+	    "\n"
+	    "This tool adds the attached drives without meta-data to the raid, and moves its files\n"
+	    "to the new stripe map. If it is interrupted, run it again to continue. Meanwhile the\n"
+	    "files can be used, but not captured or replayed\n"
+	    "\n"
+	    "Available options are:\n"
+	    "--weights <w0,w1,...> : Stripes of each new drive per stripe-map cycle (1 to %d).\n"
+	    "          By default, the smallest one of the raid\n"
+	    "--rate <MB/s> : Limit the moved data per second (default 0, unlimited)\n"
+	    "--help : To show this help info\n",
+	    "expand",
+	    MAXWEIGHT);
+}
+
+uint64_t rate = 0;
+int nweights  = 0;
+uint8_t weights[MAXDISKS];
+
+static int parse_weights (const char *arg) {
+	char *end;
+
+	for (nweights = 0; *arg && nweights < MAXDISKS; nweights++) {
+		unsigned long w = strtoul (arg, &end, 10);
+		if (end == arg || w == 0 || w > MAXWEIGHT) {
+			return -1;
+		}
+		weights[nweights] = w;
+		arg               = *end == ',' ? end + 1 : end;
+	}
+	return *arg ? -1 : 0;
+}
+
+void app_config (int argc, char **argv, struct spdk_env_opts *conf) {
+	UNUSED (conf);
+
+	int c;
+	while (1) {
+		static struct option long_options[] = {{"help", no_argument, 0, 'h'},
+		                                       {"weights", required_argument, 0, 'W'},
+		                                       {"rate", required_argument, 0, 'r'},
+		                                       {0, 0, 0, 0}};
+		/* getopt_long stores the option index here. */
+		int option_index = 0;
+
+		c = getopt_long (argc, argv, "hW:r:", long_options, &option_index);
+
+		/* Detect the end of the options. */
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 'W':
+				if (parse_weights (optarg)) {
+					printf ("Invalid weights: %s\n", optarg);
+					app_usage ();
+					exit (1);
+				}
+				break;
+
+			case 'r':
+				rate = strtoul (optarg, NULL, 10);
+				break;
+
+			case 'h':
+			case '?':
+			default:
+				app_usage ();
+				exit (1);
+		}
+	}
+	return;
+}
+void app_init (nvmeRaid *raid) {
+	// the new drives join before the raid is loaded
+	expandRaid (raid, weights, nweights);
+	return;
+}
+void app_run (nvmeRaid *raid) {
+	printf ("Moving the files of the raid (%lu free blocks)...\n", blocksLeft (raid));
+	if (reshapeRaid (raid, rate)) {
+		printf ("ERROR, run it again to continue\n");
+		return;
+	}
+	printf ("The raid has %lu blocks\n", raid->totalBlocks);
+	return;
+}
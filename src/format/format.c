@@ -6,6 +6,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <time.h>
 
 #include <rte_config.h>
 #include <rte_eal.h>
@@ -19,16 +20,57 @@ static void app_usage (void) {
 	printf (
 	    "This is a NVME-DPDK-PCAPReplay %s tool\n"
 	    "\n"
-	    "This tool will erase all the raid contents by overwritting sector 0\n",
-	    "format");
+	    "This tool will erase all the raid contents by overwritting sector 0\n"
+	    "\n"
+	    "Available options are:\n"
+	    "--stripe <KB> : Stripe size, a power of 2 from %lu to %lu (default %lu)\n"
+	    "--sweep : Measure every stripe size on the attached drives and use the fastest one.\n"
+	    "          Then, weigh the stripe map with the bandwidth of each drive.\n"
+	    "          It overwrites the beginning of every drive\n"
+	    "--weights <w0,w1,...> : Stripes of each drive per stripe-map cycle (1 to %d).\n"
+	    "          By default, they are proportional to the capacity of each drive\n"
+	    "--mirror : RAID-10, every stripe is kept in two drives (0 and 1, 2 and 3...).\n"
+	    "          Half the capacity, reads are balanced between both copies\n"
+	    "--help : To show this help info\n",
+	    "format",
+	    MINSTRIPELENGTH / 1024,
+	    MAXSTRIPELENGTH / 1024,
+	    DEFAULTSTRIPELENGTH / 1024,
+	    MAXWEIGHT);
 }
 
-int ffrom_sys = 0, ffrom_raid = 0, fto_sys = 0, fto_raid = 0, fpcap = 0;
-char *cfrom_sys = NULL, *cfrom_raid = NULL, *cto_sys = NULL, *cto_raid = NULL;
+uint64_t stripeLength = DEFAULTSTRIPELENGTH;
+int fsweep            = 0;
+int fmirror           = 0;
+int nweights          = 0;
+uint8_t weights[MAXDISKS];
+
+static int parse_weights (const char *arg) {
+	char *end;
+
+	for (nweights = 0; *arg && nweights < MAXDISKS; nweights++) {
+		unsigned long w = strtoul (arg, &end, 10);
+		if (end == arg || w == 0 || w > MAXWEIGHT) {
+			return -1;
+		}
+		weights[nweights] = w;
+		arg               = *end == ',' ? end + 1 : end;
+	}
+	return *arg ? -1 : 0;
+}
 
 static void app_paramCheck (void) {
 	int stopExecution = 0;
 
+	if (!checkStripeLength (stripeLength)) {
+		printf ("Invalid stripe size: %lu KB\n", stripeLength / 1024);
+		stopExecution = 1;
+	}
+	if (fsweep && nweights) {
+		printf ("--sweep and --weights can't be used together\n");
+		stopExecution = 1;
+	}
+
 	if (stopExecution) {
 		printf ("\n");
 		app_usage ();
@@ -41,11 +83,16 @@ void app_config (int argc, char **argv, struct spdk_env_opts *conf) {
 	
 	int c;
 	while (1) {
-		static struct option long_options[] = {{"help", no_argument, 0, 'h'}, {0, 0, 0, 0}};
+		static struct option long_options[] = {{"help", no_argument, 0, 'h'},
+		                                       {"stripe", required_argument, 0, 's'},
+		                                       {"sweep", no_argument, 0, 'w'},
+		                                       {"weights", required_argument, 0, 'W'},
+		                                       {"mirror", no_argument, 0, 'm'},
+		                                       {0, 0, 0, 0}};
 		/* getopt_long stores the option index here. */
 		int option_index = 0;
 
-		c = getopt_long (argc, argv, "hps:t:y:f:", long_options, &option_index);
+		c = getopt_long (argc, argv, "hs:wW:m", long_options, &option_index);
 
 		/* Detect the end of the options. */
 		if (c == -1)
@@ -62,6 +109,26 @@ void app_config (int argc, char **argv, struct spdk_env_opts *conf) {
 				printf ("\n");
 				break;
 
+			case 's':
+				stripeLength = strtoul (optarg, NULL, 10) * 1024;
+				break;
+
+			case 'w':
+				fsweep = 1;
+				break;
+
+			case 'm':
+				fmirror = 1;
+				break;
+
+			case 'W':
+				if (parse_weights (optarg)) {
+					printf ("Invalid weights: %s\n", optarg);
+					app_usage ();
+					exit (1);
+				}
+				break;
+
 			case 'h':
 			case '?':
 			default:
@@ -72,9 +139,164 @@ void app_config (int argc, char **argv, struct spdk_env_opts *conf) {
 	app_paramCheck ();
 	return;
 }
+/* Stripe size sweep */
+#define SWEEP_BYTES (256lu * 1024lu * 1024lu)  // per disk and stripe size
+#define SWEEP_STARTLBA (MAXSTRIPELENGTH / SECTORLENGTH)
+
+static void sweep_complete (void *arg, int error) {
+	if (error) {
+		*(int *)arg = 1;
+	}
+}
+
+static double sweep_elapsed (struct timespec *start) {
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Bandwidth (MB/s) moving SWEEP_BYTES per disk in transfers of length bytes.
+// Of the whole raid, or of a single disk if disk >= 0
+static double sweep_run (nvmeRaid *raid, sioBuff *buff, uint64_t length, int write, int disk) {
+	int first = disk < 0 ? 0 : disk, last = disk < 0 ? raid->numdisks : disk + 1;
+	uint64_t count = length / SECTORLENGTH, n = SWEEP_BYTES / length, k;
+	struct timespec start;
+	int i, error = 0;
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	// every disk gets one request at a time, so all of them stay busy
+	for (k = 0; k < n && !error; k++) {
+		for (i = first; i < last; i++) {
+			int rc;
+			if (write) {
+				rc = sio_write_async (&raid->disk[i],
+				                      buff->mem,
+				                      SWEEP_STARTLBA + k * count,
+				                      count,
+				                      sweep_complete,
+				                      &error);
+			} else {
+				rc = sio_read_async (&raid->disk[i],
+				                     buff->mem,
+				                     SWEEP_STARTLBA + k * count,
+				                     count,
+				                     sweep_complete,
+				                     &error);
+			}
+			if (rc) {
+				error = 1;
+				break;
+			}
+		}
+	}
+	sio_waittasks (raid);
+
+	if (error) {
+		return 0;
+	}
+	return (double)(n * length * (last - first)) / sweep_elapsed (&start) / 1e6;
+}
+
+static uint64_t sweep (nvmeRaid *raid) {
+	uint64_t length, best = DEFAULTSTRIPELENGTH;
+	double bestbw = 0;
+	sioBuff *buff;
+	int i;
+
+	for (i = 0; i < raid->numdisks; i++) {
+		if (sio_numSectors (&raid->disk[i]) <
+		    SWEEP_STARTLBA + SWEEP_BYTES / SECTORLENGTH) {
+			printf ("Disk %d is too small for the sweep\n", i);
+			return best;
+		}
+	}
+
+	buff = sio_getbuff (MAXSTRIPELENGTH);
+	if (buff == NULL) {
+		puts ("Not enough pinned memory for the sweep");
+		exit (-1);
+	}
+	memset (buff->mem, 0, MAXSTRIPELENGTH);
+
+	printf ("Measuring %d disks (%lu MB per disk and size)\n", raid->numdisks, SWEEP_BYTES >> 20);
+	printf ("%10s %12s %12s\n", "Stripe", "Write MB/s", "Read MB/s");
+	for (length = MINSTRIPELENGTH; length <= MAXSTRIPELENGTH; length <<= 1) {
+		double wbw = sweep_run (raid, buff, length, 1, -1);
+		double rbw = sweep_run (raid, buff, length, 0, -1);
+		double bw  = wbw < rbw ? wbw : rbw;  // capturing and replaying must keep up
+
+		printf ("%8lu K %12.1f %12.1f\n", length / 1024, wbw, rbw);
+		if (bw > bestbw) {
+			bestbw = bw;
+			best   = length;
+		}
+	}
+	printf ("Using %lu K stripes\n", best / 1024);
+
+	// Each disk gets stripes in proportion to its bandwidth, so all finish at the same time, but
+	// not more than its share of the capacity, or it fills up before the rest
+	if (raid->numdisks > 1) {
+		double bw[MAXDISKS], bwsum = 0, capsum = 0;
+
+		printf ("%10s %12s %12s\n", "Disk", "Write MB/s", "Read MB/s");
+		for (i = 0; i < raid->numdisks; i++) {
+			double wbw = sweep_run (raid, buff, best, 1, i);
+			double rbw = sweep_run (raid, buff, best, 0, i);
+
+			bw[i] = wbw < rbw ? wbw : rbw;
+			printf ("%10d %12.1f %12.1f\n", i, wbw, rbw);
+			bwsum += bw[i];
+			capsum += sio_numSectors (&raid->disk[i]);
+		}
+		for (i = 0; bwsum > 0 && i < raid->numdisks; i++) {
+			double cap = sio_numSectors (&raid->disk[i]) / capsum;
+
+			bw[i] = bw[i] / bwsum < cap ? bw[i] / bwsum : cap;
+		}
+		weighRaid (raid, bw);
+		buildStripeMap (raid);
+	}
+
+	sio_putbuff (buff);
+	return best;
+}
+
 void app_init (nvmeRaid *raid) {
+	int i;
+
+	if (checkRaidSectors (raid)) {
+		exit (-1);
+	}
+	raid->mirrored = fmirror;
+
+	if (nweights) {
+		if (nweights != raid->numdisks) {
+			printf ("%d weights for %d disks\n", nweights, raid->numdisks);
+			exit (-1);
+		}
+		for (i = 0; i < raid->numdisks; i++) {
+			raid->weight[i] = weights[i];
+		}
+		reduceWeights (raid);
+		buildStripeMap (raid);
+	}
+
+	if (fsweep) {
+		stripeLength = sweep (raid);
+	}
+
 	// format
+	raid->stripeLength = stripeLength;
 	formatRaid (raid);
+
+	printf ("Stripes of %lu K. Stripes per cycle of each disk:", stripeLength / 1024);
+	for (i = 0; i < raid->numdisks; i++) {
+		printf (" %u", raid->weight[i]);
+	}
+	printf ("\n");
+	if (raid->mirrored) {
+		printf ("Mirrored: disk 2n+1 keeps a replica of disk 2n\n");
+	}
 	return;
 }
 void app_run (nvmeRaid *raid) {
@@ -1,11 +1,18 @@
 #include <fs.h>
 #include <common.h>
+#include <time.h>
+#include <unistd.h>
 
 void checkMetaConfig (void) {
 	if (sizeof (metaSector) != METASECTORLENGTH) {
 		fprintf (
 		    stderr, "Invalid meta-data-size (%lu != %lu)\n", sizeof (metaSector), METASECTORLENGTH);
-		fprintf (stderr, "Each file data has %lu bytes\n", sizeof (metaFile));
+		fprintf (stderr, "Each file data has %lu bytes\n", sizeof (metaFileV3));
+		exit (-1);
+	}
+	if (METASECTORLENGTH + sizeof (metaExtentV3) * MAXEXTENTSV3 > METAAREALENGTH ||
+	    METAAREALENGTH > MINSTRIPELENGTH || METAAREALENGTH < MAXSECTORLENGTH) {
+		fprintf (stderr, "Invalid meta area size (%lu bytes)\n", METAAREALENGTH);
 		exit (-1);
 	}
 }
@@ -15,210 +22,2158 @@ int checkMeta (metaSector *m) {
 	return m->MAGIC == MAGICNUMBER;
 }
 
-void initMeta (metaSector *m, uint8_t diskId, uint8_t totalDisks) {
-	m->MAGIC      = MAGICNUMBER;
-	m->version    = CURVERSION;
-	m->diskId     = diskId;
-	m->totalDisks = totalDisks;
-	m->totalFiles = 0;
+int checkStripeLength (uint64_t stripeLength) {
+	// power of 2, so a stripe is always a whole number of pages and sectors
+	return stripeLength >= MINSTRIPELENGTH && stripeLength <= MAXSTRIPELENGTH &&
+	       !(stripeLength & (stripeLength - 1));
+}
 
-	int i;
-	for (i = 0; i < MAXFILES; i++) {
-		m->content[i].name[0]    = '\0';
-		m->content[i].startBlock = 0;
-		m->content[i].endBlock   = 0;
-	}
+void initMeta (metaSector *m,
+               uint8_t diskId,
+               uint8_t totalDisks,
+               uint32_t stripeLength,
+               uint32_t sectorLength,
+               const uint8_t *weights) {
+	m->MAGIC        = MAGICNUMBER;
+	m->version      = CURVERSION;
+	m->diskId       = diskId;
+	m->totalDisks   = totalDisks;
+	m->totalFiles   = 0;
+	m->stripeLength = stripeLength;
+	m->sectorLength = sectorLength;
+	memcpy (m->weights, weights, sizeof (m->weights));
+	m->mirrored    = 0;
+	m->metaStripes   = 1;
+	m->journalLength = 0;
+	memset (m->content, 0, sizeof (m->content));
+	memset (m->reserved, 0, sizeof (m->reserved));
 }
 
-// For sort
-static int cmpMetaSector (const void *p1, const void *p2) {
-	return ((const metaSector *)p1)->diskId > ((const metaSector *)p2)->diskId;
+// Version 1 had 128K stripes and room for one more file where stripeLength is now. Until version
+// 3, the files were in the meta sectors, createRaid moves them to the file table
+int upgradeMeta (metaSector *m) {
+	int version = m->version;
+
+	if (version >= CURVERSION) {
+		return 0;
+	}
+	if (version < 2) {
+		if (((metaFileV3 *)&m->stripeLength)->name[0] != 0) {
+			fprintf (stderr,
+			         "Disk %u uses its last file slot, that does not exist since version 2\n",
+			         m->diskId);
+			return -1;
+		}
+		m->stripeLength = DEFAULTSTRIPELENGTH;
+		m->sectorLength = 0;
+		memset (m->weights, 0, sizeof (m->weights));
+		m->mirrored = 0;
+	}
+
+	if (version < 4) {
+		memset (m->reserved, 0, sizeof (m->reserved));
+		m->metaStripes = 1;  // the data starts at the second stripe, the table fits in the first one
+	}
+	m->journalLength = 0;  // the table takes the whole meta-data stripes
+	m->version       = CURVERSION;
+	return version;
 }
-static int cmpIDisk (const void *p1, const void *p2) {
-	return cmpMetaSector (&((const idisk *)p1)->msector, &((const idisk *)p2)->msector);
+
+static void metaComplete (void *arg, int error) {
+	*(int *)arg = error ? -1 : 1;
 }
 
-// For search
-static int cmpFile (const void *p1, const void *p2) {
-	return strncmp (((const metaFile *)p1)->name, ((const metaFile *)p2)->name, NAMELENGTH);
+static void metaError (void *arg, int error) {
+	if (error) {
+		*(int *)arg = -1;
+	}
 }
 
-void formatRaid (nvmeRaid *raid) {
-	int i;
+// The meta sector is the beginning of the first sector of each disk, which may be bigger (4Kn).
+// The ones of every disk are read at the same time
+static int readMetas (nvmeRaid *raid, int *status) {
+	sioBuff *buff = sio_getbuff (raid->numdisks * SECTORLENGTH);
+	int i, ret = 0;
+
+	if (buff == NULL) {
+		puts ("Not enough pinned memory for the meta-data");
+		exit (-1);
+	}
 	for (i = 0; i < raid->numdisks; i++) {
-		initMeta (&raid->disk[i].msector, i, raid->numdisks);
-		sio_write_pinit (&raid->disk[i], &raid->disk[i].msector, 0, 1);
-		printf ("Overwritting sector 0 of disk %d\n", i);
+		char *sector = (char *)buff->mem + i * SECTORLENGTH;
+
+		status[i] = 0;
+		if (sio_read_async (&raid->disk[i], sector, 0, 1, metaComplete, &status[i])) {
+			status[i] = -1;
+		}
+	}
+	sio_waittasks (raid);
+
+	for (i = 0; i < raid->numdisks; i++) {
+		if (status[i] < 0) {
+			ret = -1;
+		} else {
+			memcpy (&raid->disk[i].msector, (char *)buff->mem + i * SECTORLENGTH, sizeof (metaSector));
+		}
 	}
+	sio_putbuff (buff);
+	return ret;
 }
 
-void createRaid (nvmeRaid *raid) {
-	int i, cnt = 0;
+static void dirtyTable (nvmeRaid *raid, const void *p, uint64_t length) {
+	uint64_t offset = (const char *)p - (const char *)raid->table->mem;
+	uint64_t s;
 
-	// int8_t isInit[MAXDISKS] = {0};
+	for (s = offset / SECTORLENGTH; s * SECTORLENGTH < offset + length; s++) {
+		raid->dirty[s] = 1;
+	}
+}
+
+static uint32_t checksum (const void *p, uint64_t length, uint32_t h) {
+	const uint8_t *b = p;
+	uint64_t i;
+
+	for (i = 0; i < length; i++) {  // FNV-1a
+		h ^= b[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// The meta sectors (if they changed) and the dirty table sectors in [s, e), every disk at the
+// same time. They are flushed before returning, so the journal can be reused. -1 if a write or
+// the flush failed, and then they are still dirty
+static int writeTable (nvmeRaid *raid, uint64_t s, uint64_t e) {
+	sioBuff *buff       = sio_getbuff (raid->numdisks * SECTORLENGTH);
+	uint64_t tableLba   = METAAREALENGTH / SECTORLENGTH;
+	int error[MAXDISKS] = {0};
+	uint64_t first, last;
+	int i, ret = 0;
+
+	if (buff == NULL) {
+		puts ("Not enough pinned memory for the meta-data");
+		exit (-1);
+	}
+	for (i = 0; i < raid->numdisks; i++) {
+		char *sector = (char *)buff->mem + i * SECTORLENGTH;
 
+		if (raid->metaDirty) {
+			memset (sector, 0, SECTORLENGTH);
+			memcpy (sector, &raid->disk[i].msector, sizeof (metaSector));
+			if (sio_write_async (&raid->disk[i], sector, 0, 1, metaError, &error[i])) {
+				error[i] = -1;
+			}
+		}
+		for (first = s; first < e; first = last) {
+			for (last = first; last < e && raid->dirty[last]; last++)
+				;
+			if (last == first) {
+				last++;
+				continue;
+			}
+			if (sio_write_async (&raid->disk[i],
+			                     (char *)raid->table->mem + first * SECTORLENGTH,
+			                     tableLba + first,
+			                     last - first,
+			                     metaError,
+			                     &error[i])) {
+				error[i] = -1;
+			}
+		}
+	}
+	sio_waittasks (raid);
+	sio_putbuff (buff);
+	if (sio_rflush (raid)) {
+		puts ("Error flushing the meta-data");
+		ret = -1;
+	}
 	for (i = 0; i < raid->numdisks; i++) {
-		if (sio_sectorSize (&raid->disk[i]) != METASECTORLENGTH) {
-			printf ("Disk %d have an invalid sector size (!=%lu)", i, METASECTORLENGTH);
+		if (error[i]) {
+			printf ("Error writing the meta-data of disk %d\n", i);
+			ret = -1;
 		}
+	}
+	if (ret) {
+		return ret;
+	}
 
-		sio_read_pinit (&raid->disk[i], &raid->disk[i].msector, 0, 1);
-		if (checkMeta (&raid->disk[i].msector)) {  // initialiced
-			// isInit[i] = 1;
-			cnt++;
-		} else {
-			// isInit[i] = 0;
+	if (e > s) {
+		memset (raid->dirty + s, 0, e - s);
+	}
+	raid->metaDirty = 0;
+	return 0;
+}
+
+// Table sectors a journal of length bytes has room for, and the sectors of its header
+static uint32_t journalSectors (nvmeRaid *raid, uint64_t length, uint32_t *header) {
+	uint32_t k = (length - sizeof (metaJournal)) / (SECTORLENGTH + sizeof (uint32_t));
+
+	for (;; k--) {
+		*header = (sizeof (metaJournal) + k * sizeof (uint32_t) + SECTORLENGTH - 1) / SECTORLENGTH;
+		if ((*header + k) * SECTORLENGTH <= length) {
+			return k;
 		}
 	}
+}
 
-	if (cnt == 0) {  // all must be initialiced
-		formatRaid (raid);
-	} else if (cnt < raid->numdisks) {
-		puts (
-		    "This implementation can't handle this NVME situation. Plase, consider attaching only\n"
-		    "the initialiced NVMes or clean its metadata (Which will erase all its contents)\n"
-		    "In future realeases, increasing the number of NVMes in raid would be supported\n");
-		printf ("note: %d NVMe with metadata vs %d NVMe expected\n", cnt, raid->numdisks);
+static uint32_t journalRoom (nvmeRaid *raid, uint32_t *header) {
+	return journalSectors (raid, raid->journalLength, header);
+}
+
+// The shortest journal that has room for every sector of the table before it, so any update is
+// a single commit. The meta-data stripes are shared between them
+static uint32_t journalGeometry (nvmeRaid *raid) {
+	uint64_t region = raid->metaStripes * SUPERSECTORLENGTH - METAAREALENGTH;
+	uint64_t length = region / 2 / SECTORLENGTH * SECTORLENGTH;
+	uint32_t header;
+
+	while (journalSectors (raid, length, &header) < (region - length) / SECTORLENGTH) {
+		length += SECTORLENGTH;
+	}
+	return length;
+}
+
+static uint64_t dirtySectors (nvmeRaid *raid) {
+	uint64_t tableSectors = raid->tableLength / SECTORLENGTH, s, n = 0;
+
+	for (s = 0; s < tableSectors; s++) {
+		n += raid->dirty[s];
+	}
+	return n;
+}
+
+// Journals every dirty table sector, in every disk at the same time. Once flushed, that is the
+// commit point of the update. -1 if the journal of a disk was not written or flushed
+static int journalTable (nvmeRaid *raid) {
+	uint64_t tableSectors = raid->tableLength / SECTORLENGTH;
+	uint64_t journalLba   = (METAAREALENGTH + raid->tableLength) / SECTORLENGTH;
+	int error[MAXDISKS]   = {0};
+	uint32_t header, room, k = 0, n;
+	metaJournal *j;
+	uint32_t *list;
+	sioBuff *buff;
+	uint64_t s;
+	int i, ret = 0;
+
+	if (raid->journalLength == 0) {
+		return 0;  // written in place
+	}
+	buff = sio_getbuff (raid->journalLength);
+	if (buff == NULL) {
+		puts ("Not enough pinned memory for the meta-data journal");
 		exit (-1);
 	}
+	room = journalRoom (raid, &header);
+	j    = buff->mem;
+	list = (uint32_t *)(j + 1);
+	for (s = 0; s < tableSectors && k < room; s++) {
+		if (raid->dirty[s]) {
+			list[k++] = s;
+		}
+	}
+	if (k == 0) {
+		sio_putbuff (buff);
+		return 0;
+	}
 
-	// order
-	qsort (raid->disk, raid->numdisks, sizeof (idisk), cmpIDisk);
+	header = (sizeof (metaJournal) + k * sizeof (uint32_t) + SECTORLENGTH - 1) / SECTORLENGTH;
+	memset ((char *)(list + k), 0, header * SECTORLENGTH - sizeof (metaJournal) - k * sizeof (uint32_t));
+	for (n = 0; n < k; n++) {
+		memcpy ((char *)buff->mem + (header + n) * SECTORLENGTH,
+		        (char *)raid->table->mem + list[n] * SECTORLENGTH,
+		        SECTORLENGTH);
+	}
+	j->MAGIC    = JOURNALMAGIC;
+	j->seq      = ++raid->journalSeq;
+	j->sectors  = k;
+	j->checksum = 0;
+	j->checksum = checksum (buff->mem, (header + k) * SECTORLENGTH, 2166136261u);
 
-	// check integrity
 	for (i = 0; i < raid->numdisks; i++) {
-		if (raid->disk[i].msector.diskId != i &&
-		    raid->disk[i].msector.totalDisks != raid->numdisks) {
-			puts ("NVMe raid integrity error. Can't continue");
-			exit (-1);
+		if (sio_write_async (
+		        &raid->disk[i], buff->mem, journalLba, header + k, metaError, &error[i])) {
+			error[i] = -1;
 		}
 	}
+	sio_waittasks (raid);
+	sio_putbuff (buff);
+	if (sio_rflush (raid)) {
+		puts ("Error flushing the meta-data journal");
+		ret = -1;
+	}
 
-	// fill other raid data
-	raid->numFiles = raid->disk[0].msector.totalFiles;
+	for (i = 0; i < raid->numdisks; i++) {
+		if (error[i]) {
+			printf ("Error writing the meta-data journal of disk %d\n", i);
+			ret = -1;
+		}
+	}
+	return ret;
 }
 
-void updateRaid (nvmeRaid *raid) {
+// Journal and then in place. The blocks freed by the update are deallocated once it is committed.
+// If it is not, nothing is written in place, and it stays pending with its deallocations
+static int commitRaid (nvmeRaid *raid) {
+	uint64_t tableSectors = raid->table ? raid->tableLength / SECTORLENGTH : 0;
+	uint32_t header, i;
+
+	// only raids formatted with a shorter journal (journalGeometry) get here
+	if (raid->journalLength && dirtySectors (raid) > journalRoom (raid, &header)) {
+		printf ("The update of the meta-data is bigger than its journal (%u sectors)\n",
+		        journalRoom (raid, &header));
+		return -1;
+	}
+	if (journalTable (raid) || writeTable (raid, 0, tableSectors)) {
+		puts ("The update of the meta-data is not committed");
+		return -1;
+	}
+	raid->pending = 0;
+
+	for (i = 0; i < raid->numTrims; i++) {
+		if (sio_rdeallocate (raid, raid->trims[i].start, raid->trims[i].count)) {
+			printf ("Error deallocating %lu blocks from %lu\n",
+			        raid->trims[i].count,
+			        raid->trims[i].start);
+		}
+	}
+	raid->numTrims = 0;
+	return 0;
+}
+
+// The valid journal with the highest seq is written in place again, the sectors of it some disk
+// does not have. If it was committed, and the update did not reach every disk, that finishes it.
+// Otherwise, nothing is written
+static void replayJournal (nvmeRaid *raid) {
+	uint64_t journalLba = (METAAREALENGTH + raid->tableLength) / SECTORLENGTH;
+	sioBuff *buff, *best = NULL, *journal[MAXDISKS];
+	uint32_t header, room, n, changed = 0;
+	int status[MAXDISKS];
 	int i;
+
+	if (raid->journalLength == 0) {
+		return;
+	}
+	// the journals of every disk at the same time
+	room = journalRoom (raid, &header);
 	for (i = 0; i < raid->numdisks; i++) {
-		sio_write_pinit (&raid->disk[i], &raid->disk[i].msector, 0, 1);
+		journal[i] = sio_getbuff (raid->journalLength);
+		if (journal[i] == NULL) {
+			puts ("Not enough pinned memory for the meta-data journal");
+			exit (-1);
+		}
+		status[i] = 0;
+		if (sio_read_async (&raid->disk[i],
+		                    journal[i]->mem,
+		                    journalLba,
+		                    raid->journalLength / SECTORLENGTH,
+		                    metaComplete,
+		                    &status[i])) {
+			status[i] = -1;
+		}
 	}
-}
+	sio_waittasks (raid);
 
-uint64_t blocksLeft (nvmeRaid *raid) {
-	uint64_t usedBlocks = 0;
-	int i, j;
 	for (i = 0; i < raid->numdisks; i++) {
-		for (j = 0; j < MAXFILES; j++) {
-			usedBlocks = raid->disk[i].msector.content[j].endBlock -
-			             raid->disk[i].msector.content[j].startBlock;
+		metaJournal *j;
+		uint32_t sum;
+
+		buff = journal[i];
+		if (status[i] < 0) {
+			printf ("Can't read the meta-data journal of disk %d\n", i);
+			sio_putbuff (buff);
+			continue;
+		}
+		j = buff->mem;
+		if (j->MAGIC != JOURNALMAGIC || j->sectors == 0 || j->sectors > room) {
+			sio_putbuff (buff);
+			continue;
+		}
+		header      = (sizeof (metaJournal) + j->sectors * sizeof (uint32_t) + SECTORLENGTH - 1) /
+		         SECTORLENGTH;
+		sum         = j->checksum;
+		j->checksum = 0;
+		if (checksum (buff->mem, (header + j->sectors) * SECTORLENGTH, 2166136261u) != sum ||
+		    (best && ((metaJournal *)best->mem)->seq >= j->seq)) {
+			sio_putbuff (buff);
+			continue;
+		}
+		if (best) {
+			sio_putbuff (best);
+		}
+		best = buff;
+	}
+	if (best == NULL) {
+		return;
+	}
+
+	{
+		metaJournal *j = best->mem;
+		uint32_t *list = (uint32_t *)(j + 1);
+		uint64_t tableLba = METAAREALENGTH / SECTORLENGTH, first, count;
+		sioBuff *disk;
+
+		header = (sizeof (metaJournal) + j->sectors * sizeof (uint32_t) + SECTORLENGTH - 1) /
+		         SECTORLENGTH;
+		raid->journalSeq = j->seq;
+		for (n = 0; n < j->sectors && list[n] < raid->tableLength / SECTORLENGTH; n++)
+			;
+		if (n == 0) {
+			sio_putbuff (best);
+			return;
+		}
+		// the journaled sectors are in order, one read of each disk has them
+		first = list[0];
+		count = list[n - 1] + 1 - first;
+		disk  = sio_getbuff (count * SECTORLENGTH);
+		if (disk == NULL) {
+			puts ("Not enough pinned memory for the meta-data journal");
+			exit (-1);
+		}
+		for (i = 0; i < raid->numdisks; i++) {
+			int unread = sio_read (&raid->disk[i], disk->mem, tableLba + first, count);
+
+			if (unread) {
+				printf ("Can't read the file table of disk %d\n", i);
+			}
+			for (n = 0; n < j->sectors && list[n] < raid->tableLength / SECTORLENGTH; n++) {
+				char *copy = (char *)best->mem + (header + n) * SECTORLENGTH;
+
+				// the update did not reach this disk (or it can't tell)
+				if (unread || memcmp ((char *)disk->mem + (list[n] - first) * SECTORLENGTH,
+				                      copy,
+				                      SECTORLENGTH)) {
+					raid->dirty[list[n]] = 1;
+				}
+			}
+		}
+		sio_putbuff (disk);
+		for (n = 0; n < j->sectors && list[n] < raid->tableLength / SECTORLENGTH; n++) {
+			char *sector = (char *)raid->table->mem + (uint64_t)list[n] * SECTORLENGTH;
+			char *copy   = (char *)best->mem + (header + n) * SECTORLENGTH;
+
+			if (memcmp (sector, copy, SECTORLENGTH)) {
+				memcpy (sector, copy, SECTORLENGTH);
+				raid->dirty[list[n]] = 1;
+			}
+			changed += raid->dirty[list[n]];
 		}
 	}
-	return raid->totalBlocks - usedBlocks;
+	sio_putbuff (best);
+
+	// only the sectors some disk does not have yet
+	if (changed) {
+		writeTable (raid, 0, raid->tableLength / SECTORLENGTH);
+		printf ("Meta-data journal replayed (%u sectors)\n", changed);
+	}
 }
 
-uint64_t rightFreeBlocks (nvmeRaid *raid) {
-	return raid->totalBlocks - rightFreeBlock (raid);
+// The file table takes the rest of the meta-data stripes of every disk, before the journal
+static void tableGeometry (nvmeRaid *raid) {
+	raid->tableLength =
+	    raid->metaStripes * SUPERSECTORLENGTH - METAAREALENGTH - raid->journalLength;
+	raid->maxFiles    = raid->tableLength / (sizeof (metaFile) + FILEEXTENTS * sizeof (metaExtent));
+	raid->maxExtents =
+	    (raid->tableLength - raid->maxFiles * sizeof (metaFile)) / sizeof (metaExtent);
 }
 
-uint64_t rightFreeBlock (nvmeRaid *raid) {
-	uint64_t mostRight = raid->numdisks * SUPERSECTORNUM;  // keep the metasectors
-	int i, j;
-	for (i = 0; i < raid->numdisks; i++) {
-		for (j = 0; j < MAXFILES; j++) {
-			if (mostRight < raid->disk[i].msector.content[j].endBlock)
-				mostRight = raid->disk[i].msector.content[j].endBlock;
-		}
+static void allocTable (nvmeRaid *raid) {
+	tableGeometry (raid);
+	if (raid->maxFiles == 0) {
+		puts ("The stripes of this raid are too small for the file table. Format it");
+		exit (-1);
 	}
-	return mostRight;
+
+	raid->table = sio_getbuff (raid->tableLength);
+	raid->dirty = calloc (raid->tableLength / SECTORLENGTH, 1);
+	for (raid->hashSize = 1; raid->hashSize < 2 * raid->maxFiles; raid->hashSize <<= 1)
+		;
+	raid->hash = calloc (raid->hashSize, sizeof (uint32_t));
+	if (raid->table == NULL || raid->dirty == NULL || raid->hash == NULL) {
+		puts ("Not enough memory for the file table");
+		exit (-1);
+	}
+	memset (raid->table->mem, 0, raid->tableLength);
+	raid->files      = raid->table->mem;
+	raid->extents    = (metaExtent *)(raid->files + raid->maxFiles);
+	raid->numFiles   = 0;
+	raid->numExtents = 0;
 }
 
-metaFile *findFile (nvmeRaid *raid, const char *const name) {
+// An empty file table (and journal) in every disk
+static void zeroTable (nvmeRaid *raid) {
+	int error[MAXDISKS] = {0};
+	uint64_t length;
+	sioBuff *buff;
 	int i;
-	size_t numfiles = MAXFILES;
-	metaFile *ret = NULL;
+
+	tableGeometry (raid);
+	length = raid->tableLength + raid->journalLength;
+	buff   = sio_getbuff (length);
+	if (buff == NULL) {
+		puts ("Not enough pinned memory for the file table");
+		exit (-1);
+	}
+	memset (buff->mem, 0, length);
 	for (i = 0; i < raid->numdisks; i++) {
-		ret = lfind (name, &raid->disk[i].msector.content, &numfiles, sizeof (metaFile), cmpFile);
-		if (ret)
-			break;
+		if (sio_write_async (&raid->disk[i],
+		                     buff->mem,
+		                     METAAREALENGTH / SECTORLENGTH,
+		                     length / SECTORLENGTH,
+		                     metaError,
+		                     &error[i])) {
+			error[i] = -1;
+		}
+	}
+	sio_waittasks (raid);
+	sio_putbuff (buff);
+	sio_rflush (raid);
+
+	for (i = 0; i < raid->numdisks; i++) {
+		if (error[i]) {
+			printf ("Error writing the file table of disk %d\n", i);
+		}
 	}
-	return ret;
 }
 
-uint8_t findFileDisk (nvmeRaid *raid, const char *const name) {
+// Name index
+static uint32_t nameHash (const char *name) {
+	uint32_t h = 2166136261u;  // FNV-1a
 	int i;
-	size_t numfiles = MAXFILES;
-	metaFile *ret = NULL;
-	for (i = 0; i < raid->numdisks; i++) {
-		ret = lfind (name, &raid->disk[i].msector.content, &numfiles, sizeof (metaFile), cmpFile);
-		if (ret)
+
+	for (i = 0; i < NAMELENGTH && name[i]; i++) {
+		h ^= (uint8_t)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// The slot of the name, or the empty one where it would go
+static uint32_t hashSlot (nvmeRaid *raid, const char *name) {
+	uint32_t mask = raid->hashSize - 1, i;
+
+	for (i = nameHash (name) & mask; raid->hash[i]; i = (i + 1) & mask) {
+		if (!strncmp (raid->files[raid->hash[i] - 1].name, name, NAMELENGTH)) {
 			break;
+		}
 	}
-	return raid->disk[i].msector.diskId;
+	return i;
 }
 
-metaFile *addFile (nvmeRaid *raid, const char *const name, uint64_t blsize) {
-	int i, j;
+static void hashAdd (nvmeRaid *raid, uint32_t file) {
+	raid->hash[hashSlot (raid, raid->files[file].name)] = file + 1;
+}
 
-	// TODO: set errno to the specific error
-	if (findFile (raid, name))
-		return NULL;
-	if (raid->disk[0].msector.totalFiles == MAXFILES * raid->numdisks)
-		return NULL;
-	// Check for space
-	if (rightFreeBlocks (raid) < blsize)
-		return NULL;
-	// check filename
-	if (name[0] == 0)
-		return NULL;
-	// find a place for it
+// Backward shift, so the names after it are still found
+static void hashDel (nvmeRaid *raid, uint32_t file) {
+	uint32_t mask = raid->hashSize - 1;
+	uint32_t i    = hashSlot (raid, raid->files[file].name), j, k;
+
+	raid->hash[i] = 0;
+	for (j = (i + 1) & mask; raid->hash[j]; j = (j + 1) & mask) {
+		k = nameHash (raid->files[raid->hash[j] - 1].name) & mask;  // where it wants to be
+		if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+			raid->hash[i] = raid->hash[j];
+			raid->hash[j] = 0;
+			i             = j;
+		}
+	}
+}
+
+static void indexTable (nvmeRaid *raid) {
+	uint32_t i;
+
+	raid->numFiles = 0;
+	for (i = 0; i < raid->maxFiles; i++) {
+		if (raid->files[i].name[0] != 0) {
+			hashAdd (raid, i);
+			raid->numFiles++;
+		}
+	}
+	for (raid->numExtents = 0;
+	     raid->numExtents < raid->maxExtents && raid->extents[raid->numExtents].file;
+	     raid->numExtents++)
+		;
+}
+
+// Every disk has the same table, the first one is read
+static void loadTable (nvmeRaid *raid) {
+	if (sio_read (&raid->disk[0],
+	              raid->table->mem,
+	              METAAREALENGTH / SECTORLENGTH,
+	              raid->tableLength / SECTORLENGTH)) {
+		puts ("Can't read the file table");
+		exit (-1);
+	}
+}
+
+// Until version 3, each disk had some files in its meta sector, and their next extents after it
+static void upgradeTable (nvmeRaid *raid, int version) {
+	sioBuff *buff = sio_getbuff (METAAREALENGTH);
+	uint32_t file = 0;
+	int i, j, k;
+
+	if (buff == NULL) {
+		puts ("Not enough pinned memory for the meta-data");
+		exit (-1);
+	}
 	for (i = 0; i < raid->numdisks; i++) {
-		for (j = 0; j < MAXFILES; j++) {
-			if (raid->disk[i].msector.content[j].name[0] == 0) {
-				memcpy (raid->disk[i].msector.content[j].name, name, NAMELENGTH);
-				raid->disk[i].msector.content[j].startBlock = rightFreeBlock (raid);
-				raid->disk[i].msector.content[j].endBlock =
-				    raid->disk[i].msector.content[j].startBlock + blsize;
-				raid->disk[0].msector.totalFiles++;  // increase the number of files
-				raid->numFiles++;
+		metaFileV3 *content  = raid->disk[i].msector.content;
+		metaExtentV3 *legacy = (metaExtentV3 *)((char *)buff->mem + METASECTORLENGTH);
+		uint32_t index[MAXFILESV3];
 
-				updateRaid (raid);
-				return &raid->disk[i].msector.content[j];
+		if (version == 3 &&
+		    sio_read (&raid->disk[i], buff->mem, 0, METAAREALENGTH / SECTORLENGTH)) {
+			printf ("Can't read the extents of disk %d\n", i);
+			exit (-1);
+		}
+		for (j = 0; j < MAXFILESV3; j++) {
+			if (content[j].name[0] == 0) {
+				continue;
+			}
+			if (file == raid->maxFiles) {
+				puts ("The file table is too small for the files of the raid");
+				exit (-1);
+			}
+			memcpy (raid->files[file].name, content[j].name, NAMELENGTHV3);
+			raid->files[file].startBlock = content[j].startBlock;
+			raid->files[file].endBlock   = content[j].endBlock;
+			index[j]                     = ++file;
+		}
+		for (k = 0; version == 3 && k < MAXEXTENTSV3 && legacy[k].file; k++) {
+			if (legacy[k].file > MAXFILESV3 || content[legacy[k].file - 1].name[0] == 0) {
+				continue;
+			}
+			if (raid->numExtents == raid->maxExtents) {
+				puts ("The file table is too small for the extents of the raid");
+				exit (-1);
 			}
+			raid->extents[raid->numExtents++] =
+			    (metaExtent){legacy[k].startBlock, legacy[k].endBlock, index[legacy[k].file - 1]};
 		}
+
+		raid->disk[i].msector.totalFiles = 0;
+		memset (content, 0, sizeof (raid->disk[i].msector.content));
 	}
-	return NULL;
+	sio_putbuff (buff);
+	memset (raid->dirty, 1, raid->tableLength / SECTORLENGTH);  // the whole table
 }
 
-uint8_t delFile (nvmeRaid *raid, const char *const name) {
-	// check filename
-	if (name[0] == 0)
-		return 0;
-	metaFile *f = findFile (raid, name);
-	if (f) {
-		f->name[0]    = 0;
-		f->startBlock = 0;
-		f->endBlock   = 0;
-		raid->disk[0].msector.totalFiles--;
-		raid->numFiles--;
+int checkRaidSectors (nvmeRaid *raid) {
+	int i;
 
-		updateRaid (raid);
-		return 1;
-	} else {
-		return 0;
+	for (i = 0; i < raid->numdisks; i++) {
+		uint32_t sectorLength = sio_sectorSize (&raid->disk[i]);
+
+		if (sectorLength < METASECTORLENGTH || sectorLength > MAXSECTORLENGTH ||
+		    (sectorLength & (sectorLength - 1))) {
+			printf ("Disk %d has an unsupported sector size (%u)\n", i, sectorLength);
+			return -1;
+		}
+		if (i && sectorLength != raid->sectorLength) {
+			printf ("Disk %d has %u bytes sectors, but disk 0 has %u. All must be equal\n",
+			        i,
+			        sectorLength,
+			        raid->sectorLength);
+			return -1;
+		}
+		raid->sectorLength = sectorLength;
 	}
+	return 0;
 }
 
-// utility functions
-uint64_t super_getid (nvmeRaid *raid, uint64_t lba) {
-	UNUSED (raid);
-	return (lba / SUPERSECTORNUM);
+static unsigned gcd (unsigned a, unsigned b) {
+	while (b) {
+		unsigned t = a % b;
+		a          = b;
+		b          = t;
+	}
+	return a;
 }
-uint64_t super_getdisk (nvmeRaid *raid, uint64_t lba) {
-	return super_getid (raid, lba) % raid->numdisks;
+
+// both replicas hold the same stripes, as many as the slowest (or smallest) one allows
+static void pairWeights (nvmeRaid *raid) {
+	int i;
+
+	for (i = 0; raid->mirrored && i + 1 < raid->numdisks; i += 2) {
+		if (raid->weight[i + 1] < raid->weight[i])
+			raid->weight[i] = raid->weight[i + 1];
+		raid->weight[i + 1] = raid->weight[i];
+	}
 }
-uint64_t super_getdisklba (nvmeRaid *raid, uint64_t lba) {
-	return (lba - ((super_getid (raid, lba) - (super_getid (raid, lba) / raid->numdisks)) *
-	               SUPERSECTORNUM)) +
-	       SUPERSECTORNUM;
+
+void reduceWeights (nvmeRaid *raid) {
+	unsigned g = 0;
+	int i;
+
+	pairWeights (raid);
+	for (i = 0; i < raid->numdisks; i++) {
+		g = gcd (g, raid->weight[i]);
+	}
+	// the shortest cycle, so equal disks keep the plain round-robin
+	for (i = 0; g > 1 && i < raid->numdisks; i++) {
+		raid->weight[i] /= g;
+	}
+}
+
+void weighRaid (nvmeRaid *raid, const double *perf) {
+	double max = 0;
+	int i;
+
+	for (i = 0; i < raid->numdisks; i++) {
+		if (perf[i] > max)
+			max = perf[i];
+	}
+	for (i = 0; i < raid->numdisks; i++) {
+		unsigned w = max > 0 ? (unsigned)(MAXWEIGHT * perf[i] / max + 0.5) : 1;
+		raid->weight[i] = w ? w : 1;
+	}
+	reduceWeights (raid);
+}
+
+// Smooth weighted round-robin over the first numdisks disks, so the stripes of each disk are
+// spread along the cycle. Returns the cycle
+static uint32_t fillStripeMap (
+    nvmeRaid *raid, const uint8_t *weight, int numdisks, uint8_t *map, uint8_t *rank) {
+	int current[MAXDISKS] = {0};
+	uint8_t count[MAXDISKS] = {0};
+	uint32_t p, total = 0;
+	int i;
+
+	for (i = 0; i < numdisks; i++) {
+		if (!super_isreplica (raid, i))
+			total += weight[i];
+	}
+
+	for (p = 0; p < total; p++) {
+		int best = 0;
+		for (i = 0; i < numdisks; i++) {
+			if (super_isreplica (raid, i))
+				continue;
+			current[i] += weight[i];
+			if (current[i] > current[best])
+				best = i;
+		}
+		current[best] -= total;
+		map[p]  = best;
+		rank[p] = count[best]++;
+	}
+	return total;
+}
+
+void buildStripeMap (nvmeRaid *raid) {
+	int i;
+
+	for (i = 0; i < raid->numdisks; i++) {
+		if (raid->weight[i] == 0 || raid->weight[i] > MAXWEIGHT)
+			raid->weight[i] = 1;
+	}
+	pairWeights (raid);
+	raid->stripeCycle =
+	    fillStripeMap (raid, raid->weight, raid->numdisks, raid->stripeMap, raid->stripeRank);
+}
+
+// The raid size a stripe map of the first numdisks disks allows (the first stripes of every disk
+// are the meta-data)
+static uint64_t raidBlocks (nvmeRaid *raid, int numdisks, const uint8_t *weight, uint32_t cycle) {
+	uint64_t blocks = 0;
+	int i;
+
+	for (i = 0; i < numdisks; i++) {
+		uint64_t cycles = (sio_numSectors (&raid->disk[i]) / SUPERSECTORNUM - raid->metaStripes) / weight[i];
+		if (i == 0 || cycles * cycle * SUPERSECTORNUM < blocks) {
+			blocks = cycles * cycle * SUPERSECTORNUM;
+		}
+	}
+	return blocks;
+}
+
+// For sort
+static int cmpMetaSector (const void *p1, const void *p2) {
+	return ((const metaSector *)p1)->diskId > ((const metaSector *)p2)->diskId;
+}
+static int cmpIDisk (const void *p1, const void *p2) {
+	return cmpMetaSector (&((const idisk *)p1)->msector, &((const idisk *)p2)->msector);
+}
+
+void formatRaid (nvmeRaid *raid) {
+	int i;
+
+	if (checkRaidSectors (raid)) {
+		exit (-1);
+	}
+	if (raid->mirrored && raid->numdisks % 2) {
+		printf ("A mirrored raid needs an even number of disks (%d attached)\n", raid->numdisks);
+		exit (-1);
+	}
+	if (raid->stripeCycle == 0) {  // not weighed, by capacity
+		double capacity[MAXDISKS];
+		for (i = 0; i < raid->numdisks; i++) {
+			capacity[i] = sio_numSectors (&raid->disk[i]);
+		}
+		weighRaid (raid, capacity);
+	}
+	buildStripeMap (raid);
+	raid->metaStripes   = (METAREGIONLENGTH + SUPERSECTORLENGTH - 1) / SUPERSECTORLENGTH;
+	raid->journalLength = journalGeometry (raid);
+
+	for (i = 0; i < raid->numdisks; i++) {
+		initMeta (&raid->disk[i].msector,
+		          i,
+		          raid->numdisks,
+		          raid->stripeLength,
+		          raid->sectorLength,
+		          raid->weight);
+		raid->disk[i].msector.mirrored    = raid->mirrored;
+		raid->disk[i].msector.metaStripes   = raid->metaStripes;
+		raid->disk[i].msector.journalLength = raid->journalLength;
+		printf ("Overwritting sector 0 of disk %d\n", i);
+	}
+	zeroTable (raid);
+	raid->metaDirty = 1;  // the meta sectors, once the table is empty
+	writeTable (raid, 0, 0);
+
+	// The old data is not needed anymore, every disk at the same time
+	for (i = 0; i < raid->numdisks; i++) {
+		uint64_t first   = raid->metaStripes * SUPERSECTORNUM;
+		uint64_t sectors = sio_numSectors (&raid->disk[i]);
+		if (sio_deallocate_async (&raid->disk[i], first, sectors - first, NULL, NULL) < 0) {
+			printf ("Error deallocating disk %d\n", i);
+		}
+	}
+	sio_waittasks (raid);
+	printf ("Disks deallocated\n");
+}
+
+static void expandState (nvmeRaid *raid);
+static int expandResume (nvmeRaid *raid);
+
+void createRaid (nvmeRaid *raid) {
+	int status[MAXDISKS];
+	int i, cnt = 0, upgraded = 0, version;
+
+	// int8_t isInit[MAXDISKS] = {0};
+
+	if (checkRaidSectors (raid)) {
+		exit (-1);
+	}
+
+	if (readMetas (raid, status)) {
+		for (i = 0; i < raid->numdisks; i++) {
+			if (status[i] < 0) {
+				printf ("Can't read the meta-data of disk %d\n", i);
+			}
+		}
+		exit (-1);
+	}
+	for (i = 0; i < raid->numdisks; i++) {
+		if (checkMeta (&raid->disk[i].msector)) {  // initialiced
+			// isInit[i] = 1;
+			cnt++;
+			version = upgradeMeta (&raid->disk[i].msector);
+			if (version < 0) {
+				puts ("Can't upgrade the raid meta-data. Remove a file and try again");
+				exit (-1);
+			}
+			if (version && (upgraded == 0 || version < upgraded)) {
+				upgraded = version;
+			}
+		} else {
+			// isInit[i] = 0;
+		}
+	}
+
+	if (cnt == 0) {  // all must be initialiced
+		formatRaid (raid);
+	} else if (cnt < raid->numdisks) {
+		puts (
+		    "This implementation can't handle this NVME situation. Plase, consider attaching only\n"
+		    "the initialiced NVMes or clean its metadata (Which will erase all its contents)\n"
+		    "or add them to the raid\n");
+		printf ("note: %d NVMe with metadata vs %d NVMe expected\n", cnt, raid->numdisks);
+		puts ("To add the NVMes without metadata to the raid, use the expand tool");
+		exit (-1);
+	}
+
+	// order
+	qsort (raid->disk, raid->numdisks, sizeof (idisk), cmpIDisk);
+
+	// check integrity
+	for (i = 0; i < raid->numdisks; i++) {
+		if (raid->disk[i].msector.diskId != i &&
+		    raid->disk[i].msector.totalDisks != raid->numdisks) {
+			puts ("NVMe raid integrity error. Can't continue");
+			exit (-1);
+		}
+	}
+
+	// fill other raid data
+	raid->stripeLength = raid->disk[0].msector.stripeLength;
+	raid->metaStripes  = raid->disk[0].msector.metaStripes ? raid->disk[0].msector.metaStripes : 1;
+	raid->journalLength = raid->disk[0].msector.journalLength;
+	for (i = 0; i < raid->numdisks; i++) {
+		uint32_t sectorLength = raid->disk[i].msector.sectorLength;
+
+		if (sectorLength != raid->sectorLength &&
+		    !(sectorLength == 0 && raid->sectorLength == DEFAULTSECTORLENGTH)) {
+			printf ("Disk %d was formatted with %u bytes sectors, now it has %u. Can't continue\n",
+			        i,
+			        sectorLength ? sectorLength : (uint32_t)DEFAULTSECTORLENGTH,
+			        raid->sectorLength);
+			exit (-1);
+		}
+		if (raid->disk[i].msector.stripeLength != raid->stripeLength ||
+		    !checkStripeLength (raid->stripeLength)) {
+			printf ("NVMe raid integrity error (stripe of %u bytes in disk %d). Can't continue\n",
+			        raid->disk[i].msector.stripeLength,
+			        i);
+			exit (-1);
+		}
+		if (memcmp (raid->disk[i].msector.weights, raid->disk[0].msector.weights, MAXDISKS) ||
+		    raid->disk[i].msector.mirrored != raid->disk[0].msector.mirrored ||
+		    raid->disk[i].msector.metaStripes != raid->disk[0].msector.metaStripes ||
+		    raid->disk[i].msector.journalLength != raid->disk[0].msector.journalLength) {
+			printf ("NVMe raid integrity error (stripe map of disk %d). Can't continue\n", i);
+			exit (-1);
+		}
+	}
+	raid->mirrored = raid->disk[0].msector.mirrored;
+	if (raid->mirrored && raid->numdisks % 2) {
+		puts ("A mirrored raid lost one of its disks. Can't continue");
+		exit (-1);
+	}
+
+	// stripe map, and the raid size it allows. While expanding, the one of the old disks
+	memcpy (raid->weight, raid->disk[0].msector.weights, MAXDISKS);
+	buildStripeMap (raid);
+	expandState (raid);
+	if (raid->expandDisks) {
+		raid->totalBlocks =
+		    raidBlocks (raid, raid->expandDisks, raid->expandWeight, raid->expandCycle);
+	} else {
+		raid->totalBlocks = raidBlocks (raid, raid->numdisks, raid->weight, raid->stripeCycle);
+	}
+
+	allocTable (raid);
+	if (upgraded && upgraded <= 3) {
+		upgradeTable (raid, upgraded);
+	} else {
+		loadTable (raid);
+		replayJournal (raid);
+	}
+	indexTable (raid);
+	if (raid->expandDisks && expandResume (raid)) {
+		exit (-1);
+	}
+
+	if (upgraded) {
+		printf ("Meta-data upgraded to version %d\n", CURVERSION);
+		raid->metaDirty = 1;
+		updateRaid (raid);
+	}
+}
+
+void updateRaid (nvmeRaid *raid) {
+	uint32_t header;
+
+	raid->pending = 1;
+	// every update is whole here, so a batch that may not fit in the journal is committed in parts
+	if (raid->batch == 0 ||
+	    (raid->journalLength && dirtySectors (raid) > journalRoom (raid, &header) / 2)) {
+		commitRaid (raid);
+	}
+}
+
+void beginUpdate (nvmeRaid *raid) {
+	raid->batch++;
+}
+
+void endUpdate (nvmeRaid *raid) {
+	if (--raid->batch == 0 && raid->pending) {
+		commitRaid (raid);
+	}
+}
+
+// Blocks freed by an update, deallocated once it is committed
+static void releaseBlocks (nvmeRaid *raid, uint64_t start, uint64_t count) {
+	if (raid->numTrims == raid->maxTrims) {
+		uint32_t max     = raid->maxTrims ? raid->maxTrims * 2 : 64;
+		metaRange *trims = realloc (raid->trims, max * sizeof (metaRange));
+
+		if (trims == NULL) {
+			puts ("Not enough memory for the deallocations");
+			exit (-1);
+		}
+		raid->trims    = trims;
+		raid->maxTrims = max;
+	}
+	raid->trims[raid->numTrims++] = (metaRange){start, count};
+}
+
+// Allocation. Extents start at a whole cycle of the stripe map, so every disk gets its share of
+// each one, and the compaction can move them without changing the disk of any stripe
+typedef struct {
+	uint64_t start;
+	uint64_t end;
+	metaFile *file;      // owner of the used ones
+	metaExtent *extent;  // in the extents table, NULL if it is the one of the metaFile
+} blockRange;
+
+static int cmpRangeStart (const void *p1, const void *p2) {
+	const blockRange *r1 = p1, *r2 = p2;
+	return r1->start < r2->start ? -1 : r1->start > r2->start;
+}
+static int cmpRangeSize (const void *p1, const void *p2) {  // the biggest first
+	const blockRange *r1 = p1, *r2 = p2;
+	uint64_t s1 = r1->end - r1->start, s2 = r2->end - r2->start;
+	return s1 > s2 ? -1 : s1 < s2;
+}
+
+static uint64_t allocUnit (nvmeRaid *raid) {
+	return raid->stripeCycle * SUPERSECTORNUM;
+}
+
+// The meta-data stripes (metaStripes) of every disk are before the rows of the stripe map
+// (mapStripe), so the raid blocks start with data. It does not depend on the disks, and does not
+// move when the raid is expanded
+static uint64_t firstBlock (nvmeRaid *raid) {
+	UNUSED (raid);
+	return 0;
+}
+
+static blockRange *allocRangeArray (nvmeRaid *raid) {
+	blockRange *r = malloc ((raid->maxFiles + raid->maxExtents + 1) * sizeof (blockRange));
+
+	if (r == NULL) {
+		puts ("Not enough memory for the allocation map");
+		exit (-1);
+	}
+	return r;
+}
+
+// The nth extent of the file in the extents table (the first one is n = 1)
+static metaExtent *tableExtent (nvmeRaid *raid, metaFile *file, int n) {
+	uint32_t slot = file - raid->files, i;
+
+	if (n < 1) {
+		return NULL;
+	}
+	for (i = 0; i < raid->numExtents; i++) {
+		if (raid->extents[i].file == slot + 1 && --n == 0) {
+			return &raid->extents[i];
+		}
+	}
+	return NULL;
+}
+
+// Frees the extents of the file in the table after the first keep ones. The table stays packed
+static void dropExtents (nvmeRaid *raid, metaFile *file, int keep) {
+	uint32_t slot = file - raid->files, first = raid->numExtents, i, n = 0;
+
+	for (i = 0; i < raid->numExtents; i++) {
+		if (raid->extents[i].file == slot + 1 && keep-- <= 0) {
+			if (first == raid->numExtents) {
+				first = i;
+			}
+			continue;
+		}
+		raid->extents[n++] = raid->extents[i];
+	}
+	if (n < raid->numExtents) {
+		memset (&raid->extents[n], 0, (raid->numExtents - n) * sizeof (metaExtent));
+		dirtyTable (raid, &raid->extents[first], (raid->numExtents - first) * sizeof (metaExtent));
+		raid->numExtents = n;
+	}
+}
+
+// Every extent with blocks, sorted
+static int usedRanges (nvmeRaid *raid, blockRange *r) {
+	uint32_t i;
+	int n = 0;
+
+	for (i = 0; i < raid->maxFiles; i++) {
+		metaFile *f = &raid->files[i];
+		if (f->name[0] != 0 && f->endBlock > f->startBlock) {
+			r[n++] = (blockRange){f->startBlock, f->endBlock, f, NULL};
+		}
+	}
+	for (i = 0; i < raid->numExtents; i++) {
+		metaExtent *e = &raid->extents[i];
+		r[n++]        = (blockRange){e->startBlock, e->endBlock, &raid->files[e->file - 1], e};
+	}
+	qsort (r, n, sizeof (blockRange), cmpRangeStart);
+	return n;
+}
+
+// The holes between the used extents, sorted. Contiguous free blocks are always one range
+static int freeRanges (nvmeRaid *raid, blockRange *r) {
+	blockRange *used = allocRangeArray (raid);
+	uint64_t unit = allocUnit (raid), cursor = firstBlock (raid);
+	int nused = usedRanges (raid, used), i, n = 0;
+
+	for (i = 0; i <= nused; i++) {
+		uint64_t start = (cursor + unit - 1) / unit * unit;
+		uint64_t end   = i < nused ? used[i].start : raid->totalBlocks;
+
+		if (start < end) {
+			r[n++] = (blockRange){start, end, NULL, NULL};
+		}
+		if (i < nused && used[i].end > cursor) {
+			cursor = used[i].end;
+		}
+	}
+	free (used);
+	return n;
+}
+
+// Best fit, the smallest free range where it fits. If there is not, the biggest ones first, so
+// the file gets as few extents as possible. Returns the number of extents, -1 if no space
+static int allocRanges (nvmeRaid *raid, uint64_t blsize, blockRange *out, int max) {
+	blockRange *fr = allocRangeArray (raid);
+	int n = freeRanges (raid, fr), best = -1, i, k = 0;
+
+	for (i = 0; i < n; i++) {
+		uint64_t len = fr[i].end - fr[i].start;
+		if (len >= blsize && (best < 0 || len < fr[best].end - fr[best].start)) {
+			best = i;
+		}
+	}
+	if (best >= 0) {
+		out[0] = (blockRange){fr[best].start, fr[best].start + blsize, NULL, NULL};
+		free (fr);
+		return 1;
+	}
+
+	qsort (fr, n, sizeof (blockRange), cmpRangeSize);
+	for (i = 0; i < n && k < max && blsize; i++) {
+		uint64_t len = fr[i].end - fr[i].start;
+		if (len > blsize) {
+			len = blsize;
+		}
+		out[k++] = (blockRange){fr[i].start, fr[i].start + len, NULL, NULL};
+		blsize -= len;
+	}
+	free (fr);
+	if (blsize) {
+		return -1;
+	}
+	qsort (out, k, sizeof (blockRange), cmpRangeStart);  // the file goes forward in the disks
+	return k;
+}
+
+uint64_t blocksLeft (nvmeRaid *raid) {
+	blockRange *fr = allocRangeArray (raid);
+	uint64_t left  = 0;
+	int i, n = freeRanges (raid, fr);
+
+	for (i = 0; i < n; i++) {
+		left += fr[i].end - fr[i].start;
+	}
+	free (fr);
+	return left;
+}
+
+uint64_t biggestFreeBlocks (nvmeRaid *raid) {
+	blockRange *fr   = allocRangeArray (raid);
+	uint64_t biggest = 0;
+	int i, n = freeRanges (raid, fr);
+
+	for (i = 0; i < n; i++) {
+		if (fr[i].end - fr[i].start > biggest)
+			biggest = fr[i].end - fr[i].start;
+	}
+	free (fr);
+	return biggest;
+}
+
+uint64_t rightFreeBlocks (nvmeRaid *raid) {
+	return raid->totalBlocks - rightFreeBlock (raid);
+}
+
+uint64_t rightFreeBlock (nvmeRaid *raid) {
+	blockRange *used   = allocRangeArray (raid);
+	uint64_t mostRight = firstBlock (raid);
+	int i, n = usedRanges (raid, used);
+
+	for (i = 0; i < n; i++) {
+		if (mostRight < used[i].end)
+			mostRight = used[i].end;
+	}
+	free (used);
+	return mostRight;
+}
+
+metaFile *findFile (nvmeRaid *raid, const char *const name) {
+	uint32_t i = hashSlot (raid, name);
+
+	return raid->hash[i] ? &raid->files[raid->hash[i] - 1] : NULL;
+}
+
+metaFile *addFile (nvmeRaid *raid, const char *const name, uint64_t blsize) {
+	blockRange *r;
+	metaFile *f = NULL;
+	uint32_t i;
+	int k, n;
+
+	// TODO: set errno to the specific error
+	if (findFile (raid, name))
+		return NULL;
+	// the blocks freed in this batch are not reused until they are deallocated
+	if (raid->numTrims && commitRaid (raid))
+		return NULL;
+	if (raid->numFiles == raid->maxFiles)
+		return NULL;
+	// check filename
+	if (name[0] == 0)
+		return NULL;
+	// find a place for it
+	for (i = 0; i < raid->maxFiles && f == NULL; i++) {
+		if (raid->files[i].name[0] == 0) {
+			f = &raid->files[i];
+		}
+	}
+
+	// Check for space, with the extents left in the table
+	r = allocRangeArray (raid);
+	n = allocRanges (raid, blsize, r, raid->maxExtents - raid->numExtents + 1);
+	if (n < 0) {
+		free (r);
+		return NULL;
+	}
+
+	strncpy (f->name, name, NAMELENGTH);
+	f->startBlock = n ? r[0].start : 0;
+	f->endBlock   = n ? r[0].end : 0;
+	dirtyTable (raid, f, sizeof (metaFile));
+	for (k = 1; k < n; k++) {
+		metaExtent *e = &raid->extents[raid->numExtents++];
+
+		e->startBlock = r[k].start;
+		e->endBlock   = r[k].end;
+		e->file       = f - raid->files + 1;
+		dirtyTable (raid, e, sizeof (metaExtent));
+	}
+	free (r);
+	hashAdd (raid, f - raid->files);
+	raid->numFiles++;
+
+	updateRaid (raid);
+	return f;
+}
+
+uint8_t delFile (nvmeRaid *raid, const char *const name) {
+	// check filename
+	if (name[0] == 0)
+		return 0;
+	metaFile *f = findFile (raid, name);
+	if (f) {
+		blockRange *r = malloc (fileExtents (raid, f) * sizeof (blockRange));
+		int n, k;
+
+		if (r == NULL) {
+			return 0;
+		}
+		for (n = 0; fileExtent (raid, f, n, &r[n].start, &r[n].end) == 0; n++)
+			;
+		dropExtents (raid, f, 0);
+		hashDel (raid, f - raid->files);
+		memset (f, 0, sizeof (metaFile));
+		dirtyTable (raid, f, sizeof (metaFile));
+		raid->numFiles--;
+
+		// so the disks stop keeping its data
+		for (k = 0; k < n; k++) {
+			releaseBlocks (raid, r[k].start, r[k].end - r[k].start);
+		}
+		free (r);
+
+		updateRaid (raid);
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+int fileExtent (nvmeRaid *raid, metaFile *file, int n, uint64_t *start, uint64_t *end) {
+	metaExtent *e;
+
+	if (n == 0) {
+		*start = file->startBlock;
+		*end   = file->endBlock;
+		return 0;
+	}
+	e = tableExtent (raid, file, n);
+	if (e == NULL) {
+		return -1;
+	}
+	*start = e->startBlock;
+	*end   = e->endBlock;
+	return 0;
+}
+
+int fileExtents (nvmeRaid *raid, metaFile *file) {
+	uint64_t start, end;
+	int n = 0;
+
+	while (fileExtent (raid, file, n, &start, &end) == 0) {
+		n++;
+	}
+	return n;
+}
+
+uint64_t fileBlocks (nvmeRaid *raid, metaFile *file) {
+	uint64_t start, end, blocks = 0;
+	int n;
+
+	for (n = 0; fileExtent (raid, file, n, &start, &end) == 0; n++) {
+		blocks += end - start;
+	}
+	return blocks;
+}
+
+int fileMap (nvmeRaid *raid, metaFile *file, uint64_t offset, uint64_t *lba, uint64_t *count) {
+	uint64_t start, end;
+	int n;
+
+	for (n = 0; fileExtent (raid, file, n, &start, &end) == 0; n++) {
+		if (offset < end - start) {
+			*lba   = start + offset;
+			*count = end - start - offset;
+			return 0;
+		}
+		offset -= end - start;
+	}
+	return -1;
+}
+
+int fileDiskExtent (
+    nvmeRaid *raid, metaFile *file, uint8_t disk, int *n, uint64_t *first, uint64_t *last) {
+	uint64_t start, end, split;
+
+	// *n counts two parts of each extent, the second one empty unless it is being expanded
+	while (fileExtent (raid, file, (*n + 1) / 2, &start, &end) == 0) {
+		split = super_getsplit (raid, start, end);
+		if (++*n % 2) {
+			start = split;
+		} else {
+			end = split;
+		}
+		if (start < end && super_getrange (raid, start, end, disk, first, last) &&
+		    *last - *first >= SUPERSECTORNUM) {
+			return 0;
+		}
+	}
+	*first = *last = 0;
+	return -1;
+}
+
+int truncFile (nvmeRaid *raid, metaFile *file, uint64_t blocks) {
+	uint64_t start, end, size = blocks;
+	blockRange *drop;
+	int n, k = 0, keep = 0;
+
+	if (blocks > fileBlocks (raid, file)) {
+		return -1;
+	}
+	drop = malloc (fileExtents (raid, file) * sizeof (blockRange));
+	if (drop == NULL) {
+		return -1;
+	}
+
+	for (n = 0; fileExtent (raid, file, n, &start, &end) == 0; n++) {
+		uint64_t len = blocks < end - start ? blocks : end - start;
+
+		if (n > 0 && len == 0) {  // the whole extent goes away
+			drop[k++] = (blockRange){start, end, NULL, NULL};
+			continue;
+		}
+		if (len < end - start) {
+			drop[k++] = (blockRange){start + len, end, NULL, NULL};
+			if (n == 0) {
+				file->endBlock = start + len;
+				dirtyTable (raid, file, sizeof (metaFile));
+			} else {
+				metaExtent *e = tableExtent (raid, file, n);
+				e->endBlock   = start + len;
+				dirtyTable (raid, e, sizeof (metaExtent));
+			}
+		}
+		if (n > 0) {
+			keep++;
+		}
+		blocks -= len;
+	}
+	dropExtents (raid, file, keep);
+	if (file->indexBlocks && size < file->indexBlock + file->indexBlocks) {
+		file->indexBlock  = 0;
+		file->indexBlocks = 0;
+		dirtyTable (raid, file, sizeof (metaFile));
+	}
+	for (n = 0; n < k; n++) {
+		releaseBlocks (raid, drop[n].start, drop[n].end - drop[n].start);
+	}
+	free (drop);
+
+	updateRaid (raid);
+	return 0;
+}
+
+int growFile (nvmeRaid *raid, metaFile *file, uint64_t blocks) {
+	uint64_t unit = allocUnit (raid), start, end, len = 0;
+	metaExtent *last = NULL;
+	blockRange *r;
+	int n = fileExtents (raid, file) - 1, i, k;
+
+	blocks = (blocks + unit - 1) / unit * unit;
+	// the blocks freed before are not reused until they are deallocated
+	if (raid->numTrims && commitRaid (raid)) {
+		return -1;
+	}
+	fileExtent (raid, file, n, &start, &end);
+	if (n > 0) {
+		last = tableExtent (raid, file, n);
+	}
+
+	// in place, the free blocks right after its last extent
+	r = allocRangeArray (raid);
+	if (end > start) {
+		int nfree = freeRanges (raid, r);
+
+		for (i = 0; i < nfree; i++) {
+			if (r[i].start == (end + unit - 1) / unit * unit) {
+				len = r[i].end - end < blocks ? r[i].end - end : blocks;
+				break;
+			}
+		}
+		if (len) {
+			if (last) {
+				last->endBlock += len;
+				dirtyTable (raid, last, sizeof (metaExtent));
+			} else {
+				file->endBlock += len;
+				dirtyTable (raid, file, sizeof (metaFile));
+			}
+		}
+	}
+
+	// and the rest in new extents (the first one in its metaFile, if it has no blocks yet)
+	if (blocks > len) {
+		int empty = end == start && n == 0;
+
+		k = allocRanges (raid, blocks - len, r, raid->maxExtents - raid->numExtents + empty);
+		if (k < 0) {
+			if (last) {
+				last->endBlock -= len;
+			} else {
+				file->endBlock -= len;
+			}
+			free (r);
+			return -1;
+		}
+		for (i = 0; i < k; i++) {
+			metaExtent *e;
+
+			if (i == 0 && empty) {
+				file->startBlock = r[0].start;
+				file->endBlock   = r[0].end;
+				dirtyTable (raid, file, sizeof (metaFile));
+				continue;
+			}
+			e             = &raid->extents[raid->numExtents++];
+			e->startBlock = r[i].start;
+			e->endBlock   = r[i].end;
+			e->file       = file - raid->files + 1;
+			dirtyTable (raid, e, sizeof (metaExtent));
+		}
+	}
+	free (r);
+
+	updateRaid (raid);
+	return 0;
+}
+
+void setFileIndex (nvmeRaid *raid, metaFile *file, uint64_t block, uint32_t blocks) {
+	file->indexBlock  = blocks ? block : 0;
+	file->indexBlocks = blocks;
+	dirtyTable (raid, file, sizeof (metaFile));
+	updateRaid (raid);
+}
+
+void setFileLayout (nvmeRaid *raid, metaFile *file, uint8_t layout) {
+	file->layout = layout;
+	dirtyTable (raid, file, sizeof (metaFile));
+	updateRaid (raid);
+}
+
+int deallocFile (nvmeRaid *raid, metaFile *file) {
+	uint64_t start, end;
+	int n, error = 0;
+
+	for (n = 0; fileExtent (raid, file, n, &start, &end) == 0; n++) {
+		if (sio_rdeallocate (raid, start, end - start)) {
+			error = -1;
+		}
+	}
+	return error;
+}
+
+static void copyComplete (void *arg, int error) {
+	if (error) {
+		*(int *)arg = -1;
+	}
+}
+
+// Copies raid blocks, a gigasector at a time
+static int copyBlocks (nvmeRaid *raid, uint64_t dst, uint64_t src, uint64_t count) {
+	sioBuff *buff = sio_getbuff (GIGASECTORLENGTH);
+	int error     = 0;
+
+	if (buff == NULL) {
+		puts ("Not enough pinned memory to move the data");
+		return -1;
+	}
+	while (count && !error) {
+		uint32_t n = count < GIGASECTORNUM ? count : GIGASECTORNUM;
+
+		if (sio_rread_async (raid, buff->mem, src, n, copyComplete, &error) < 0) {
+			error = -1;
+		}
+		sio_waittasks (raid);
+		if (!error && sio_rwrite_async (raid, buff->mem, dst, n, copyComplete, &error) < 0) {
+			error = -1;
+		}
+		sio_waittasks (raid);
+
+		count -= n;
+		src += n;
+		dst += n;
+	}
+	sio_putbuff (buff);
+	return error;
+}
+
+// The highest extent that fits in the lowest hole goes there, until none fits. The data is
+// copied before the meta-data points to it, and the moves keep the place of each stripe in the
+// cycle, so the files written per disk (spcap) are still contiguous in every disk
+int compactRaid (nvmeRaid *raid) {
+	blockRange *used = allocRangeArray (raid), *fr = allocRangeArray (raid);
+	uint64_t unit    = allocUnit (raid);
+	int moves = 0, moved;
+
+	do {
+		int nfree, nused, i, j;
+
+		// the old places must be deallocated before they are reused
+		if (raid->numTrims && commitRaid (raid)) {
+			moves = -1;
+			goto out;
+		}
+		nfree = freeRanges (raid, fr);
+		nused = usedRanges (raid, used);
+
+		moved = 0;
+		for (i = 0; i < nfree && !moved; i++) {
+			for (j = nused - 1; j >= 0 && used[j].start > fr[i].start; j--) {
+				uint64_t len = used[j].end - used[j].start;
+				uint64_t dst = fr[i].start + used[j].start % unit;
+
+				if (dst + len > fr[i].end) {
+					continue;
+				}
+				printf ("Moving %lu blocks of %.*s from %lu to %lu\n",
+				        len,
+				        NAMELENGTH,
+				        used[j].file->name,
+				        used[j].start,
+				        dst);
+				if (copyBlocks (raid, dst, used[j].start, len)) {
+					printf ("Error moving the data of %.*s\n", NAMELENGTH, used[j].file->name);
+					moves = -1;
+					goto out;
+				}
+				if (used[j].extent) {
+					used[j].extent->startBlock = dst;
+					used[j].extent->endBlock   = dst + len;
+					dirtyTable (raid, used[j].extent, sizeof (metaExtent));
+				} else {
+					used[j].file->startBlock = dst;
+					used[j].file->endBlock   = dst + len;
+					dirtyTable (raid, used[j].file, sizeof (metaFile));
+				}
+				releaseBlocks (raid, used[j].start, len);
+				updateRaid (raid);
+
+				moves++;
+				moved = 1;
+				break;
+			}
+		}
+	} while (moved);
+out:
+	free (used);
+	free (fr);
+	return moves;
+}
+
+// Expansion. The stripes go in order to the new stripe map, a window at a time. The old disks keep
+// their stripes per cycle, and the cycle gets longer, so each stripe goes to a lower row than the
+// one it had (in the new disks, nothing was there): once the windows start far enough, the
+// stripes a window overwrites were already moved, and an interrupted window can be moved again.
+// The first stripes, until there, are copied to the backup rows before (at the end of the new
+// disks, not used until the expansion ends) and moved from there. The progress is kept in the
+// meta sectors, the smallest one is used
+#define EXPANDWINDOW (64lu * 1024lu * 1024lu)  // bytes moved between checkpoints
+
+enum { EXPAND_OLD, EXPAND_NEW, EXPAND_BACKUP };
+
+// Disk and disk lba of a stripe, in the new stripe map or in the old one
+static uint8_t mapStripe (nvmeRaid *raid, uint64_t id, int old, uint64_t *lba) {
+	uint32_t cycle        = old ? raid->expandCycle : raid->stripeCycle;
+	const uint8_t *map    = old ? raid->expandMap : raid->stripeMap;
+	const uint8_t *rank   = old ? raid->expandRank : raid->stripeRank;
+	const uint8_t *weight = old ? raid->expandWeight : raid->weight;
+	uint32_t pos          = id % cycle;
+	uint64_t row          = (id / cycle) * weight[map[pos]] + rank[pos];
+
+	*lba = (row + raid->metaStripes) * SUPERSECTORNUM;
+	return map[pos];
+}
+
+static int expandOld (nvmeRaid *raid, uint64_t id) {
+	return raid->expandDisks && id >= raid->expandStripe;
+}
+
+static uint64_t expandWindow (nvmeRaid *raid) {
+	uint64_t window = EXPANDWINDOW / SUPERSECTORLENGTH;
+	return window ? window : 1;
+}
+
+// The stripes moved through the backup rows
+static uint64_t expandFirst (nvmeRaid *raid) {
+	uint64_t co = raid->expandCycle, cn = raid->stripeCycle;
+	uint64_t first = (expandWindow (raid) * co + 2 * co * cn + cn - co - 1) / (cn - co);
+	uint64_t stripes = raid->totalBlocks / SUPERSECTORNUM;
+
+	return first < stripes ? first : stripes;
+}
+
+// Where stripe id is in a place. The backup rows follow, in each new disk, the ones the new stripe
+// map gives to the stripes of the raid before the expansion
+static uint8_t expandPlace (nvmeRaid *raid, uint64_t id, int place, uint64_t *lba) {
+	if (place == EXPAND_BACKUP) {
+		uint64_t stripes = raid->totalBlocks / SUPERSECTORNUM;
+		int newDisks     = raid->numdisks - raid->expandDisks;
+		uint8_t disk     = raid->expandDisks + id % newDisks;
+		uint64_t rows    = (stripes + raid->stripeCycle - 1) / raid->stripeCycle * raid->weight[disk];
+
+		*lba = (raid->metaStripes + rows + id / newDisks) * SUPERSECTORNUM;
+		return disk;
+	}
+	return mapStripe (raid, id, place == EXPAND_OLD, lba);
+}
+
+// Copies stripes [first, first + count) from one place to another, every disk at the same time
+static int expandCopy (
+    nvmeRaid *raid, sioBuff *buff, uint64_t first, uint64_t count, int from, int to) {
+	int error = 0;
+	uint64_t i, lba;
+	uint8_t disk;
+	int mirror;
+
+	for (i = 0; i < count && !error; i++) {
+		disk = expandPlace (raid, first + i, from, &lba);
+		if (sio_read_async (&raid->disk[disk],
+		                    (char *)buff->mem + i * SUPERSECTORLENGTH,
+		                    lba,
+		                    SUPERSECTORNUM,
+		                    metaError,
+		                    &error)) {
+			error = -1;
+		}
+	}
+	sio_waittasks (raid);
+
+	for (i = 0; i < count && !error; i++) {
+		char *p = (char *)buff->mem + i * SUPERSECTORLENGTH;
+
+		disk   = expandPlace (raid, first + i, to, &lba);
+		mirror = to == EXPAND_BACKUP ? -1 : super_getmirror (raid, disk);
+		if (sio_write_async (&raid->disk[disk], p, lba, SUPERSECTORNUM, metaError, &error) ||
+		    (mirror >= 0 &&
+		     sio_write_async (&raid->disk[mirror], p, lba, SUPERSECTORNUM, metaError, &error))) {
+			error = -1;
+		}
+	}
+	sio_waittasks (raid);
+	return error;
+}
+
+// The progress, in every meta sector. It is flushed before returning. -1 if what was moved or the
+// meta sectors did not reach the disks, and then the last checkpoint stays
+static int expandCheckpoint (nvmeRaid *raid, uint64_t stripe, int backup, int done) {
+	metaSector old[MAXDISKS];
+	int i;
+
+	if (sio_rflush (raid)) {  // what was moved
+		puts ("Error flushing the moved stripes");
+		return -1;
+	}
+	for (i = 0; i < raid->numdisks; i++) {
+		metaSector *m = &raid->disk[i].msector;
+
+		old[i]          = *m;
+		m->expandStripe = done ? 0 : stripe;
+		m->expandBackup = backup;
+		if (done) {
+			m->expandDisks = 0;
+			memset (m->expandWeights, 0, sizeof (m->expandWeights));
+		}
+	}
+	raid->metaDirty = 1;
+	if (writeTable (raid, 0, 0)) {  // a disk may have it, expandState takes the oldest one
+		puts ("Error writing the progress of the expansion");
+		for (i = 0; i < raid->numdisks; i++) {
+			raid->disk[i].msector = old[i];
+		}
+		return -1;
+	}
+	raid->expandStripe = stripe;
+	return 0;
+}
+
+// The first stripes, through the backup rows. If they are already there (an interrupted
+// expansion), only from them
+static int expandBackup (nvmeRaid *raid, sioBuff *buff, int resume) {
+	uint64_t first = expandFirst (raid), window = expandWindow (raid), s, n;
+
+	for (s = 0; !resume && s < first; s += n) {
+		n = first - s < window ? first - s : window;
+		if (expandCopy (raid, buff, s, n, EXPAND_OLD, EXPAND_BACKUP)) {
+			puts ("Error copying the first stripes to the backup rows");
+			return -1;
+		}
+	}
+	if (!resume && expandCheckpoint (raid, 0, 1, 0)) {
+		return -1;
+	}
+
+	for (s = 0; s < first; s += n) {
+		n = first - s < window ? first - s : window;
+		if (expandCopy (raid, buff, s, n, EXPAND_BACKUP, EXPAND_NEW)) {
+			puts ("Error moving the first stripes from the backup rows");
+			return -1;
+		}
+	}
+	return expandCheckpoint (raid, first, 0, 0);
+}
+
+// The expansion of the meta sectors, if any. A checkpoint may not have reached every disk
+static void expandState (nvmeRaid *raid) {
+	int i, backup = 0;
+
+	raid->expandDisks = 0;
+	for (i = 0; i < raid->numdisks; i++) {
+		metaSector *m = &raid->disk[i].msector;
+
+		if (m->expandDisks == 0) {
+			continue;
+		}
+		if (raid->expandDisks == 0 || m->expandStripe < raid->expandStripe) {
+			raid->expandStripe = m->expandStripe;
+			backup             = m->expandBackup;
+		} else if (m->expandStripe == raid->expandStripe) {
+			backup |= m->expandBackup;
+		}
+		raid->expandDisks = m->expandDisks;
+		memcpy (raid->expandWeight, m->expandWeights, MAXDISKS);
+	}
+	if (raid->expandDisks == 0) {
+		return;
+	}
+
+	raid->expandCycle = fillStripeMap (
+	    raid, raid->expandWeight, raid->expandDisks, raid->expandMap, raid->expandRank);
+	for (i = 0; i < raid->numdisks; i++) {
+		raid->disk[i].msector.expandBackup = backup;
+	}
+}
+
+// An interrupted move from the backup rows must end before the first stripes are used
+static int expandResume (nvmeRaid *raid) {
+	sioBuff *buff;
+	int ret;
+
+	printf ("The raid is being expanded, %lu of %lu stripes moved\n",
+	        raid->expandStripe,
+	        raid->totalBlocks / SUPERSECTORNUM);
+	if (!raid->disk[0].msector.expandBackup) {
+		return 0;
+	}
+	buff = sio_getbuff (expandWindow (raid) * SUPERSECTORLENGTH);
+	if (buff == NULL) {
+		puts ("Not enough pinned memory to move the stripes");
+		return -1;
+	}
+	ret = expandBackup (raid, buff, 1);
+	sio_putbuff (buff);
+	return ret;
+}
+
+void expandRaid (nvmeRaid *raid, const uint8_t *weights, int nweights) {
+	int status[MAXDISKS], taken[MAXDISKS] = {0};
+	int i, ref = -1, oldDisks, newDisks, id;
+	metaSector m;
+
+	if (checkRaidSectors (raid) || readMetas (raid, status)) {
+		puts ("Can't read the meta-data of the NVMes");
+		exit (-1);
+	}
+	for (i = 0; i < raid->numdisks; i++) {
+		metaSector *d = &raid->disk[i].msector;
+
+		if (!checkMeta (d)) {
+			continue;
+		}
+		if (upgradeMeta (d) < 0) {
+			puts ("Can't upgrade the raid meta-data. Attach only the raid NVMes");
+			exit (-1);
+		}
+		if (ref < 0 || (d->expandDisks && !raid->disk[ref].msector.expandDisks)) {
+			ref = i;
+		}
+	}
+	if (ref < 0) {
+		puts ("There is no raid in these NVMes. Format them");
+		exit (-1);
+	}
+	m = raid->disk[ref].msector;
+
+	if (m.expandDisks) {  // resumed: the meta-data of some NVMes may be missing
+		oldDisks = m.expandDisks;
+		if (m.totalDisks != raid->numdisks) {
+			printf ("The raid is being expanded to %u NVMes, %d attached\n", m.totalDisks, raid->numdisks);
+			exit (-1);
+		}
+		for (i = 0; i < raid->numdisks; i++) {  // the checkpoint every disk has
+			metaSector *d = &raid->disk[i].msector;
+
+			if (checkMeta (d) && d->expandDisks && d->expandStripe < m.expandStripe) {
+				m.expandStripe = d->expandStripe;
+				m.expandBackup = d->expandBackup;
+			}
+		}
+	} else {
+		oldDisks = m.totalDisks;
+		newDisks = raid->numdisks - oldDisks;
+		if (newDisks <= 0) {
+			puts ("There are no new NVMes to add to the raid");
+			exit (-1);
+		}
+		if (m.mirrored && newDisks % 2) {
+			puts ("A mirrored raid grows by pairs of NVMes");
+			exit (-1);
+		}
+		if (nweights && nweights != newDisks) {
+			printf ("%d weights for %d new disks\n", nweights, newDisks);
+			exit (-1);
+		}
+
+		// the old disks keep their stripes per cycle
+		m.expandDisks = oldDisks;
+		memcpy (m.expandWeights, m.weights, MAXDISKS);
+		for (i = oldDisks; i < raid->numdisks; i++) {
+			uint8_t w = MAXWEIGHT;
+			int j;
+
+			for (j = 0; j < oldDisks; j++) {
+				if ((m.weights[j] ? m.weights[j] : 1) < w)
+					w = m.weights[j] ? m.weights[j] : 1;
+			}
+			m.weights[i] = nweights ? weights[i - oldDisks] : w;
+		}
+		m.totalDisks   = raid->numdisks;
+		m.expandStripe = 0;
+		m.expandBackup = 0;
+	}
+
+	// the NVMes of the raid keep their ids, the new ones take the next ones
+	for (i = 0; i < raid->numdisks; i++) {
+		metaSector *d = &raid->disk[i].msector;
+
+		if (checkMeta (d) && d->diskId < raid->numdisks &&
+		    (d->diskId < oldDisks || d->expandDisks) && !taken[d->diskId]) {
+			taken[d->diskId] = 1;
+		} else {
+			d->MAGIC = 0;  // new
+		}
+	}
+	for (i = 0; i < oldDisks; i++) {
+		if (!taken[i]) {
+			printf ("Disk %d of the raid is not attached\n", i);
+			exit (-1);
+		}
+	}
+
+	// the table of the raid, copied to the new NVMes
+	raid->stripeLength  = m.stripeLength;
+	raid->metaStripes   = m.metaStripes ? m.metaStripes : 1;
+	raid->journalLength = m.journalLength;
+	{
+		uint64_t first = METAAREALENGTH / SECTORLENGTH;
+		uint64_t count = raid->metaStripes * SUPERSECTORNUM - first;
+		sioBuff *buff  = sio_getbuff (count * SECTORLENGTH);
+		int error      = 0;
+
+		if (buff == NULL) {
+			puts ("Not enough pinned memory for the file table");
+			exit (-1);
+		}
+		if (sio_read (&raid->disk[ref], buff->mem, first, count)) {
+			puts ("Can't read the file table");
+			exit (-1);
+		}
+		for (i = 0; i < raid->numdisks; i++) {
+			if (raid->disk[i].msector.MAGIC == MAGICNUMBER) {
+				continue;
+			}
+			if (sio_write_async (&raid->disk[i], buff->mem, first, count, metaError, &error)) {
+				error = -1;
+			}
+		}
+		sio_waittasks (raid);
+		sio_putbuff (buff);
+		if (error) {
+			puts ("Error writing the file table to the new NVMes");
+			exit (-1);
+		}
+	}
+
+	// and the meta sectors of every NVMe
+	for (i = 0, id = oldDisks; i < raid->numdisks; i++) {
+		metaSector *d = &raid->disk[i].msector;
+		uint8_t diskId;
+
+		if (d->MAGIC == MAGICNUMBER) {
+			diskId = d->diskId;
+		} else {
+			while (taken[id])
+				id++;
+			diskId = id++;
+		}
+		*d        = m;
+		d->diskId = diskId;
+	}
+	qsort (raid->disk, raid->numdisks, sizeof (idisk), cmpIDisk);
+
+	// the new ones must hold their share of the raid, and the backup rows
+	raid->mirrored = m.mirrored;
+	memcpy (raid->weight, m.weights, MAXDISKS);
+	buildStripeMap (raid);
+	for (i = 0; i < raid->numdisks; i++) {
+		raid->disk[i].msector.mirrored = m.mirrored;
+		memcpy (raid->disk[i].msector.weights, raid->weight, MAXDISKS);
+	}
+	expandState (raid);
+	raid->totalBlocks = raidBlocks (raid, raid->expandDisks, raid->expandWeight, raid->expandCycle);
+	for (i = raid->expandDisks; i < raid->numdisks && expandFirst (raid); i++) {
+		uint64_t lba, last = expandFirst (raid) - 1;
+
+		last -= last % (raid->numdisks - raid->expandDisks);
+		expandPlace (raid, last + i - raid->expandDisks, EXPAND_BACKUP, &lba);
+		if (lba + SUPERSECTORNUM > sio_numSectors (&raid->disk[i])) {
+			printf ("Disk %d is too small for the raid\n", i);
+			exit (-1);
+		}
+	}
+
+	raid->metaDirty = 1;
+	if (writeTable (raid, 0, 0)) {
+		puts ("Error writing the meta sectors of the expansion");
+		exit (-1);
+	}
+	printf ("The raid has %d NVMes now (it had %d). Stripes per cycle of each disk:",
+	        raid->numdisks,
+	        raid->expandDisks);
+	for (i = 0; i < raid->numdisks; i++) {
+		printf (" %u", raid->weight[i]);
+	}
+	printf ("\n");
+}
+
+int reshapeRaid (nvmeRaid *raid, uint64_t rate) {
+	uint64_t window = expandWindow (raid), stripes = raid->totalBlocks / SUPERSECTORNUM;
+	uint64_t ssn = SUPERSECTORNUM, moved = 0, p, end, a, b;
+	blockRange *used;
+	struct timespec start, now;
+	sioBuff *buff;
+	int n, j = 0, percent = -1;
+
+	if (raid->expandDisks == 0) {
+		puts ("The raid is not being expanded");
+		return 0;
+	}
+	buff = sio_getbuff (window * SUPERSECTORLENGTH);
+	if (buff == NULL) {
+		puts ("Not enough pinned memory to move the stripes");
+		return -1;
+	}
+	if (raid->expandStripe == 0 && expandBackup (raid, buff, 0)) {
+		sio_putbuff (buff);
+		return -1;
+	}
+
+	// only the stripes of the files, in order
+	used = allocRangeArray (raid);
+	n    = usedRanges (raid, used);
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	for (p = raid->expandStripe; p < stripes; p = end) {
+		end = p + window < stripes ? p + window : stripes;
+
+		for (; j < n && used[j].end <= p * ssn; j++)
+			;
+		for (a = p; j < n && a < end; a = b) {
+			uint64_t first = used[j].start / ssn, last = (used[j].end + ssn - 1) / ssn;
+
+			if (first >= end) {
+				break;
+			}
+			a = first > a ? first : a;
+			b = last < end ? last : end;
+			if (a < b && expandCopy (raid, buff, a, b - a, EXPAND_OLD, EXPAND_NEW)) {
+				printf ("Error moving the stripes from %lu\n", a);
+				free (used);
+				sio_putbuff (buff);
+				return -1;
+			}
+			moved += a < b ? b - a : 0;
+			if (last <= end) {
+				j++;
+			}
+		}
+		if (expandCheckpoint (raid, end, 0, 0)) {
+			free (used);
+			sio_putbuff (buff);
+			return -1;
+		}
+
+		if (100 * end / stripes != (uint64_t)percent) {
+			percent = 100 * end / stripes;
+			printf ("\r%3d %% of the raid moved", percent);
+			fflush (stdout);
+		}
+		// throttled, so the disks still serve the rest
+		clock_gettime (CLOCK_MONOTONIC, &now);
+		if (rate) {
+			double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+			double due     = (double)moved * SUPERSECTORLENGTH / (rate * 1e6);
+			if (due > elapsed) {
+				usleep ((due - elapsed) * 1e6);
+			}
+		}
+	}
+	printf ("\n%lu stripes moved\n", moved);
+	free (used);
+	sio_putbuff (buff);
+
+	// the capacity of every disk
+	if (expandCheckpoint (raid, 0, 0, 1)) {
+		return -1;
+	}
+	raid->expandDisks = 0;
+	raid->totalBlocks = raidBlocks (raid, raid->numdisks, raid->weight, raid->stripeCycle);
+	return 0;
+}
+
+// utility functions
+uint64_t super_getid (nvmeRaid *raid, uint64_t lba) {
+	UNUSED (raid);
+	return (lba / SUPERSECTORNUM);
+}
+uint64_t super_getdisk (nvmeRaid *raid, uint64_t lba) {
+	uint64_t id = super_getid (raid, lba), disklba;
+
+	if (expandOld (raid, id)) {  // not moved yet
+		return mapStripe (raid, id, 1, &disklba);
+	}
+	return raid->stripeMap[id % raid->stripeCycle];
+}
+uint64_t super_getdisklba (nvmeRaid *raid, uint64_t lba) {
+	uint64_t id = super_getid (raid, lba), disklba;
+
+	mapStripe (raid, id, expandOld (raid, id), &disklba);  // after the meta-data
+	return disklba + lba % SUPERSECTORNUM;
+}
+uint64_t super_getfirst (nvmeRaid *raid, uint64_t lba, uint8_t disk) {
+	uint32_t i;
+
+	if (super_isreplica (raid, disk)) {  // same stripes, in the same place
+		disk ^= 1;
+	}
+	// every disk has at least one stripe in each cycle
+	for (i = 0; i < raid->stripeCycle; i++) {
+		if (super_getdisk (raid, lba + i * SUPERSECTORNUM) == disk) {
+			return lba + i * SUPERSECTORNUM;
+		}
+	}
+	return lba;
+}
+int super_getrange (
+    nvmeRaid *raid, uint64_t start, uint64_t end, uint8_t disk, uint64_t *first, uint64_t *last) {
+	uint64_t firstStripe, lastStripe, stripe;
+
+	*first = *last = 0;
+	if (end <= start) {
+		return 0;
+	}
+	if (super_isreplica (raid, disk)) {
+		disk ^= 1;
+	}
+
+	// The sectors of the range in every disk are contiguous. Find the first and the last ones
+	firstStripe = start - start % SUPERSECTORNUM;
+	lastStripe  = (end - 1) - (end - 1) % SUPERSECTORNUM;
+	for (stripe = firstStripe;
+	     stripe <= lastStripe && stripe < firstStripe + raid->stripeCycle * SUPERSECTORNUM;
+	     stripe += SUPERSECTORNUM) {
+		if (super_getdisk (raid, stripe) == disk) {
+			*first = super_getdisklba (raid, stripe > start ? stripe : start);
+			break;
+		}
+	}
+	if (!*first) {  // the range does not reach this disk
+		return 0;
+	}
+	for (stripe = lastStripe;; stripe -= SUPERSECTORNUM) {
+		if (super_getdisk (raid, stripe) == disk) {
+			uint64_t stripeEnd = stripe + SUPERSECTORNUM;
+			*last = super_getdisklba (raid, (stripeEnd < end ? stripeEnd : end) - 1) + 1;
+			break;
+		}
+	}
+	return 1;
+}
+uint64_t super_getraidlba (nvmeRaid *raid, uint8_t disk, uint64_t disklba) {
+	uint64_t row = disklba / SUPERSECTORNUM - raid->metaStripes;  // after the meta-data
+	uint32_t pos;
+
+	if (super_isreplica (raid, disk)) {
+		disk ^= 1;
+	}
+	for (pos = 0; pos < raid->stripeCycle; pos++) {
+		if (raid->stripeMap[pos] == disk && raid->stripeRank[pos] == row % raid->weight[disk]) {
+			return ((row / raid->weight[disk]) * raid->stripeCycle + pos) * SUPERSECTORNUM +
+			       disklba % SUPERSECTORNUM;
+		}
+	}
+	return 0;
+}
+int super_getmirror (nvmeRaid *raid, uint8_t disk) {
+	return raid->mirrored ? disk ^ 1 : -1;
+}
+int super_isreplica (nvmeRaid *raid, uint8_t disk) {
+	return raid->mirrored && (disk & 1);
+}
+uint64_t super_getsplit (nvmeRaid *raid, uint64_t start, uint64_t end) {
+	uint64_t moved = raid->expandStripe * SUPERSECTORNUM;
+
+	return raid->expandDisks && start < moved && end > moved ? moved : end;
 }
\ No newline at end of file
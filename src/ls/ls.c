@@ -35,7 +35,7 @@ static void app_paramCheck (void) {
 }
 
 void app_config (int argc, char **argv, struct spdk_env_opts *conf) {
-	UNUSED(conf);
+	conf->mem_size = SIO_TOOLMEMSIZE;  // mapping every hugepage is most of the start-up
 	
 	int c;
 	while (1) {
@@ -72,24 +72,46 @@ void app_run (nvmeRaid *raid) {
 	if (raid->numFiles == 0) {
 		printf ("There is no files in the raid\n");
 	} else {
-		int i, j;
-		int id = 0;
-		for (i = 0; i < raid->numdisks; i++) {
-			for (j = 0; j < MAXFILES; j++, id++) {
-				if (raid->disk[i].msector.content[j].name[0] != 0) {
-					printf ("%02d: %26s\t%lu Sectors\n",
-					        id,
-					        raid->disk[i].msector.content[j].name,
-					        raid->disk[i].msector.content[j].endBlock -
-					            raid->disk[i].msector.content[j].startBlock);
-				}
+		uint32_t i;
+		for (i = 0; i < raid->maxFiles; i++) {
+			metaFile *f = &raid->files[i];
+			spcap_stats stats;
+
+			if (f->name[0] != 0) {
+				printf ("%02u: %26.*s\t%lu Sectors\t%d extents\n",
+				        i,
+				        NAMELENGTH,
+				        f->name,
+				        fileBlocks (raid, f),
+				        fileExtents (raid, f));
+			}
+			// captures keep their summary in their index, one read each
+			if (f->name[0] != 0 && f->indexBlocks && spcapStats (raid, f, &stats) == 0) {
+				double seconds = (stats.lastTime - stats.firstTime) / 1e9;
+
+				printf ("    %lu packets, %lu bytes in %.3f s (%.1f Mb/s, peak %.1f Mb/s)\n",
+				        stats.packets,
+				        stats.bytes,
+				        seconds,
+				        seconds > 0 ? stats.bytes * 8 / seconds / 1e6 : 0,
+				        stats.peakRate * 8 / 1e6);
 			}
 		}
-		printf ("\n Showing all %d files.\n", raid->numFiles);
+		printf ("\n Showing all %d files (room for %u).\n", raid->numFiles, raid->maxFiles);
 		printf ("\n %lu Block reserved/used from %lu total (%lf %%)\n",
-		        raid->totalBlocks - rightFreeBlocks (raid),
+		        raid->totalBlocks - blocksLeft (raid),
 		        raid->totalBlocks,
-		        100*((double)raid->totalBlocks - rightFreeBlocks (raid)) / ((double)rightFreeBlocks (raid)));
+		        100 * ((double)raid->totalBlocks - blocksLeft (raid)) / ((double)raid->totalBlocks));
+		printf (" %lu Blocks free, the biggest free extent has %lu\n",
+		        blocksLeft (raid),
+		        biggestFreeBlocks (raid));
+		if (raid->expandDisks) {
+			printf (" Expanding from %u to %d NVMes: %lu of %lu stripes moved\n",
+			        raid->expandDisks,
+			        raid->numdisks,
+			        raid->expandStripe,
+			        raid->totalBlocks / SUPERSECTORNUM);
+		}
 	}
 	return;
 }
@@ -34,6 +34,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <rte_config.h>
@@ -44,7 +45,8 @@
 
 #include <common.h>
 
-nvmeRaid myRaid = {.numdisks = 0, .totalBlocks = 0};
+nvmeRaid myRaid = {.numdisks = 0, .totalBlocks = 0, .stripeLength = DEFAULTSTRIPELENGTH,
+                   .sectorLength = DEFAULTSECTORLENGTH};
 
 static void register_ns (struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns) {
 	const struct spdk_nvme_ctrlr_data *cdata;
@@ -71,18 +73,33 @@ static void register_ns (struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns)
 	        spdk_nvme_ns_get_id (ns),
 	        spdk_nvme_ns_get_size (ns) / 1000000000);
 
-	myRaid.disk[myRaid.numdisks].ctrlr = ctrlr;
-	myRaid.disk[myRaid.numdisks].ns    = ns;
-	myRaid.disk[myRaid.numdisks].qpair =
-	    spdk_nvme_ctrlr_alloc_io_qpair (ctrlr, SPDK_NVME_QPRIO_URGENT);
-	if (myRaid.disk[myRaid.numdisks].qpair == NULL) {
-		printf ("ERROR: spdk_nvme_ctrlr_alloc_io_qpair() failed\n");
+	if (sio_initnvme (&myRaid.disk[myRaid.numdisks], ctrlr, ns)) {
 		return;
 	}
-	myRaid.totalBlocks += spdk_nvme_ns_get_num_sectors (ns);
+	myRaid.totalBlocks += sio_numSectors (&myRaid.disk[myRaid.numdisks]);
 	myRaid.numdisks++;
 }
 
+// Kernel drives or files (io_uring), instead of the NVMe owned by spdk
+static int register_files (char *files) {
+	char *path, *save = NULL;
+
+	for (path = strtok_r (files, ",", &save); path; path = strtok_r (NULL, ",", &save)) {
+		if (myRaid.numdisks == MAXDISKS) {
+			fprintf (stderr, "Too many disks, the limit is %d\n", MAXDISKS);
+			return -1;
+		}
+
+		printf ("Opening %s\n", path);
+		if (sio_initfile (&myRaid.disk[myRaid.numdisks], path)) {
+			return -1;
+		}
+		myRaid.totalBlocks += sio_numSectors (&myRaid.disk[myRaid.numdisks]);
+		myRaid.numdisks++;
+	}
+	return 0;
+}
+
 struct hello_world_sequence {
 	struct ns_entry *ns_entry;
 	char *buf;
@@ -124,7 +141,40 @@ static void attach_cb (void *cb_ctx,
 	}
 }
 
+// Start-up phases, so a slow one can be spotted
+enum { PHASE_ENV, PHASE_ATTACH, PHASE_INIT, PHASE_RAID, PHASE_BUFFS, NUM_PHASES };
+static const char *phaseName[NUM_PHASES] = {"env", "attach", "app", "raid", "buffers"};
+static double phaseTime[NUM_PHASES];
+static struct timespec phaseStart;
+
+static void phase_end (int phase) {
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	phaseTime[phase] = (now.tv_sec - phaseStart.tv_sec) * 1e3 +
+	                   (now.tv_nsec - phaseStart.tv_nsec) / 1e6;
+	phaseStart = now;
+}
+
+static void phase_print (void) {
+	double total = 0;
+	int i;
+
+	printf ("Start-up:");
+	for (i = 0; i < NUM_PHASES; i++) {
+		printf (" %s %.1f ms,", phaseName[i], phaseTime[i]);
+		total += phaseTime[i];
+	}
+	printf (" total %.1f ms\n", total);
+}
+
 static void cleanup (void) {
+	int i;
+
+	for (i = 0; i < myRaid.numdisks; i++) {
+		sio_freedisk (&myRaid.disk[i]);
+	}
+	sio_freebuffs ();
 }
 
 int main (int argc, char **argv) {
@@ -138,7 +188,22 @@ int main (int argc, char **argv) {
 
 	// First of all, try to configure the app
 	app_config (argc, argv, &opts);
+	clock_gettime (CLOCK_MONOTONIC, &phaseStart);
 	spdk_env_init (&opts);
+	phase_end (PHASE_ENV);
+
+	if (getenv ("SIO_FILES")) {
+		// strtok_r writes in it, and the environment is not ours
+		char *files = strdup (getenv ("SIO_FILES"));
+
+		if (files == NULL || register_files (files)) {
+			free (files);
+			cleanup ();
+			return 1;
+		}
+		free (files);
+		goto attached;
+	}
 
 	printf ("Attaching to NVMe Controllers\n");
 
@@ -147,7 +212,9 @@ int main (int argc, char **argv) {
 	 *  for each NVMe controller found, giving our application a choice on
 	 *  whether to attach to each controller.  attach_cb will then be
 	 *  called for each controller after the SPDK NVMe driver has completed
-	 *  initializing the controller we chose to attach.
+	 *  initializing the controller we chose to attach. The controllers are
+	 *  initialized at the same time, so attaching all takes as long as the
+	 *  slowest one.
 	 */
 	rc = spdk_nvme_probe (NULL, NULL, probe_cb, attach_cb, NULL);
 	if (rc != 0) {
@@ -156,12 +223,22 @@ int main (int argc, char **argv) {
 		return 1;
 	}
 
+attached:
+	phase_end (PHASE_ATTACH);
 	printf ("Attach completed.\n");
 	printf ("Starting NVMe-Raid\n");
 
 	app_init (&myRaid);
-	createRaid (&myRaid);
+	phase_end (PHASE_INIT);
+	createRaid (&myRaid);  // the meta-data of every disk is read at once
+	phase_end (PHASE_RAID);
+	if (sio_initbuffs (&myRaid, SIO_DEFAULTBUFFS)) {
+		cleanup ();
+		return 1;
+	}
+	phase_end (PHASE_BUFFS);
 	printf ("NVMe-Raid started\n");
+	phase_print ();
 	// clean a bit the screen
 	puts ("");
 	puts ("");
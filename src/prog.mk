@@ -64,6 +64,11 @@ ifeq ($(CONFIG_RDMA),y)
 LIBS += -libverbs -lrdmacm
 endif
 
+ifeq ($(CONFIG_URING),y)
+CFLAGS += -DSIO_URING
+LIBS += -luring
+endif
+
 all: $(APP)
 
 $(APP) : $(OBJS) $(SPDK_LIB_FILES) $(ENV_LIBS)
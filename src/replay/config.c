@@ -89,24 +89,35 @@ static const char usage[] =
     "           handled by the I/O RX lcores                                        \n"
     "    --tx \"(PORT, QUEUE, NVME, LCORE), ...\" : List of NIC TX ports, queues and\n"
     "           NVME drives handled by the I/O TX lcores                            \n"
+    "    --st \"(NVME, LCORE), ...\" : List of NVME drives read by the storage      \n"
+    "           lcores                                                              \n"
     "                                                                               \n"
     "Application optional parameters:                                               \n"
-    "    --rsz \"A, B\" : Ring sizes                                                \n"
+    "    --rsz \"A, B[, C]\" : Ring sizes                                           \n"
     "           A = Size (in number of buffer descriptors) of each of the NIC RX    \n"
     "               rings read by the I/O RX lcores (default value is %u)           \n"
     "           B = Size (in number of buffer descriptors) of each of the NIC TX    \n"
     "               rings written by I/O TX lcores (default value is %u)            \n"
+    "           C = Size (in number of packets) of each of the rings written by the \n"
+    "               storage lcores (default value is %u)                            \n"
     "    --bsz \"A, B\" :  Burst sizes                                              \n"
     "           A = I/O RX lcore read burst size from NIC RX (default value is %u)  \n"
     "           B = I/O TX lcore write burst size to NIC TX (default value is %u)   \n"
     "                                                                               \n"
     "Replay parameters:                                                             \n"
-    "    --ifile \"file name\" : An optimized-pcap file stored in the NVME-raid     \n";
+    "    --ifile \"file name\" : An optimized-pcap file stored in the NVME-raid     \n"
+    "    --zc : Zero-copy. The NVMe DMAs the file straight into the mbufs, which are\n"
+    "           sent as multi-segment packets                                       \n"
+    "    --seek \"seconds\" : Start from that second of the capture, with its index \n"
+    "    --seek-packet \"n\" : Start from its nth packet, with the index of blocks  \n"
+    "    --ordered : Sends the packets in the order they were captured, through the\n"
+    "           first TX ring. Every NVMe must be read by a single storage lcore    \n";
 
 void replay_print_usage (void) {
 	printf (usage,
 	        REPLAY_DEFAULT_NIC_RX_RING_SIZE,
 	        REPLAY_DEFAULT_NIC_TX_RING_SIZE,
+	        REPLAY_DEFAULT_STORAGE_RING_SIZE,
 	        REPLAY_DEFAULT_BURST_SIZE_IO_RX_READ,
 	        REPLAY_DEFAULT_BURST_SIZE_IO_TX_WRITE);
 }
@@ -193,7 +204,7 @@ static int parse_arg_rx (const char *arg) {
 			return -6;
 		}
 		lp = &replay.lcore_params[lcore];
-		if (lp->type == e_REPLAY_LCORE_WORKER) {
+		if ((lp->type == e_REPLAY_LCORE_WORKER) || (lp->type == e_REPLAY_LCORE_STORAGE)) {
 			return -7;
 		}
 		lp->type = e_REPLAY_LCORE_IO;
@@ -251,14 +262,15 @@ static int parse_arg_tx (const char *arg) {
 		}
 
 		/* Enable port and queue for later initialization */
-		if ((port >= REPLAY_MAX_NIC_PORTS) || (queue >= REPLAY_MAX_TX_QUEUES_PER_NIC_PORT)) {
+		if ((port >= REPLAY_MAX_NIC_PORTS) || (queue >= REPLAY_MAX_TX_QUEUES_PER_NIC_PORT) ||
+		    (nvme >= MAXDISKS)) {
 			return -3;
 		}
 		if (replay.nic_tx_queue_mask[port][queue] != 0) {
 			return -4;
 		}
 		replay.nic_tx_queue_mask[port][queue] = 1;
-		replay.nic_tx_queue_nvme[port][queue] = nvme;  // TODO check if available nvme
+		replay.nic_tx_queue_nvme[port][queue] = nvme;  // checked against the raid at init
 
 		/* Check and assign (port, queue) to I/O lcore */
 		if (rte_lcore_is_enabled (lcore) == 0) {
@@ -269,7 +281,7 @@ static int parse_arg_tx (const char *arg) {
 			return -6;
 		}
 		lp = &replay.lcore_params[lcore];
-		if (lp->type == e_REPLAY_LCORE_WORKER) {
+		if ((lp->type == e_REPLAY_LCORE_WORKER) || (lp->type == e_REPLAY_LCORE_STORAGE)) {
 			return -7;
 		}
 		lp->type = e_REPLAY_LCORE_IO;
@@ -299,6 +311,73 @@ static int parse_arg_tx (const char *arg) {
 	return 0;
 }
 
+#ifndef REPLAY_ARG_ST_MAX_CHARS
+#define REPLAY_ARG_ST_MAX_CHARS 4096
+#endif
+
+#ifndef REPLAY_ARG_ST_MAX_TUPLES
+#define REPLAY_ARG_ST_MAX_TUPLES MAXDISKS
+#endif
+
+static int parse_arg_st (const char *arg) {
+	const char *p0 = arg, *p = arg;
+	uint32_t n_tuples;
+
+	if (strnlen (arg, REPLAY_ARG_ST_MAX_CHARS + 1) == REPLAY_ARG_ST_MAX_CHARS + 1) {
+		return -1;
+	}
+
+	n_tuples = 0;
+	while ((p = strchr (p0, '(')) != NULL) {
+		struct replay_lcore_params *lp;
+		uint32_t nvme, lcore;
+
+		p0 = strchr (p++, ')');
+		if ((p0 == NULL) || (str_to_unsigned_vals (p, p0 - p, ',', 2, &nvme, &lcore) != 2)) {
+			return -2;
+		}
+
+		/* Enable the NVMe for later initialization */
+		if (nvme >= MAXDISKS) {
+			return -3;
+		}
+		if (replay.nvme_mask[nvme] != 0) {
+			return -4;
+		}
+		replay.nvme_mask[nvme] = 1;
+
+		/* Check and assign the NVMe to the storage lcore */
+		if (rte_lcore_is_enabled (lcore) == 0) {
+			return -5;
+		}
+
+		if (lcore >= REPLAY_MAX_LCORES) {
+			return -6;
+		}
+		lp = &replay.lcore_params[lcore];
+		if ((lp->type != e_REPLAY_LCORE_DISABLED) && (lp->type != e_REPLAY_LCORE_STORAGE)) {
+			return -7;
+		}
+		lp->type = e_REPLAY_LCORE_STORAGE;
+		if (lp->storage.n_nvme >= REPLAY_MAX_NVME_PER_STORAGE_LCORE) {
+			return -9;
+		}
+		lp->storage.nvme[lp->storage.n_nvme] = (uint8_t)nvme;
+		lp->storage.n_nvme++;
+
+		n_tuples++;
+		if (n_tuples > REPLAY_ARG_ST_MAX_TUPLES) {
+			return -10;
+		}
+	}
+
+	if (n_tuples == 0) {
+		return -11;
+	}
+
+	return 0;
+}
+
 #ifndef REPLAY_ARG_RSZ_CHARS
 #define REPLAY_ARG_RSZ_CHARS 63
 #endif
@@ -308,18 +387,25 @@ static int parse_arg_rsz (const char *arg) {
 		return -1;
 	}
 
+	replay.storage_ring_size = REPLAY_DEFAULT_STORAGE_RING_SIZE;
 	if (str_to_unsigned_vals (arg,
 	                          REPLAY_ARG_RSZ_CHARS,
 	                          ',',
-	                          2,
+	                          3,
 	                          &replay.nic_rx_ring_size,
-	                          &replay.nic_tx_ring_size) != 2)
+	                          &replay.nic_tx_ring_size,
+	                          &replay.storage_ring_size) < 2)
 		return -2;
 
-	if ((replay.nic_rx_ring_size == 0) || (replay.nic_tx_ring_size == 0)) {
+	if ((replay.nic_rx_ring_size == 0) || (replay.nic_tx_ring_size == 0) ||
+	    (replay.storage_ring_size == 0)) {
 		return -3;
 	}
 
+	if (!rte_is_power_of_2 (replay.storage_ring_size)) {
+		return -4;
+	}
+
 	return 0;
 }
 
@@ -353,8 +439,19 @@ static int parse_arg_bsz (const char *arg) {
 }
 
 static int parse_arg_ifile (const char *arg) {
-	puts ("TODO OPENING");
-	exit (-1);
+	if (arg[0] == 0) {
+		return -1;
+	}
+	if (strnlen (arg, NAMELENGTH + 1) > NAMELENGTH) {
+		return -2;
+	}
+
+	// The raid is not available yet, the file will be opened at app_run
+	replay.ifile = strdup (arg);
+	if (!replay.ifile) {
+		return -3;
+	}
+
 	return 0;
 }
 
@@ -369,14 +466,20 @@ int replay_parse_args (int argc, char **argv, struct spdk_env_opts *conf) {
 	                                 // Classic parameters
 	                                 {"rx", 1, 0, 0},
 	                                 {"tx", 1, 0, 0},
+	                                 {"st", 1, 0, 0},
 	                                 {"rsz", 1, 0, 0},
 	                                 {"bsz", 1, 0, 0},
 	                                 // File config
 	                                 {"ifile", 1, 0, 0},
+	                                 {"zc", 0, 0, 0},
+	                                 {"seek", 1, 0, 0},
+	                                 {"seek-packet", 1, 0, 0},
+	                                 {"ordered", 0, 0, 0},
 	                                 // endlist
 	                                 {NULL, 0, 0, 0}};
 	uint32_t arg_rx    = 0;
 	uint32_t arg_tx    = 0;
+	uint32_t arg_st    = 0;
 	uint32_t arg_rsz   = 0;
 	uint32_t arg_bsz   = 0;
 	uint32_t arg_ifile = 0;
@@ -410,6 +513,14 @@ int replay_parse_args (int argc, char **argv, struct spdk_env_opts *conf) {
 						return -1;
 					}
 				}
+				if (!strcmp (lgopts[option_index].name, "st")) {
+					arg_st = 1;
+					ret    = parse_arg_st (optarg);
+					if (ret) {
+						printf ("Incorrect value for --st argument (%d)\n", ret);
+						return -1;
+					}
+				}
 				if (!strcmp (lgopts[option_index].name, "rsz")) {
 					arg_rsz = 1;
 					ret     = parse_arg_rsz (optarg);
@@ -426,6 +537,32 @@ int replay_parse_args (int argc, char **argv, struct spdk_env_opts *conf) {
 						return -1;
 					}
 				}
+				if (!strcmp (lgopts[option_index].name, "zc")) {
+					replay.zerocopy = 1;
+				}
+				if (!strcmp (lgopts[option_index].name, "seek")) {
+					char *end;
+					double seconds = strtod (optarg, &end);
+
+					if (end == optarg || *end || seconds < 0) {
+						printf ("Incorrect value for --seek argument (%s)\n", optarg);
+						return -1;
+					}
+					replay.seek = seconds * 1e9;
+				}
+				if (!strcmp (lgopts[option_index].name, "seek-packet")) {
+					char *end;
+					uint64_t packet = strtoull (optarg, &end, 10);
+
+					if (end == optarg || *end || packet == 0) {
+						printf ("Incorrect value for --seek-packet argument (%s)\n", optarg);
+						return -1;
+					}
+					replay.seek_packet = packet;
+				}
+				if (!strcmp (lgopts[option_index].name, "ordered")) {
+					replay.ordered = 1;
+				}
 				if (!strcmp (lgopts[option_index].name, "ifile")) {
 					arg_ifile = 1;
 					ret       = parse_arg_ifile (optarg);
@@ -444,7 +581,7 @@ int replay_parse_args (int argc, char **argv, struct spdk_env_opts *conf) {
 	}
 
 	/* Check that all mandatory arguments are provided */
-	if ((arg_rx == 0) || (arg_tx == 0) || (arg_ifile == 0)) {
+	if ((arg_rx == 0) || (arg_tx == 0) || (arg_st == 0) || (arg_ifile == 0)) {
 		printf ("Not all mandatory arguments are present\n");
 		return -1;
 	}
@@ -453,6 +590,7 @@ int replay_parse_args (int argc, char **argv, struct spdk_env_opts *conf) {
 	if (arg_rsz == 0) {
 		replay.nic_rx_ring_size = REPLAY_DEFAULT_NIC_RX_RING_SIZE;
 		replay.nic_tx_ring_size = REPLAY_DEFAULT_NIC_TX_RING_SIZE;
+		replay.storage_ring_size = REPLAY_DEFAULT_STORAGE_RING_SIZE;
 	}
 
 	if (arg_bsz == 0) {
@@ -546,6 +684,28 @@ int replay_get_lcore_for_nic_tx (uint8_t port, uint8_t queue, uint32_t *lcore_ou
 	return -1;
 }
 
+int replay_get_lcore_for_nvme (uint8_t nvme, uint32_t *lcore_out) {
+	uint32_t lcore;
+
+	for (lcore = 0; lcore < REPLAY_MAX_LCORES; lcore++) {
+		struct replay_lcore_params_storage *lp = &replay.lcore_params[lcore].storage;
+		uint32_t i;
+
+		if (replay.lcore_params[lcore].type != e_REPLAY_LCORE_STORAGE) {
+			continue;
+		}
+
+		for (i = 0; i < lp->n_nvme; i++) {
+			if (lp->nvme[i] == nvme) {
+				*lcore_out = lcore;
+				return 0;
+			}
+		}
+	}
+
+	return -1;
+}
+
 int replay_is_socket_used (uint32_t socket) {
 	uint32_t lcore;
 
@@ -600,6 +760,26 @@ uint32_t replay_get_lcores_worker (void) {
 	return count;
 }
 
+uint32_t replay_get_lcores_storage (void) {
+	uint32_t lcore, count;
+
+	count = 0;
+	for (lcore = 0; lcore < REPLAY_MAX_LCORES; lcore++) {
+		if (replay.lcore_params[lcore].type != e_REPLAY_LCORE_STORAGE) {
+			continue;
+		}
+
+		count++;
+	}
+
+	if (count > REPLAY_MAX_STORAGE_LCORES) {
+		rte_panic ("Algorithmic error (too many storage lcores)\n");
+		return 0;
+	}
+
+	return count;
+}
+
 void replay_print_params (void) {
 	unsigned port, queue, lcore, i /*, j*/;
 
@@ -679,10 +859,32 @@ void replay_print_params (void) {
 		printf (";\n");
 	}
 
+	/* Print storage lcore params */
+	for (lcore = 0; lcore < REPLAY_MAX_LCORES; lcore++) {
+		struct replay_lcore_params_storage *lp = &replay.lcore_params[lcore].storage;
+
+		if (replay.lcore_params[lcore].type != e_REPLAY_LCORE_STORAGE) {
+			continue;
+		}
+
+		printf ("Storage lcore %u (socket %u): ", lcore, rte_lcore_to_socket_id (lcore));
+
+		printf ("NVMe  ");
+		for (i = 0; i < lp->n_nvme; i++) {
+			printf ("%u  ", (unsigned)lp->nvme[i]);
+		}
+		printf (";\n");
+	}
+
 	/* Rings */
-	printf ("Ring sizes: NIC RX = %u; NIC TX = %u;\n",
+	printf ("Ring sizes: NIC RX = %u; NIC TX = %u; Storage = %u;\n",
 	        (unsigned)replay.nic_rx_ring_size,
-	        (unsigned)replay.nic_tx_ring_size);
+	        (unsigned)replay.nic_tx_ring_size,
+	        (unsigned)replay.storage_ring_size);
+
+	/* Zero-copy */
+	printf ("Zero-copy: %s\n", replay.zerocopy ? "enabled" : "disabled");
+	printf ("Capture order: %s\n", replay.ordered ? "kept" : "per NVMe");
 
 	/* Bursts */
 	printf ("Burst sizes: I/O RX rd = %u; I/O TX wr = %u)\n",
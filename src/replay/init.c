@@ -57,6 +57,7 @@
 #include <rte_lcore.h>
 #include <rte_log.h>
 #include <rte_lpm.h>
+#include <rte_malloc.h>
 #include <rte_mbuf.h>
 #include <rte_memcpy.h>
 #include <rte_memory.h>
@@ -149,6 +150,23 @@ static void replay_init_mbuf_pools (void) {
 		if (replay.pools[socket] == NULL) {
 			rte_panic ("Cannot create mbuf pool on socket %u\n", socket);
 		}
+
+		if (!replay.zerocopy) {
+			continue;
+		}
+
+		/* Zero-copy packets are indirect mbufs attached to the ones read from the NVMe */
+		snprintf (name, sizeof (name), "clone_pool_%u", socket);
+		printf ("Creating the clone pool for socket %u ...\n", socket);
+		replay.clone_pools[socket] = rte_pktmbuf_pool_create (name,
+		                                                      REPLAY_DEFAULT_CLONE_MEMPOOL_BUFFERS,
+		                                                      REPLAY_DEFAULT_MEMPOOL_CACHE_SIZE,
+		                                                      0,
+		                                                      0,
+		                                                      socket);
+		if (replay.clone_pools[socket] == NULL) {
+			rte_panic ("Cannot create clone pool on socket %u\n", socket);
+		}
 	}
 
 	for (lcore = 0; lcore < REPLAY_MAX_LCORES; lcore++) {
@@ -156,37 +174,91 @@ static void replay_init_mbuf_pools (void) {
 			continue;
 		}
 
-		socket                          = rte_lcore_to_socket_id (lcore);
-		replay.lcore_params[lcore].pool = replay.pools[socket];
+		socket                                = rte_lcore_to_socket_id (lcore);
+		replay.lcore_params[lcore].pool       = replay.pools[socket];
+		replay.lcore_params[lcore].clone_pool = replay.clone_pools[socket];
 	}
 }
 
 static void replay_init_rings_tx (void) {
-	unsigned lcore;
+	unsigned lcore, nvme;
+
+	/* Initialize the rings that connect the storage lcores with the TX side */
+	for (nvme = 0; nvme < MAXDISKS; nvme++) {
+		struct replay_lcore_params_storage *lp;
+		char name[32];
+		uint32_t lcore_st, i;
+
+		if (replay.nvme_mask[nvme] == 0) {
+			continue;
+		}
+
+		if (replay_get_lcore_for_nvme ((uint8_t)nvme, &lcore_st) < 0) {
+			rte_panic ("Algorithmic error (no storage lcore to handle NVMe %u)\n", nvme);
+		}
+		lp = &replay.lcore_params[lcore_st].storage;
+
+		snprintf (name, sizeof (name), "ring_nvme_%u", nvme);
+		printf ("Creating ring to connect NVMe %u (storage lcore %u) with the TX lcores ...\n",
+		        nvme,
+		        lcore_st);
+		replay.nvme_rings[nvme] = rte_ring_create (
+		    name, replay.storage_ring_size, rte_lcore_to_socket_id (lcore_st), RING_F_SP_ENQ);
+		if (replay.nvme_rings[nvme] == NULL) {
+			rte_panic ("Cannot create ring to connect NVMe %u with the TX lcores\n", nvme);
+		}
+
+		for (i = 0; i < lp->n_nvme; i++) {
+			if (lp->nvme[i] == nvme) {
+				lp->rings_out[i] = replay.nvme_rings[nvme];
+			}
+		}
+	}
 
-	/* Initialize the rings for the TX side */
+	/* Attach each NIC TX queue to the ring of its NVMe */
 	for (lcore = 0; lcore < REPLAY_MAX_LCORES; lcore++) {
-		unsigned port;
+		struct replay_lcore_params_io *lp = &replay.lcore_params[lcore].io;
+		uint32_t i;
 
-		if (replay.lcore_params[lcore].type != e_REPLAY_LCORE_WORKER) {
+		if (replay.lcore_params[lcore].type != e_REPLAY_LCORE_IO) {
 			continue;
 		}
 
-		for (port = 0; port < REPLAY_MAX_NIC_PORTS; port++) {
-			uint32_t lcore_io;
+		for (i = 0; i < lp->tx.n_nic_queues; i++) {
+			uint8_t port  = lp->tx.nic_queues[i].port;
+			uint8_t queue = lp->tx.nic_queues[i].queue;
 
-			if (replay_get_nic_tx_queues_per_port (port) == 0) {
-				continue;
+			nvme = replay.nic_tx_queue_nvme[port][queue];
+			if (replay.nvme_rings[nvme] == NULL) {
+				rte_panic ("NVMe %u (TX port %u queue %u) is not handled by any storage lcore\n",
+				           nvme,
+				           (unsigned)port,
+				           (unsigned)queue);
 			}
+			lp->tx.rings_in[i] = replay.nvme_rings[nvme];
+		}
+	}
+
+	/* Every NVMe read must be sent through, at least, one NIC TX queue */
+	for (nvme = 0; nvme < MAXDISKS; nvme++) {
+		unsigned port, queue;
+		int used = 0;
+
+		if (replay.nvme_mask[nvme] == 0) {
+			continue;
+		}
 
-			if (replay_get_lcore_for_nic_tx ((uint8_t)port, 0, &lcore_io) <
-			    0) {  // TODO check other queues
-				rte_panic (
-				    "Algorithmic error (no I/O core to handle TX of port %u "
-				    "and queue 0)\n",
-				    port);
+		for (port = 0; port < REPLAY_MAX_NIC_PORTS; port++) {
+			for (queue = 0; queue < REPLAY_MAX_TX_QUEUES_PER_NIC_PORT; queue++) {
+				if (replay.nic_tx_queue_mask[port][queue] &&
+				    replay.nic_tx_queue_nvme[port][queue] == nvme) {
+					used = 1;
+				}
 			}
 		}
+		if (!used) {
+			rte_panic ("NVMe %u is read but there is no NIC TX queue to send it\n", nvme);
+		}
 	}
 }
 
@@ -355,3 +427,167 @@ void replay_init (void) {
 
 	printf ("Initialization completed.\n");
 }
+
+void replay_init_nvme_queues (nvmeRaid *raid) {
+	unsigned lcore;
+	int qid = 1;  // queue 0 is kept for the master thread
+
+	/* Each storage and I/O lcore owns a qpair on every NVMe */
+	for (lcore = 0; lcore < REPLAY_MAX_LCORES; lcore++) {
+		if ((replay.lcore_params[lcore].type != e_REPLAY_LCORE_IO) &&
+		    (replay.lcore_params[lcore].type != e_REPLAY_LCORE_STORAGE)) {
+			continue;
+		}
+
+		replay.lcore_params[lcore].qid = qid++;
+	}
+
+	printf ("Allocating %d NVMe queues per NVMe ...\n", qid);
+	if (sio_allocqueues (raid, qid)) {
+		rte_panic ("Cannot allocate the NVMe queues\n");
+	}
+}
+
+void replay_init_storage (nvmeRaid *raid, metaFile *file) {
+	spcap_index start = {0};
+	spcap_blockidx block;
+	uint64_t seq, skip = 0, lba, count;
+	int skipnvme = -1;
+	unsigned lcore, i;
+
+	replay.raid = raid;
+	replay.file = file;
+	rte_atomic32_init (&replay.nvme_active);
+	rte_atomic32_init (&replay.nvme_failed);
+
+	// each NVMe reads the stripes moved and then the ones not moved yet (fileDiskExtent), the
+	// new ones too. Only the blocks say where each stripe goes
+	if (raid->expandDisks && file->layout != SPCAP_LAYOUT_BLOCKS) {
+		rte_panic ("The raid is being expanded, run the expand tool until it ends\n");
+	}
+
+	// the streams start at the block with the packet or the time to seek, or at the second of
+	// the index with that time (files without an index of their blocks)
+	if (replay.seek_packet) {
+		if (spcapSeekBlock (raid, file, replay.seek_packet - 1, 1, &seq, &block) ||
+		    spcapBlockStart (raid, file, seq, &start) ||
+		    fileMap (raid, file, seq * SUPERSECTORNUM, &lba, &count)) {
+			rte_panic ("The file has no index of its blocks, it can't seek a packet\n");
+		}
+		skip     = replay.seek_packet - 1 - block.packet;
+		skipnvme = super_getdisk (raid, lba);
+		printf ("Replaying from packet %lu (block %lu)\n", replay.seek_packet, seq);
+	} else if (replay.seek) {
+		spcap_stats stats;
+
+		if (spcapStats (raid, file, &stats)) {
+			rte_panic ("The file has no time index, it can only be replayed from the start\n");
+		}
+		if (spcapSeekBlock (raid, file, stats.firstTime + replay.seek, 0, &seq, &block) == 0 &&
+		    spcapBlockStart (raid, file, seq, &start) == 0) {
+			start.time = block.time;
+		} else if (spcapSeek (raid, file, stats.firstTime + replay.seek, &start)) {
+			rte_panic ("The file has no time index, it can only be replayed from the start\n");
+		}
+		printf ("Replaying from %.3f s\n", (start.time - stats.firstTime) / 1e9);
+	}
+
+	for (lcore = 0; lcore < REPLAY_MAX_LCORES; lcore++) {
+		struct replay_lcore_params_storage *lp = &replay.lcore_params[lcore].storage;
+
+		if (replay.lcore_params[lcore].type != e_REPLAY_LCORE_STORAGE) {
+			continue;
+		}
+
+		for (i = 0; i < lp->n_nvme; i++) {
+			struct replay_nvme_stream *st = &lp->streams[i];
+			uint8_t nvme                  = lp->nvme[i];
+
+			if (nvme >= raid->numdisks) {
+				rte_panic ("NVMe %u is not part of the raid (%d NVMe)\n",
+				           (unsigned)nvme,
+				           raid->numdisks);
+			}
+			if (super_isreplica (raid, nvme)) {
+				rte_panic ("NVMe %u is the mirror of NVMe %u, use that one (both are read)\n",
+				           (unsigned)nvme,
+				           (unsigned)super_getmirror (raid, nvme));
+			}
+
+			memset (st, 0, sizeof (*st));
+			st->disk          = &raid->disk[nvme];
+			st->mirror        = raid->mirrored ? &raid->disk[super_getmirror (raid, nvme)] : NULL;
+			st->pool          = replay.lcore_params[lcore].pool;
+			st->stripelen     = SUPERSECTORLENGTH;
+			st->stripesectors = SUPERSECTORNUM;
+			if (replay.zerocopy) {
+				unsigned j;
+
+				// Each segment must fit a whole page of its mbuf data room
+				if (rte_pktmbuf_data_room_size (st->pool) < 2 * REPLAY_ZC_SEGMENT_SIZE - 1) {
+					rte_panic ("The mbufs are too small for zero-copy\n");
+				}
+				st->seglen = REPLAY_ZC_SEGMENT_SIZE;
+				st->nsegs  = SUPERSECTORLENGTH / REPLAY_ZC_SEGMENT_SIZE;
+				for (j = 0; j < REPLAY_STORAGE_READAHEAD; j++) {
+					st->sgl[j].segs = rte_zmalloc_socket (NULL,
+					                                      st->nsegs * sizeof (struct rte_mbuf *),
+					                                      RTE_CACHE_LINE_SIZE,
+					                                      rte_lcore_to_socket_id (lcore));
+					if (st->sgl[j].segs == NULL) {
+						rte_panic ("Cannot allocate the stream segments of NVMe %u\n",
+						           (unsigned)nvme);
+					}
+				}
+			} else {
+				st->buffs =
+				    spdk_malloc (REPLAY_STORAGE_READAHEAD * SUPERSECTORLENGTH, SECTORLENGTH, NULL);
+				if (st->buffs == NULL) {
+					rte_panic ("Cannot allocate the stream buffers of NVMe %u\n", (unsigned)nvme);
+				}
+				st->seglen = SUPERSECTORLENGTH;
+			}
+
+			// Each NVMe stores its own spcap-stream through the extents of the file. It ends
+			// with an empty header, the extents just bound the read-ahead
+			st->nvme   = nvme;
+			st->extent = -1;
+			if (spcapDiskOffset (raid,
+			                     file,
+			                     nvme,
+			                     start.offset[nvme],
+			                     &st->extent,
+			                     &st->nextlba,
+			                     &st->endlba,
+			                     &st->offset)) {
+				st->nextlba = st->endlba = 0;  // nothing to read
+			}
+			if (nvme == skipnvme) {  // the block of the packet to seek
+				st->skip = skip;
+			}
+
+			printf ("Storage lcore %u reads NVMe %u from sector %lu\n",
+			        lcore,
+			        (unsigned)nvme,
+			        st->nextlba);
+			rte_atomic32_inc (&replay.nvme_active);
+		}
+	}
+
+	// the merge needs the next block of every NVMe at hand
+	if (replay.ordered) {
+		int primaries = 0;
+
+		if (file->layout != SPCAP_LAYOUT_BLOCKS) {
+			rte_panic ("The file was captured without blocks, its order can't be kept\n");
+		}
+		for (i = 0; i < (unsigned)raid->numdisks; i++) {
+			primaries += !super_isreplica (raid, i);
+		}
+		if (replay_get_lcores_storage () != 1 ||
+		    rte_atomic32_read (&replay.nvme_active) != primaries) {
+			rte_panic ("--ordered needs every NVMe of the raid (%d) in a single storage lcore\n",
+			           primaries);
+		}
+	}
+}
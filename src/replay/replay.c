@@ -87,15 +87,24 @@ void app_config (int argc, char **argv, struct spdk_env_opts *conf) {
 }
 
 void app_init (nvmeRaid *raid) {
-	UNUSED (raid);
 	/* Init */
 	replay_init ();
+	replay_init_nvme_queues (raid);
 	replay_print_params ();
 	return;
 }
 
 void app_run (nvmeRaid *raid) {
 	uint32_t lcore;
+	metaFile *file;
+
+	/* Open the file to replay */
+	file = findFile (raid, replay.ifile);
+	if (!file) {
+		printf ("File %s not found in NVMe-raid\n", replay.ifile);
+		return;
+	}
+	replay_init_storage (raid, file);
 
 	/* Launch per-lcore init on every lcore */
 	rte_eal_mp_remote_launch (replay_lcore_main_loop, NULL, CALL_MASTER);
@@ -107,5 +116,10 @@ void app_run (nvmeRaid *raid) {
 		}
 	}
 
+	if (rte_atomic32_read (&replay.nvme_failed)) {
+		printf ("The replay is not complete: %d NVMe streams could not be read\n",
+		        rte_atomic32_read (&replay.nvme_failed));
+		exit (1);
+	}
 	return;
 }
@@ -40,6 +40,8 @@
 #include "spdk/nvme.h"
 #include "spdk/env.h"
 
+#include <common.h>
+
 /* Logical cores */
 #ifndef REPLAY_MAX_SOCKETS
 #define REPLAY_MAX_SOCKETS 2
@@ -90,6 +92,17 @@
 #error "REPLAY_MAX_WORKER_LCORES is too big"
 #endif
 
+#ifndef REPLAY_MAX_STORAGE_LCORES
+#define REPLAY_MAX_STORAGE_LCORES MAXDISKS
+#endif
+#if (REPLAY_MAX_STORAGE_LCORES > REPLAY_MAX_LCORES)
+#error "REPLAY_MAX_STORAGE_LCORES is too big"
+#endif
+
+#ifndef REPLAY_MAX_NVME_PER_STORAGE_LCORE
+#define REPLAY_MAX_NVME_PER_STORAGE_LCORE MAXDISKS
+#endif
+
 /* Mempools */
 #ifndef REPLAY_DEFAULT_MBUF_SIZE
 #define REPLAY_DEFAULT_MBUF_SIZE (9000 /*2048*/ + sizeof (struct rte_mbuf) + RTE_PKTMBUF_HEADROOM)
@@ -169,6 +182,25 @@
 #define REPLAY_DEFAULT_NIC_TX_RS_THRESH 0
 #endif
 
+/* NVMe storage */
+#ifndef REPLAY_DEFAULT_STORAGE_RING_SIZE
+#define REPLAY_DEFAULT_STORAGE_RING_SIZE 4096
+#endif
+
+#ifndef REPLAY_STORAGE_READAHEAD
+#define REPLAY_STORAGE_READAHEAD 8  // Stripes in flight per NVMe
+#endif
+
+#ifndef REPLAY_ZC_SEGMENT_SIZE
+#define REPLAY_ZC_SEGMENT_SIZE 4096  // A page, so every NVMe PRP entry is one mbuf
+#endif
+// A packet may start in the middle of a segment
+#define REPLAY_ZC_PKT_SEGMENTS (UINT16_MAX / REPLAY_ZC_SEGMENT_SIZE + 2)
+
+#ifndef REPLAY_DEFAULT_CLONE_MEMPOOL_BUFFERS
+#define REPLAY_DEFAULT_CLONE_MEMPOOL_BUFFERS 8192 * 16
+#endif
+
 /* Bursts */
 #ifndef REPLAY_MBUF_ARRAY_SIZE
 #define REPLAY_MBUF_ARRAY_SIZE 512
@@ -205,7 +237,48 @@ enum replay_lcore_type {
 	e_REPLAY_LCORE_DISABLED = 0,
 	e_REPLAY_LCORE_IO,
 	e_REPLAY_LCORE_WORKER,
-	e_REPLAY_LCORE_WORKER_SLAVE
+	e_REPLAY_LCORE_WORKER_SLAVE,
+	e_REPLAY_LCORE_STORAGE
+};
+
+/* Zero-copy: a stripe is read straight into the data room of nsegs mbufs */
+struct replay_nvme_sgl {
+	struct rte_mbuf **segs;
+	uint32_t seg;  // next SGL element
+	uint32_t segoffset;
+};
+
+/* Sequential reader of the spcap-stream stored in one NVMe */
+struct replay_nvme_stream {
+	idisk *disk;
+	idisk *mirror;  // the other replica (mirrored raids), each stripe is read from the less busy
+	char *buffs;                                        // REPLAY_STORAGE_READAHEAD stripes
+	struct replay_nvme_sgl sgl[REPLAY_STORAGE_READAHEAD];  // or their mbufs (zero-copy)
+	struct rte_mempool *pool;
+	uint32_t stripelen;
+	uint32_t stripesectors;
+	uint32_t seglen;  // contiguous bytes of each stripe piece
+	uint32_t nsegs;   // pieces of each stripe
+	volatile int8_t ready[REPLAY_STORAGE_READAHEAD];  // 1 once read, -1 if the read failed
+	uint32_t head;      // oldest stripe submitted
+	uint32_t inflight;  // stripes submitted and not consumed
+	uint32_t offset;    // already consumed bytes of the head stripe
+	uint32_t blockend;  // of the packets of the head stripe (block layout), 0 until read
+	uint64_t blockseq;  // of the head stripe, in the file
+	uint16_t blockalign;  // of its packets
+	uint16_t blockformat;  // of their headers
+	uint64_t skip;         // packets not sent, before the one seeked
+	uint64_t nextlba;
+	uint64_t endlba;  // of the current extent of the file
+	int extent;
+	uint8_t nvme;
+	uint8_t finished;
+	uint8_t failed;  // a stripe could not be read, nothing after it is sent
+
+	/* Stats */
+	uint64_t pkts;
+	uint64_t bytes;
+	uint64_t drops;
 };
 
 #include <sys/time.h>
@@ -243,6 +316,9 @@ struct replay_lcore_params_io {
 		} nic_queues[REPLAY_MAX_NIC_TX_PORTS_PER_IO_LCORE];
 		uint32_t n_nic_queues;
 
+		/* Storage rings */
+		struct rte_ring *rings_in[REPLAY_MAX_NIC_TX_QUEUES_PER_IO_LCORE];
+
 		/* Internal buffers */
 		struct replay_mbuf_array mbuf_out[REPLAY_MAX_NIC_TX_PORTS_PER_IO_LCORE];
 		uint8_t mbuf_out_flush[REPLAY_MAX_NIC_TX_PORTS_PER_IO_LCORE];
@@ -258,11 +334,27 @@ struct replay_lcore_params_io {
 	} tx;
 };
 
+struct replay_lcore_params_storage {
+	/* NVMe */
+	uint8_t nvme[REPLAY_MAX_NVME_PER_STORAGE_LCORE];
+	uint32_t n_nvme;
+
+	/* Streams and rings */
+	struct replay_nvme_stream streams[REPLAY_MAX_NVME_PER_STORAGE_LCORE];
+	struct rte_ring *rings_out[REPLAY_MAX_NVME_PER_STORAGE_LCORE];
+
+	/* Internal buffers */
+	struct replay_mbuf_array mbuf_out[REPLAY_MAX_NVME_PER_STORAGE_LCORE];
+};
+
 struct replay_lcore_params {
 	struct replay_lcore_params_io io;
+	struct replay_lcore_params_storage storage;
 
 	enum replay_lcore_type type;
 	struct rte_mempool *pool;
+	struct rte_mempool *clone_pool;
+	int qid;  // NVMe queue owned by the lcore
 } __rte_cache_aligned;
 
 struct replay_params {
@@ -274,16 +366,33 @@ struct replay_params {
 	uint8_t nic_tx_queue_mask[REPLAY_MAX_NIC_PORTS][REPLAY_MAX_TX_QUEUES_PER_NIC_PORT];
 	uint8_t nic_tx_queue_nvme[REPLAY_MAX_NIC_PORTS][REPLAY_MAX_TX_QUEUES_PER_NIC_PORT];
 
+	/* NVMe */
+	uint8_t nvme_mask[MAXDISKS];
+	struct rte_ring *nvme_rings[MAXDISKS];
+	rte_atomic32_t nvme_active;
+	rte_atomic32_t nvme_failed;  // streams stopped by a read error
+
 	/* mbuf pools */
 	struct rte_mempool *pools[REPLAY_MAX_SOCKETS];
+	struct rte_mempool *clone_pools[REPLAY_MAX_SOCKETS];
+	uint8_t zerocopy;
+	uint64_t seek;  // ns from the start of the file
+	uint64_t seek_packet;  // or the number of the first packet, from 1
+	uint8_t ordered;  // the blocks of every NVMe are merged by the single storage lcore
 
 	/* rings */
 	uint32_t nic_rx_ring_size;
 	uint32_t nic_tx_ring_size;
+	uint32_t storage_ring_size;
 
 	/* burst size */
 	uint32_t burst_size_io_rx_read;
 	uint32_t burst_size_io_tx_write;
+
+	/* replayed file */
+	char *ifile;
+	nvmeRaid *raid;
+	metaFile *file;
 } __rte_cache_aligned;
 
 struct pktLatencyStat {
@@ -300,15 +409,19 @@ extern struct replay_params replay;
 int replay_parse_args (int argc, char **argv, struct spdk_env_opts *conf);
 void replay_print_usage (void);
 void replay_init (void);
+void replay_init_nvme_queues (nvmeRaid *raid);
+void replay_init_storage (nvmeRaid *raid, metaFile *file);
 int replay_lcore_main_loop (void *arg);
 
 int replay_get_nic_rx_queues_per_port (uint8_t port);
 int replay_get_nic_tx_queues_per_port (uint8_t port);
 int replay_get_lcore_for_nic_rx (uint8_t port, uint8_t queue, uint32_t *lcore_out);
 int replay_get_lcore_for_nic_tx (uint8_t port, uint8_t queue, uint32_t *lcore_out);
+int replay_get_lcore_for_nvme (uint8_t nvme, uint32_t *lcore_out);
 int replay_is_socket_used (uint32_t socket);
 uint32_t replay_get_lcores_io_rx (void);
 uint32_t replay_get_lcores_worker (void);
+uint32_t replay_get_lcores_storage (void);
 void replay_print_params (void);
 
 #ifdef RTE_EXEC_ENV_BAREMETAL
@@ -110,6 +110,8 @@
 
 //#define QUEUE_STATS
 
+static unsigned doloop = 1;
+
 static inline void replay_lcore_io_rx (struct replay_lcore_params_io *lp, uint32_t bsz_rd) {
 	uint32_t i;
 
@@ -136,36 +138,549 @@ static inline void replay_lcore_io_tx (struct replay_lcore_params_io *lp, uint32
 	uint32_t i;
 
 	for (i = 0; i < lp->tx.n_nic_queues; i++) {
-		uint8_t port  = lp->tx.nic_queues[i].port;
-		uint8_t queue = lp->tx.nic_queues[i].queue;
+		uint8_t port                  = lp->tx.nic_queues[i].port;
+		uint8_t queue                 = lp->tx.nic_queues[i].queue;
+		struct replay_mbuf_array *out = &lp->tx.mbuf_out[i];
 		uint32_t n_mbufs, n_pkts;
 
-		n_mbufs = bsz_tx_wr;
+		// Refill the burst with the packets read from the NVMe
+		if (out->n_mbufs < bsz_tx_wr) {
+			out->n_mbufs += rte_ring_dequeue_burst (lp->tx.rings_in[i],
+			                                        (void **)&out->array[out->n_mbufs],
+			                                        bsz_tx_wr - out->n_mbufs);
+		}
 
-		struct rte_mbuf *tmpbuf = rte_ctrlmbuf_alloc (replay.pools[0]);
-		if (!tmpbuf) {
+		n_mbufs = out->n_mbufs;
+		if (unlikely (n_mbufs == 0)) {
 			continue;
 		}
 
-		tmpbuf->pkt_len  = 0;  // TODO
-		tmpbuf->data_len = 0;  // TODO
-		tmpbuf->port     = port;
-
-		//memcpy (rte_ctrlmbuf_data (tmpbuf), icmppkt, icmppktlen - 8);
-		n_pkts = rte_eth_tx_burst (port, queue, &tmpbuf, n_mbufs);
+		REPLAY_IO_TX_PREFETCH0 (out->array[0]);
+		n_pkts = rte_eth_tx_burst (port, queue, out->array, (uint16_t)n_mbufs);
 
+		// A replay must not drop packets, keep the unsent ones for the next burst
 		if (unlikely (n_pkts < n_mbufs)) {
-			while (n_pkts < n_mbufs) {
-				rte_ctrlmbuf_free (tmpbuf);
-				n_mbufs--;
+			memmove (out->array, &out->array[n_pkts], (n_mbufs - n_pkts) * sizeof (out->array[0]));
+		}
+		out->n_mbufs -= n_pkts;
+
+#ifdef QUEUE_STATS
+		lp->tx.nic_queues_count[i] += n_pkts;
+		lp->tx.nic_queues_iters[i]++;
+#endif
+	}
+}
+
+static inline int replay_lcore_io_tx_pending (struct replay_lcore_params_io *lp) {
+	uint32_t i;
+
+	for (i = 0; i < lp->tx.n_nic_queues; i++) {
+		if (lp->tx.mbuf_out[i].n_mbufs || !rte_ring_empty (lp->tx.rings_in[i])) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* NVMe streams */
+static void replay_nvme_read_complete (void *arg, int error) {
+	volatile int8_t *ready = (volatile int8_t *)arg;
+
+	*ready = error ? -1 : 1;
+}
+
+/* A stripe of the stream could not be read: it stops, and the replay fails */
+static void replay_nvme_stream_fail (struct replay_nvme_stream *st) {
+	if (st->failed) {
+		return;
+	}
+	printf ("NVMe %u: error reading the spcap-stream, it stops here\n", (unsigned)st->nvme);
+	st->failed   = 1;
+	st->finished = 1;
+	rte_atomic32_inc (&replay.nvme_failed);
+}
+
+static void replay_nvme_sgl_reset (void *arg, uint32_t offset) {
+	struct replay_nvme_sgl *sgl = (struct replay_nvme_sgl *)arg;
+
+	sgl->seg       = offset / REPLAY_ZC_SEGMENT_SIZE;
+	sgl->segoffset = offset % REPLAY_ZC_SEGMENT_SIZE;
+}
+
+static int replay_nvme_sgl_next (void *arg, void **address, uint32_t *length) {
+	struct replay_nvme_sgl *sgl = (struct replay_nvme_sgl *)arg;
+
+	*address = rte_pktmbuf_mtod_offset (sgl->segs[sgl->seg], void *, sgl->segoffset);
+	*length  = REPLAY_ZC_SEGMENT_SIZE - sgl->segoffset;
+	sgl->seg++;
+	sgl->segoffset = 0;
+	return 0;
+}
+
+/* Get the mbufs that will receive a stripe, each one with a page-aligned data room */
+static inline int replay_nvme_sgl_alloc (struct replay_nvme_stream *st, uint32_t slot) {
+	struct replay_nvme_sgl *sgl = &st->sgl[slot];
+	uint32_t i;
+
+	if (rte_pktmbuf_alloc_bulk (st->pool, sgl->segs, st->nsegs)) {
+		return -1;
+	}
+
+	for (i = 0; i < st->nsegs; i++) {
+		struct rte_mbuf *m = sgl->segs[i];
+		m->data_off = (uint16_t)RTE_PTR_DIFF (
+		    RTE_PTR_ALIGN_CEIL (m->buf_addr, REPLAY_ZC_SEGMENT_SIZE), m->buf_addr);
+		m->data_len = REPLAY_ZC_SEGMENT_SIZE;
+		m->pkt_len  = REPLAY_ZC_SEGMENT_SIZE;
+	}
+	return 0;
+}
+
+static inline void replay_nvme_stream_fill (struct replay_nvme_stream *st) {
+	while (st->inflight < REPLAY_STORAGE_READAHEAD && st->nextlba < st->endlba) {
+		uint32_t slot = (st->head + st->inflight) % REPLAY_STORAGE_READAHEAD;
+		idisk *dsk    = sio_replica (st->disk, st->mirror);
+		int rc;
+
+		st->ready[slot] = 0;
+		if (st->buffs) {
+			rc = sio_read_async (dsk,
+			                     st->buffs + slot * st->stripelen,
+			                     st->nextlba,
+			                     st->stripesectors,
+			                     replay_nvme_read_complete,
+			                     (void *)&st->ready[slot]);
+		} else {
+			if (unlikely (replay_nvme_sgl_alloc (st, slot))) {  // no mbufs, retry later
+				break;
+			}
+			rc = sio_readv_async (dsk,
+			                      st->nextlba,
+			                      st->stripesectors,
+			                      replay_nvme_sgl_reset,
+			                      replay_nvme_sgl_next,
+			                      &st->sgl[slot],
+			                      replay_nvme_read_complete,
+			                      (void *)&st->ready[slot]);
+		}
+		if (unlikely (rc != 0)) {
+			st->endlba = st->nextlba;  // stop reading this NVMe
+			replay_nvme_stream_fail (st);
+			break;
+		}
+
+		st->nextlba += st->stripesectors;
+		st->inflight++;
+		if (st->nextlba + st->stripesectors > st->endlba &&
+		    fileDiskExtent (replay.raid,
+		                    replay.file,
+		                    st->nvme,
+		                    &st->extent,
+		                    &st->nextlba,
+		                    &st->endlba)) {
+			st->nextlba = st->endlba;  // no more extents
+		}
+	}
+}
+
+static inline void replay_nvme_stream_poll (struct replay_nvme_stream *st) {
+	sio_poll (st->disk);
+	if (st->mirror) {
+		sio_poll (st->mirror);
+	}
+}
+
+/* Release the oldest stripe so it can be read again */
+static inline void replay_nvme_stream_release (struct replay_nvme_stream *st) {
+	if (!st->buffs) {
+		uint32_t i;
+		// The packets still being sent keep their own reference of the mbufs
+		for (i = 0; i < st->nsegs; i++) {
+			rte_pktmbuf_free (st->sgl[st->head].segs[i]);
+		}
+	}
+
+	st->head = (st->head + 1) % REPLAY_STORAGE_READAHEAD;
+	st->inflight--;
+}
+
+/* Wait for the read-ahead still in flight before leaving the qpair */
+static inline void replay_nvme_stream_drain (struct replay_nvme_stream *st) {
+	while (st->inflight) {
+		replay_nvme_stream_poll (st);
+		if (st->ready[st->head]) {  // read or not, it is not sent
+			st->offset = 0;
+			replay_nvme_stream_release (st);
+		}
+	}
+}
+
+/* Bytes already read from the NVMe that can be consumed */
+static inline uint64_t replay_nvme_stream_avail (struct replay_nvme_stream *st) {
+	uint64_t avail = 0;
+	uint32_t i;
+
+	for (i = 0; i < st->inflight; i++) {
+		int8_t ready = st->ready[(st->head + i) % REPLAY_STORAGE_READAHEAD];
+
+		if (unlikely (ready < 0)) {
+			replay_nvme_stream_fail (st);
+		}
+		if (ready <= 0) {
+			break;
+		}
+		avail += st->stripelen;
+	}
+
+	return avail ? avail - st->offset : 0;
+}
+
+static inline char *replay_nvme_stream_ptr (struct replay_nvme_stream *st,
+                                            uint32_t slot,
+                                            uint64_t offset) {
+	if (st->buffs) {
+		return st->buffs + slot * st->stripelen + offset;
+	} else {
+		return rte_pktmbuf_mtod_offset (st->sgl[slot].segs[offset / REPLAY_ZC_SEGMENT_SIZE],
+		                                char *,
+		                                offset % REPLAY_ZC_SEGMENT_SIZE);
+	}
+}
+
+/* Copy (or skip, if dst is NULL) the next len bytes of the stream. They must be available */
+static inline void replay_nvme_stream_read (struct replay_nvme_stream *st,
+                                            void *dst,
+                                            uint64_t len,
+                                            int consume) {
+	uint32_t head   = st->head;
+	uint64_t offset = st->offset;
+
+	while (len) {
+		uint64_t n = RTE_MIN (len, st->seglen - offset % st->seglen);
+
+		if (dst) {
+			rte_memcpy (dst, replay_nvme_stream_ptr (st, head, offset), n);
+			dst = (char *)dst + n;
+		}
+		len -= n;
+		offset += n;
+
+		if (offset == st->stripelen) {
+			head   = (head + 1) % REPLAY_STORAGE_READAHEAD;
+			offset = 0;
+			if (consume) {
+				replay_nvme_stream_release (st);
+			}
+		}
+	}
+
+	if (consume) {
+		st->offset = offset;
+	}
+}
+
+/* Zero-copy: build a chain of indirect mbufs pointing to the next len bytes of the stream */
+static inline struct rte_mbuf *replay_nvme_stream_attach (struct replay_nvme_stream *st,
+                                                          struct rte_mempool *clone_pool,
+                                                          uint64_t len) {
+	struct rte_mbuf *pkts[REPLAY_ZC_PKT_SEGMENTS];
+	uint32_t head   = st->head;
+	uint64_t offset = st->offset;
+	uint32_t n_segs = (len + REPLAY_ZC_SEGMENT_SIZE - 1) / REPLAY_ZC_SEGMENT_SIZE + 1;
+	uint32_t i;
+
+	if (unlikely (rte_pktmbuf_alloc_bulk (clone_pool, pkts, n_segs))) {
+		return NULL;
+	}
+
+	for (i = 0; len; i++) {
+		uint64_t n = RTE_MIN (len, REPLAY_ZC_SEGMENT_SIZE - offset % REPLAY_ZC_SEGMENT_SIZE);
+		struct rte_mbuf *seg = st->sgl[head].segs[offset / REPLAY_ZC_SEGMENT_SIZE];
+
+		rte_pktmbuf_attach (pkts[i], seg);
+		pkts[i]->data_off += offset % REPLAY_ZC_SEGMENT_SIZE;
+		pkts[i]->data_len = n;
+		if (i) {
+			pkts[i - 1]->next = pkts[i];
+		}
+		len -= n;
+		offset += n;
+
+		if (offset == st->stripelen) {
+			head   = (head + 1) % REPLAY_STORAGE_READAHEAD;
+			offset = 0;
+		}
+	}
+	pkts[i - 1]->next = NULL;
+	pkts[0]->nb_segs  = i;
+
+	// Return the clones not needed
+	for (; i < n_segs; i++) {
+		rte_pktmbuf_free (pkts[i]);
+	}
+
+	return pkts[0];
+}
+
+/* Block layout: read the header of the head stripe. 0 if the stream can go on */
+static inline int replay_nvme_stream_block (struct replay_nvme_stream *st) {
+	spcap_block block;
+
+	if (st->blockend) {
+		return 0;
+	}
+	if (replay_nvme_stream_avail (st) == 0) {  // the head stripe is not read yet
+		if (st->inflight == 0 && st->nextlba >= st->endlba) {
+			st->finished = 1;
+		}
+		return -1;
+	}
+
+	rte_memcpy (&block, replay_nvme_stream_ptr (st, st->head, 0), sizeof (spcap_block));
+	// the empty blocks (or anything else) after the capture end the stream
+	st->blockend = spcapBlockEnd (&block, st->stripelen);
+	if (st->blockend == 0) {
+		st->finished = 1;
+		return -1;
+	}
+	st->blockseq    = block.seq;
+	st->blockalign  = block.align;
+	st->blockformat = block.format;
+	if (st->offset < SPCAPFIRST (block.align)) {
+		replay_nvme_stream_read (st, NULL, SPCAPFIRST (block.align) - st->offset, 1);
+	}
+	return 0;
+}
+
+static inline uint32_t replay_nvme_stream_decode (struct replay_nvme_stream *st,
+                                                  struct rte_mempool *pool,
+                                                  struct rte_mempool *clone_pool,
+                                                  struct rte_mbuf **mbufs,
+                                                  uint32_t n_mbufs) {
+	uint8_t blocks = replay.file->layout == SPCAP_LAYOUT_BLOCKS;
+	uint32_t n     = 0;
+
+	while (n < n_mbufs && likely (!st->failed)) {
+		uint64_t avail, time = 0;  // the timing is not replayed
+		uint8_t raw[SPCAPMAXHEADER];
+		uint32_t hsize, esize;
+		struct rte_mbuf *m;
+		spcap_pkt header;
+
+		if (blocks) {
+			uint32_t next;
+
+			if (replay_nvme_stream_block (st)) {
+				break;
+			}
+			next = SPCAPALIGNUP (st->offset, st->blockalign);  // skip the padding
+			if (next < st->blockend && next > st->offset) {
+				replay_nvme_stream_read (st, NULL, next - st->offset, 1);
+			}
+			if (next >= st->blockend) {  // the rest of the stripe has no packets
+				replay_nvme_stream_read (st, NULL, st->stripelen - st->offset, 1);
+				st->blockend = 0;
+				if (replay.ordered) {  // the next block may be in another NVMe
+					break;
+				}
+				continue;
+			}
+		}
+		avail = replay_nvme_stream_avail (st);
+
+		if (blocks) {  // the whole block is read, and its headers have their own format
+			uint32_t left = st->blockend - st->offset;
+			uint32_t peek = RTE_MIN (left, SPCAPMAXHEADER);
+
+			replay_nvme_stream_read (st, raw, peek, 0);
+			hsize = spcapParse (raw, peek, st->blockformat, &time, &header);
+			if (unlikely (hsize == 0 || hsize + header.caplen > left)) {
+				replay_nvme_stream_read (st, NULL, left, 1);  // a broken block
+				continue;
 			}
 		} else {
-			lp->tx.mbuf_out[port].n_mbufs++;
+			if (avail < sizeof (spcap_header)) {
+				if (st->inflight == 0 && st->nextlba >= st->endlba) {
+					st->finished = 1;
+				}
+				break;
+			}
+
+			replay_nvme_stream_read (st, raw, sizeof (spcap_header), 0);
+			hsize = spcapParse (raw, sizeof (spcap_header), SPCAP_FORMAT_FIXED, &time, &header);
+			if (header.len == 0 && header.caplen == 0) {  // end of the stream
+				st->finished = 1;
+				break;
+			}
+			if (avail < hsize + header.caplen) {  // wait for the next stripe
+				break;
+			}
 		}
+		esize = header.caplen;
+
+		if (unlikely (st->skip)) {  // before the packet seeked
+			replay_nvme_stream_read (st, NULL, hsize + esize, 1);
+			st->skip--;
+			continue;
+		}
+
+		if (clone_pool) {
+			replay_nvme_stream_read (st, NULL, hsize, 1);
+			m = replay_nvme_stream_attach (st, clone_pool, esize);
+			if (unlikely (m == NULL)) {
+				replay_nvme_stream_read (st, NULL, esize, 1);
+				st->drops++;
+				continue;
+			}
+			replay_nvme_stream_read (st, NULL, esize, 1);
+		} else {
+			if (unlikely (esize >
+			              rte_pktmbuf_data_room_size (pool) - RTE_PKTMBUF_HEADROOM)) {
+				replay_nvme_stream_read (st, NULL, hsize + esize, 1);
+				st->drops++;
+				continue;
+			}
+
+			m = rte_pktmbuf_alloc (pool);
+			if (unlikely (m == NULL)) {  // try again later, without losing the packet
+				break;
+			}
+
+			replay_nvme_stream_read (st, NULL, hsize, 1);
+			replay_nvme_stream_read (st, rte_pktmbuf_mtod (m, void *), esize, 1);
+			m->data_len = esize;
+		}
+		m->pkt_len = esize;
+		mbufs[n++] = m;
+
+		st->pkts++;
+		st->bytes += esize;
 	}
+
+	return n;
 }
 
-static unsigned doloop = 1;
+static void replay_lcore_main_loop_storage (void) {
+	uint32_t lcore                         = rte_lcore_id ();
+	struct replay_lcore_params_storage *lp = &replay.lcore_params[lcore].storage;
+	struct rte_mempool *pool               = replay.lcore_params[lcore].pool;
+	struct rte_mempool *clone_pool         = replay.lcore_params[lcore].clone_pool;
+	uint32_t bsz_wr                        = replay.burst_size_io_tx_write;
+	uint32_t n_active                      = lp->n_nvme;
+	uint8_t done[REPLAY_MAX_NVME_PER_STORAGE_LCORE] = {0};
+	uint32_t i;
+
+	while (likely (doloop) && n_active) {
+		for (i = 0; i < lp->n_nvme; i++) {
+			struct replay_nvme_stream *st = &lp->streams[i];
+			struct replay_mbuf_array *out = &lp->mbuf_out[i];
+			uint32_t n;
+
+			if (unlikely (done[i])) {
+				continue;
+			}
+
+			if (!st->finished) {
+				replay_nvme_stream_fill (st);
+				replay_nvme_stream_poll (st);
+
+				if (out->n_mbufs < bsz_wr) {
+					out->n_mbufs += replay_nvme_stream_decode (st,
+					                                           pool,
+					                                           clone_pool,
+					                                           &out->array[out->n_mbufs],
+					                                           bsz_wr - out->n_mbufs);
+				}
+			}
+
+			if (out->n_mbufs) {
+				n = rte_ring_sp_enqueue_burst (lp->rings_out[i], (void **)out->array, out->n_mbufs);
+				if (unlikely (n < out->n_mbufs)) {
+					memmove (out->array, &out->array[n], (out->n_mbufs - n) * sizeof (out->array[0]));
+				}
+				out->n_mbufs -= n;
+			}
+
+			if (unlikely (st->finished && out->n_mbufs == 0)) {
+				replay_nvme_stream_drain (st);
+
+				printf ("NVMe %u: %lu packets (%lu bytes) read, %lu dropped\n",
+				        (unsigned)lp->nvme[i],
+				        st->pkts,
+				        st->bytes,
+				        st->drops);
+				done[i] = 1;
+				n_active--;
+				rte_atomic32_dec (&replay.nvme_active);
+			}
+		}
+	}
+}
+
+/* Order kept: the blocks of every NVMe are sent by their seq, the lowest one first */
+static void replay_lcore_main_loop_ordered (void) {
+	uint32_t lcore                         = rte_lcore_id ();
+	struct replay_lcore_params_storage *lp = &replay.lcore_params[lcore].storage;
+	struct rte_mempool *pool               = replay.lcore_params[lcore].pool;
+	struct rte_mempool *clone_pool         = replay.lcore_params[lcore].clone_pool;
+	struct replay_mbuf_array *out          = &lp->mbuf_out[0];
+	uint32_t bsz_wr                        = replay.burst_size_io_tx_write;
+	uint32_t i, n;
+
+	while (likely (doloop)) {
+		struct replay_nvme_stream *next = NULL;
+		uint32_t waiting                = 0;
+
+		for (i = 0; i < lp->n_nvme; i++) {
+			struct replay_nvme_stream *st = &lp->streams[i];
+
+			if (st->finished) {
+				continue;
+			}
+			replay_nvme_stream_fill (st);
+			replay_nvme_stream_poll (st);
+			if (replay_nvme_stream_block (st)) {
+				waiting += !st->finished;
+				continue;
+			}
+			if (next == NULL || st->blockseq < next->blockseq) {
+				next = st;
+			}
+		}
+
+		// a NVMe whose block is not read yet may have the lowest seq
+		if (next && !waiting && out->n_mbufs < bsz_wr) {
+			out->n_mbufs += replay_nvme_stream_decode (
+			    next, pool, clone_pool, &out->array[out->n_mbufs], bsz_wr - out->n_mbufs);
+		}
+
+		if (out->n_mbufs) {
+			n = rte_ring_sp_enqueue_burst (lp->rings_out[0], (void **)out->array, out->n_mbufs);
+			if (unlikely (n < out->n_mbufs)) {
+				memmove (out->array, &out->array[n], (out->n_mbufs - n) * sizeof (out->array[0]));
+			}
+			out->n_mbufs -= n;
+		}
+
+		if (unlikely (next == NULL && !waiting && out->n_mbufs == 0)) {
+			break;
+		}
+	}
+
+	for (i = 0; i < lp->n_nvme; i++) {
+		struct replay_nvme_stream *st = &lp->streams[i];
+
+		replay_nvme_stream_drain (st);
+
+		printf ("NVMe %u: %lu packets (%lu bytes) read, %lu dropped\n",
+		        (unsigned)lp->nvme[i],
+		        st->pkts,
+		        st->bytes,
+		        st->drops);
+		rte_atomic32_dec (&replay.nvme_active);
+	}
+}
 
 static void replay_lcore_main_loop_io (void) {
 	uint32_t lcore                    = rte_lcore_id ();
@@ -185,6 +700,12 @@ static void replay_lcore_main_loop_io (void) {
 		if (likely (lp->tx.n_nic_queues > 0)) {
 			replay_lcore_io_tx (lp, bsz_tx_wr);
 		}
+
+		// Finish once every NVMe has been read and sent
+		if (unlikely (rte_atomic32_read (&replay.nvme_active) == 0) &&
+		    !replay_lcore_io_tx_pending (lp)) {
+			break;
+		}
 	}
 }
 
@@ -194,11 +715,17 @@ int replay_lcore_main_loop (__attribute__ ((unused)) void *arg) {
 
 	lcore = rte_lcore_id ();
 	lp    = &replay.lcore_params[lcore];
+	sio_setqueue (lp->qid);
 
 	if (lp->type == e_REPLAY_LCORE_IO) {
 		printf ("Logical core %u (I/O) main loop.\n", lcore);
-		for (;;) {
-			replay_lcore_main_loop_io ();
+		replay_lcore_main_loop_io ();
+	} else if (lp->type == e_REPLAY_LCORE_STORAGE) {
+		printf ("Logical core %u (Storage) main loop.\n", lcore);
+		if (replay.ordered) {
+			replay_lcore_main_loop_ordered ();
+		} else {
+			replay_lcore_main_loop_storage ();
 		}
 	}
 
@@ -17,17 +17,20 @@ static void app_usage (void) {
 	    "This is a NVME-DPDK-PCAPReplay %s tool\n"
 	    "\n"
 	    "Available options are:\n"
+	    "--compact : After removing the files (if any), move the others so the free space\n"
+	    "            is contiguous. It can take a while, the moved data is copied\n"
 	    "--help : To show this help info\n",
 	    "rm");
 }
 
 size_t n_files;
 char const *const *file;
+int fcompact = 0;
 
 static void app_paramCheck (void) {
 	int stopExecution = 0;
 
-	if (n_files == 0) {
+	if (n_files == 0 && !fcompact) {
 		stopExecution = 1;
 		printf ("PARAM-ERROR: Need to pass at least one file to remove\n");
 	}
@@ -39,20 +42,25 @@ static void app_paramCheck (void) {
 }
 
 void app_config (int argc, char **argv, struct spdk_env_opts *conf) {
-	UNUSED(conf);
+	conf->mem_size = SIO_TOOLMEMSIZE;  // mapping every hugepage is most of the start-up
 	
 	int c;
 	while (1) {
-		static struct option long_options[] = {{"help", no_argument, 0, 'h'}, {0, 0, 0, 0}};
+		static struct option long_options[] = {
+		    {"help", no_argument, 0, 'h'}, {"compact", no_argument, 0, 'c'}, {0, 0, 0, 0}};
 		/* getopt_long stores the option index here. */
 		int option_index = 0;
 
-		c = getopt_long (argc, argv, ":h", long_options, &option_index);
+		c = getopt_long (argc, argv, ":hc", long_options, &option_index);
 		/* Detect the end of the options. */
 		if (c == -1)
 			break;
 
 		switch (c) {
+			case 'c':
+				fcompact = 1;
+				break;
+
 			case 'h':
 			case '?':
 			default:
@@ -75,13 +83,32 @@ void app_init (nvmeRaid *raid) {
 void app_run (nvmeRaid *raid) {
 	size_t i;
 
+	// one commit for all of them
+	beginUpdate (raid);
 	for (i = 0; i < n_files; i++) {
-		printf ("Trying to remove file \"%26s\"...", file[i]);
+		printf ("Trying to remove file \"%s\"...", file[i]);
 		if (delFile (raid, file[i])) {
 			printf ("OK\n");
 		} else {
 			printf ("ERROR\n");
 		}
 	}
+	endUpdate (raid);
+
+	if (fcompact) {
+		int moves;
+
+		printf ("Compacting the raid (%lu free blocks, the biggest extent has %lu)...\n",
+		        blocksLeft (raid),
+		        biggestFreeBlocks (raid));
+		moves = compactRaid (raid);
+		if (moves < 0) {
+			printf ("ERROR\n");
+		} else {
+			printf ("%d extents moved, the biggest free extent has %lu blocks\n",
+			        moves,
+			        biggestFreeBlocks (raid));
+		}
+	}
 	return;
 }
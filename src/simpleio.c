@@ -1,77 +1,423 @@
 #include <common.h>
 #include <simpleio.h>
+#include <siobackend.h>
+
+#include <errno.h>
+#include <unistd.h>
 
-#include "spdk/nvme.h"
 #include "spdk/env.h"
 
 // Simpliest commands
 int sio_sectorSize (idisk* dsk) {
-	return spdk_nvme_ns_get_sector_size (dsk->ns);
+	return dsk->sectorLength;
+}
+
+uint64_t sio_numSectors (idisk* dsk) {
+	return dsk->numSectors;
+}
+
+// Disk set-up
+static __thread int sio_qid = 0;
+
+static inline sioQueue* sio_queue (idisk* dsk) {
+	return dsk->queue[sio_qid];
+}
+
+static sioQueue* sio_newqueue (idisk* dsk, uint32_t qdepth) {
+	sioQueue* q = calloc (1, sizeof (sioQueue));
+	uint32_t i;
+
+	if (q == NULL) {
+		fprintf (stderr, "ERROR: not enough memory for a new queue\n");
+		return NULL;
+	}
+
+	q->disk = dsk;
+	if (dsk->backend->newQueue (dsk, q)) {
+		free (q);
+		return NULL;
+	}
+
+	q->qdepth = qdepth;
+	for (i = 0; i < SIO_MAXQDEPTH; i++) {
+		q->tasks[i].queue = q;
+		q->tasks[i].next  = q->freeTasks;
+		q->freeTasks      = &q->tasks[i];
+	}
+	return q;
+}
+
+int sio_initdisk (idisk* dsk) {
+	dsk->queue[0] = sio_newqueue (dsk, SIO_DEFAULTQDEPTH);
+	if (dsk->queue[0] == NULL) {
+		return -1;
+	}
+	dsk->numqueues = 1;
+	return 0;
+}
+
+void sio_freedisk (idisk* dsk) {
+	int i;
+
+	for (i = 0; i < dsk->numqueues; i++) {
+		dsk->backend->freeQueue (dsk, dsk->queue[i]);
+		free (dsk->queue[i]);
+		dsk->queue[i] = NULL;
+	}
+	dsk->numqueues = 0;
+	if (dsk->fd >= 0) {
+		close (dsk->fd);
+		dsk->fd = -1;
+	}
+}
+
+int sio_initnvme (idisk* dsk, struct spdk_nvme_ctrlr* ctrlr, struct spdk_nvme_ns* ns) {
+	if (sio_nvme_open (dsk, ctrlr, ns)) {
+		return -1;
+	}
+	return sio_initdisk (dsk);
+}
+
+int sio_initfile (idisk* dsk, const char* path) {
+	if (sio_uring_open (dsk, path)) {
+		return -1;
+	}
+	return sio_initdisk (dsk);
+}
+
+// Pinned buffers
+static sioBuff* sio_freebuff[SIO_MAXSOCKETS];
+static uint64_t sio_buffsize   = 0;
+static volatile int sio_buffslock = 0;
+
+static inline uint32_t sio_socket (void) {
+	uint32_t socket = spdk_env_get_socket_id (spdk_env_get_current_core ());
+	return socket < SIO_MAXSOCKETS ? socket : 0;
+}
+
+static sioBuff* sio_newbuff (uint64_t size, uint32_t socket) {
+	sioBuff* b = malloc (sizeof (sioBuff));
+
+	if (b == NULL) {
+		return NULL;
+	}
+
+	// spdk_malloc takes the memory from the socket of the calling core
+	b->mem = spdk_malloc (size, MINSTRIPELENGTH, NULL);
+	if (b->mem == NULL) {
+		free (b);
+		return NULL;
+	}
+	b->size   = size;
+	b->socket = socket;
+	b->next   = NULL;
+	return b;
+}
+
+int sio_initbuffs (nvmeRaid* raid, int numbuffs) {
+	uint32_t socket = sio_socket ();
+	int i;
+
+	sio_buffsize = GIGASECTORLENGTH;
+	for (i = 0; i < numbuffs; i++) {
+		sioBuff* b = sio_newbuff (sio_buffsize, socket);
+		if (b == NULL) {
+			fprintf (stderr, "ERROR: not enough pinned memory for the buffers pool\n");
+			return -1;
+		}
+		sio_putbuff (b);
+	}
+	return 0;
+}
+
+sioBuff* sio_getbuff (uint64_t size) {
+	uint32_t socket = sio_socket ();
+	sioBuff *b, **prev;
+
+	while (__sync_lock_test_and_set (&sio_buffslock, 1))
+		;
+	// first fit
+	for (prev = &sio_freebuff[socket]; (b = *prev) != NULL; prev = &b->next) {
+		if (b->size >= size) {
+			*prev = b->next;
+			break;
+		}
+	}
+	__sync_lock_release (&sio_buffslock);
+
+	if (b == NULL) {
+		b = sio_newbuff (size > sio_buffsize ? size : sio_buffsize, socket);
+	}
+	return b;
+}
+
+void sio_putbuff (sioBuff* buff) {
+	if (buff == NULL) {
+		return;
+	}
+
+	while (__sync_lock_test_and_set (&sio_buffslock, 1))
+		;
+	buff->next                 = sio_freebuff[buff->socket];
+	sio_freebuff[buff->socket] = buff;
+	__sync_lock_release (&sio_buffslock);
+}
+
+void sio_freebuffs (void) {
+	int i;
+
+	for (i = 0; i < SIO_MAXSOCKETS; i++) {
+		while (sio_freebuff[i]) {
+			sioBuff* b      = sio_freebuff[i];
+			sio_freebuff[i] = b->next;
+			spdk_free (b->mem);
+			free (b);
+		}
+	}
+}
+
+void sio_setqdepth (nvmeRaid* raid, uint32_t qdepth) {
+	int i, j;
+
+	if (qdepth == 0)
+		qdepth = 1;
+	if (qdepth > SIO_MAXQDEPTH)
+		qdepth = SIO_MAXQDEPTH;
+
+	for (i = 0; i < raid->numdisks; i++) {
+		for (j = 0; j < raid->disk[i].numqueues; j++) {
+			raid->disk[i].queue[j]->qdepth = qdepth;
+		}
+	}
+}
+
+// Per-thread queues
+int sio_allocqueues (nvmeRaid* raid, int numqueues) {
+	int i;
+
+	if (numqueues > SIO_MAXQUEUES) {
+		fprintf (stderr, "ERROR: %d queues requested, limited to %d\n", numqueues, SIO_MAXQUEUES);
+		return -1;
+	}
+
+	for (i = 0; i < raid->numdisks; i++) {
+		idisk* dsk = &raid->disk[i];
+		while (dsk->numqueues < numqueues) {
+			dsk->queue[dsk->numqueues] = sio_newqueue (dsk, dsk->queue[0]->qdepth);
+			if (dsk->queue[dsk->numqueues] == NULL) {
+				return -1;
+			}
+			dsk->numqueues++;
+		}
+	}
+	return 0;
+}
+
+void sio_setqueue (int qid) {
+	sio_qid = qid;
 }
 
 // Async functions
-static void sio_read_complete (void* restrict arg,
-                               const struct spdk_nvme_cpl* restrict completion) {
-	UNUSED (completion);
-	uint64_t* iarg = (uint64_t*)arg;
-	++*iarg;
+void sio_complete (sioTask* t, int error) {
+	sioQueue* q = t->queue;
+	sio_cb cb   = t->cb;
+	void* cbarg = t->arg;
+
+	if (error) {
+		q->errors++;
+	}
+	q->inflight--;
+	q->completed++;
+
+	// release the task before the callback, so it could submit new ones
+	t->next      = q->freeTasks;
+	q->freeTasks = t;
+
+	if (cb) {
+		cb (cbarg, error);
+	}
+}
+
+static inline int sio_pollqueue (sioQueue* q) {
+	return q->disk->backend->poll (q);
+}
+
+// Backpressure: wait for the disk queue to have room for a new task
+static inline sioTask* sio_gettask (sioQueue* q, sio_cb cb, void* cbarg) {
+	sioTask* t;
+
+	while (q->inflight >= q->qdepth || !q->freeTasks) {
+		sio_pollqueue (q);
+	}
+
+	t            = q->freeTasks;
+	q->freeTasks = t->next;
+	t->cb        = cb;
+	t->arg       = cbarg;
+	return t;
+}
+
+static inline void sio_puttask (sioQueue* q, sioTask* t) {
+	t->next      = q->freeTasks;
+	q->freeTasks = t;
+}
+
+static int sio_submit (idisk* restrict dsk,
+                       sioTask* t,
+                       enum sioOp op,
+                       void* payload,
+                       uint64_t lba,
+                       uint32_t lba_count) {
+	sioQueue* q = t->queue;
+	int rc;
+
+	while ((rc = dsk->backend->submit (dsk, q, t, op, payload, lba, lba_count)) == -ENOMEM) {
+		sio_pollqueue (q);  // the backend has no free slots
+	}
+	if (rc != 0) {
+		sio_puttask (q, t);
+		fprintf (stderr, "starting I/O (%s, operation %d) failed\n", dsk->backend->name, op);
+		return rc;
+	}
+
+	q->inflight++;
+	q->scheduled++;
+	return 0;
+}
+
+int sio_read_async (idisk* restrict dsk,
+                    void* restrict payload,
+                    uint64_t lba,
+                    uint32_t lba_count,
+                    sio_cb cb,
+                    void* cbarg) {
+	sioTask* t = sio_gettask (sio_queue (dsk), cb, cbarg);
+	return sio_submit (dsk, t, SIO_OP_READ, payload, lba, lba_count);
+}
+
+int sio_write_async (idisk* restrict dsk,
+                     void* restrict payload,
+                     uint64_t lba,
+                     uint32_t lba_count,
+                     sio_cb cb,
+                     void* cbarg) {
+	sioTask* t = sio_gettask (sio_queue (dsk), cb, cbarg);
+	return sio_submit (dsk, t, SIO_OP_WRITE, payload, lba, lba_count);
+}
+
+int sio_readv_async (idisk* restrict dsk,
+                     uint64_t lba,
+                     uint32_t lba_count,
+                     sio_sgl_reset sglreset,
+                     sio_sgl_next sglnext,
+                     void* sglarg,
+                     sio_cb cb,
+                     void* cbarg) {
+	sioTask* t = sio_gettask (sio_queue (dsk), cb, cbarg);
+
+	t->sglReset = sglreset;
+	t->sglNext  = sglnext;
+	t->sglArg   = sglarg;
+	return sio_submit (dsk, t, SIO_OP_READV, NULL, lba, lba_count);
+}
+
+int sio_deallocate_async (
+    idisk* restrict dsk, uint64_t lba, uint64_t lba_count, sio_cb cb, void* cbarg) {
+	uint32_t flags = dsk->backend->flags (dsk);
+	uint64_t chunk = SIO_TRIMLENGTH / dsk->sectorLength;
+	enum sioOp op  = SIO_OP_DEALLOCATE;
+	int rc, commands = 0;
+
+	if (!(flags & SIO_F_DEALLOCATE)) {
+		if (!(flags & SIO_F_WRITEZEROES)) {
+			return 0;  // the disk can't be told
+		}
+		op    = SIO_OP_WRITEZEROES;
+		chunk = 1lu << 16;  // the number of blocks of write zeroes is 16 bits wide
+	}
+
+	// Several commands, so the disk works on them in parallel
+	while (lba_count) {
+		uint32_t count = lba_count < chunk ? lba_count : chunk;
+
+		rc = sio_submit (dsk, sio_gettask (sio_queue (dsk), cb, cbarg), op, NULL, lba, count);
+		if (rc != 0) {
+			return rc;
+		}
+		commands++;
+
+		lba_count -= count;
+		lba += count;
+	}
+
+	return commands;
+}
+
+int sio_flush_async (idisk* restrict dsk, sio_cb cb, void* cbarg) {
+	sioTask* t = sio_gettask (sio_queue (dsk), cb, cbarg);
+	return sio_submit (dsk, t, SIO_OP_FLUSH, NULL, 0, 0);
 }
 
-static void sio_write_complete (void* restrict arg,
-                                const struct spdk_nvme_cpl* restrict completion) {
-	UNUSED (completion);
+int sio_poll (idisk* dsk) {
+	return sio_pollqueue (sio_queue (dsk));
+}
+
+void sio_wait (idisk* dsk) {
+	sioQueue* q = sio_queue (dsk);
+	while (q->inflight) {
+		sio_pollqueue (q);
+	}
+}
 
-	uint64_t* iarg = (uint64_t*)arg;
-	++*iarg;
+static void sio_sync_complete (void* arg, int error) {
+	*(int*)arg = error ? -1 : 1;
 }
 
 // Works for pinned memory
 int sio_read (idisk* restrict dsk, void* restrict payload, uint64_t lba, uint32_t lba_count) {
-	int rc;
-	uint64_t completed = 0;
+	int rc, completed = 0;
 
-	rc = spdk_nvme_ns_cmd_read (
-	    dsk->ns, dsk->qpair, payload, lba, lba_count, sio_read_complete, &completed, 0);
+	rc = sio_read_async (dsk, payload, lba, lba_count, sio_sync_complete, &completed);
 	if (rc != 0) {
-		fprintf (stderr, "starting read I/O failed\n");
 		return rc;
 	}
 
 	while (!completed) {
-		spdk_nvme_qpair_process_completions (dsk->qpair, 0);
+		sio_poll (dsk);
 	}
 
-	return rc;
+	return completed < 0 ? -1 : 0;
 }
 int sio_write (idisk* restrict dsk, void* restrict payload, uint64_t lba, uint32_t lba_count) {
-	int rc;
-	uint64_t completed = 0;
+	int rc, completed = 0;
 
-	rc = spdk_nvme_ns_cmd_write (
-	    dsk->ns, dsk->qpair, payload, lba, lba_count, sio_write_complete, &completed, 0);
+	rc = sio_write_async (dsk, payload, lba, lba_count, sio_sync_complete, &completed);
 	if (rc != 0) {
-		fprintf (stderr, "starting write I/O failed\n");
 		return rc;
 	}
 
 	while (!completed) {
-		spdk_nvme_qpair_process_completions (dsk->qpair, 0);
+		sio_poll (dsk);
 	}
 
-	return rc;
+	return completed < 0 ? -1 : 0;
 }
 
 // Copy into pinned memory
 int sio_read_pinit (idisk* restrict dsk, void* restrict payload, uint64_t lba, uint32_t lba_count) {
-	int sectorSize = spdk_nvme_ns_get_sector_size (dsk->ns);
-	void* mem = spdk_malloc (lba_count * sectorSize, sectorSize, NULL);
-	if (mem == NULL) {
+	uint64_t size = (uint64_t)lba_count * dsk->sectorLength;
+	sioBuff* buff = sio_getbuff (size);
+	int ret;
+
+	if (buff == NULL) {
 		printf ("Error pinning memory for RD transaction\n");
 		return -1;
 	}
-	int ret = sio_read (dsk, mem, lba, lba_count);
-	memcpy (payload, mem, lba_count * sectorSize);
-	spdk_free (mem);
+	ret = sio_read (dsk, buff->mem, lba, lba_count);
+	if (ret == 0) {
+		memcpy (payload, buff->mem, size);
+	}
+	sio_putbuff (buff);
 	return ret;
 }
 
@@ -79,260 +425,316 @@ int sio_write_pinit (idisk* restrict dsk,
                      void* restrict payload,
                      uint64_t lba,
                      uint32_t lba_count) {
-	int sectorSize = spdk_nvme_ns_get_sector_size (dsk->ns);
-	void* mem = spdk_malloc (lba_count * sectorSize, sectorSize, NULL);
-	if (mem == NULL) {
+	uint64_t size = (uint64_t)lba_count * dsk->sectorLength;
+	sioBuff* buff = sio_getbuff (size);
+	int ret;
+
+	if (buff == NULL) {
 		printf ("Error pinning memory for WR transaction\n");
 		return -1;
 	}
-	memcpy (mem, payload, lba_count * sectorSize);
-	int ret = sio_write (dsk, mem, lba, lba_count);
-	spdk_free (mem);
+	memcpy (buff->mem, payload, size);
+	ret = sio_write (dsk, buff->mem, lba, lba_count);
+	sio_putbuff (buff);
 	return ret;
 }
 
-uint64_t task_completed = 0;
-uint64_t task_scheduled = 0;
+// The replica with less tasks in flight in this thread queue, b may be NULL
+idisk* sio_replica (idisk* a, idisk* b) {
+	if (b && sio_queue (b)->inflight < sio_queue (a)->inflight) {
+		return b;
+	}
+	return a;
+}
 
-// Works for pinned memory
-int sio_rread (nvmeRaid* restrict raid, void* restrict payload, uint64_t lba, uint32_t lba_count) {
-	int rc, i = 0;
-	uint64_t dstlba;
-
-	if (lba_count <= (SUPERSECTORNUM - lba % SUPERSECTORNUM)) {
-		i      = super_getdisk (raid, lba);
-		dstlba = super_getdisklba (raid, lba);
-		rc     = spdk_nvme_ns_cmd_read (raid->disk[i].ns,
-		                            raid->disk[i].qpair,
-		                            payload,
-		                            dstlba,
-		                            lba_count,
-		                            sio_read_complete,
-		                            &task_completed,
-		                            0);
-		if (rc != 0) {
-			fprintf (stderr, "starting read I/O failed\n");
-			return rc;
-		}
-		task_scheduled++;
-	} else if (lba % SUPERSECTORNUM) {  // unalligned
-		rc = sio_rread (raid, payload, lba, (SUPERSECTORNUM - lba % SUPERSECTORNUM));
-		if (rc != 0) {
-			return rc;
-		}
-		rc = sio_rread (raid,
-		                payload + ((SUPERSECTORNUM - lba % SUPERSECTORNUM)) * SECTORLENGTH,
-		                lba + (SUPERSECTORNUM - lba % SUPERSECTORNUM),
-		                lba_count - (SUPERSECTORNUM - lba % SUPERSECTORNUM));
-		if (rc != 0) {
-			return rc;
+// Works for pinned memory. Returns the number of commands, each one calls cb. If one can't be
+// queued, it waits for the ones queued before returning the error
+static int sio_rio (nvmeRaid* restrict raid,
+                    void* restrict payload,
+                    uint64_t lba,
+                    uint32_t lba_count,
+                    int write,
+                    sio_cb cb,
+                    void* cbarg) {
+	int rc, cmds = 0;
+
+	// Split the request in stripes, each one is queued in its own disk
+	while (lba_count) {
+		uint32_t count  = SUPERSECTORNUM - lba % SUPERSECTORNUM;
+		int disk        = super_getdisk (raid, lba);
+		int mirror      = super_getmirror (raid, disk);
+		idisk* dsk      = &raid->disk[disk];
+		uint64_t dstlba = super_getdisklba (raid, lba);
+
+		if (count > lba_count) {
+			count = lba_count;
 		}
-	} else {  // perfectly alligned
-		int k = 0;
-		while (lba_count >= SUPERSECTORNUM) {
-			i      = super_getdisk (raid, lba);
-			dstlba = super_getdisklba (raid, lba);
-			rc     = spdk_nvme_ns_cmd_read (raid->disk[i].ns,
-			                            raid->disk[i].qpair,
-			                            payload,
-			                            dstlba,
-			                            SUPERSECTORNUM,
-			                            sio_read_complete,
-			                            &task_completed,
-			                            0);
-			if (rc != 0) {
-				fprintf (stderr, "read I/O failed\n");
-				return rc;
-			}
-			task_scheduled++;
-			// move offsets
-			lba_count -= SUPERSECTORNUM;
-			lba += SUPERSECTORNUM;
-			payload += SUPERSECTORNUM * SECTORLENGTH;
-
-			if (++k >
-			    raid->numdisks * 128) {  // a 128 deep queue, should "flush" for each 128 requests
-				k = 0;
-				// check completations
-				for (i = 0; i < raid->numdisks; i++) {
-					spdk_nvme_qpair_process_completions (raid->disk[i].qpair, 0);
+
+		// Writes go to both replicas, reads to the less busy one
+		if (write) {
+			rc = sio_write_async (dsk, payload, dstlba, count, cb, cbarg);
+			if (rc == 0) {
+				cmds++;
+				if (mirror >= 0) {
+					rc = sio_write_async (&raid->disk[mirror], payload, dstlba, count, cb, cbarg);
+					cmds += rc == 0;
 				}
 			}
+		} else {
+			if (mirror >= 0) {
+				dsk = sio_replica (dsk, &raid->disk[mirror]);
+			}
+			rc = sio_read_async (dsk, payload, dstlba, count, cb, cbarg);
+			cmds += rc == 0;
 		}
-		if (lba_count) {
-			rc = sio_rread (raid, payload, lba, lba_count);
+		if (rc != 0) {
+			// the payload is not touched once this returns
+			if (cmds) {
+				sio_waittasks (raid);
+			}
+			return rc < 0 ? rc : -1;
 		}
+
+		// move offsets
+		lba_count -= count;
+		lba += count;
+		payload += count * SECTORLENGTH;
 	}
 
-	// check completations
-	for (i = 0; i < raid->numdisks; i++) {
-		spdk_nvme_qpair_process_completions (raid->disk[i].qpair, 0);
+	return cmds;
+}
+
+int sio_rread_async (nvmeRaid* restrict raid,
+                     void* restrict payload,
+                     uint64_t lba,
+                     uint32_t lba_count,
+                     sio_cb cb,
+                     void* cbarg) {
+	return sio_rio (raid, payload, lba, lba_count, 0, cb, cbarg);
+}
+
+int sio_rwrite_async (nvmeRaid* restrict raid,
+                      void* restrict payload,
+                      uint64_t lba,
+                      uint32_t lba_count,
+                      sio_cb cb,
+                      void* cbarg) {
+	return sio_rio (raid, payload, lba, lba_count, 1, cb, cbarg);
+}
+
+static void sio_rio_complete (void* arg, int error) {
+	if (error) {
+		*(int*)arg = -1;
 	}
-	return 0;
+}
+
+// Waits for the commands of the request, and their errors
+static int sio_rsync (
+    nvmeRaid* restrict raid, void* restrict payload, uint64_t lba, uint32_t lba_count, int write) {
+	int error = 0;
+	int rc    = sio_rio (raid, payload, lba, lba_count, write, sio_rio_complete, &error);
+
+	if (rc < 0) {
+		return rc;
+	}
+	sio_waittasks (raid);
+	return error;
+}
+
+int sio_rread (nvmeRaid* restrict raid, void* restrict payload, uint64_t lba, uint32_t lba_count) {
+	return sio_rsync (raid, payload, lba, lba_count, 0);
 }
 
 int sio_rwrite (nvmeRaid* restrict raid, void* restrict payload, uint64_t lba, uint32_t lba_count) {
-	int rc, i = 0;
-	uint64_t dstlba;
-
-	if (lba_count <= (SUPERSECTORNUM - lba % SUPERSECTORNUM)) {  // sector a escribir < supersector
-		i      = super_getdisk (raid, lba);
-		dstlba = super_getdisklba (raid, lba);
-		rc     = spdk_nvme_ns_cmd_write (raid->disk[i].ns,
-		                             raid->disk[i].qpair,
-		                             payload,
-		                             dstlba,
-		                             lba_count,
-		                             sio_write_complete,
-		                             &task_completed,
-		                             0);
-		if (rc != 0) {
-			fprintf (stderr, "starting write I/O failed\n");
-			return rc;
-		}
-		task_scheduled++;
-	} else if (lba % SUPERSECTORNUM) {  // unalligned
-		rc = sio_rwrite (raid, payload, lba, (SUPERSECTORNUM - lba % SUPERSECTORNUM));
-		if (rc != 0) {
-			return rc;
-		}
-		rc = sio_rwrite (raid,
-		                 payload + ((SUPERSECTORNUM - lba % SUPERSECTORNUM)) * SECTORLENGTH,
-		                 lba + (SUPERSECTORNUM - lba % SUPERSECTORNUM),
-		                 lba_count - (SUPERSECTORNUM - lba % SUPERSECTORNUM));
-		if (rc != 0) {
-			return rc;
-		}
-	} else {  // perfectly alligned
-		int k = 0;
-		while (lba_count >= SUPERSECTORNUM) {
-			i      = super_getdisk (raid, lba);
-			dstlba = super_getdisklba (raid, lba);
-			rc     = spdk_nvme_ns_cmd_write (raid->disk[i].ns,
-			                             raid->disk[i].qpair,
-			                             payload,
-			                             dstlba,
-			                             SUPERSECTORNUM,
-			                             sio_write_complete,
-			                             &task_completed,
-			                             0);
-
-			printf ("DEBUG2: writing %lu sectors @ sector %lu in sector %lu of disk %d\n",
-			        SUPERSECTORNUM,
-			        lba,
-			        dstlba,
-			        i);
-			if (rc != 0) {
-				fprintf (stderr, "write I/O failed\n");
-				return rc;
-			}
-			task_scheduled++;
-			// move offsets
-			lba_count -= SUPERSECTORNUM;
-			lba += SUPERSECTORNUM;
-			payload += SUPERSECTORNUM * SECTORLENGTH;
-
-			if (++k >
-			    raid->numdisks * 128) {  // a 128 deep queue, should "flush" for each 128 requests
-				k = 0;
-				// check completations
-				for (i = 0; i < raid->numdisks; i++) {
-					spdk_nvme_qpair_process_completions (raid->disk[i].qpair, 0);
-				}
-			}
-		}
-		if (lba_count) {
-			rc = sio_rwrite (raid, payload, lba, lba_count);
-		}
+	return sio_rsync (raid, payload, lba, lba_count, 1);
+}
+
+// Copy into pinned memory
+// The copy of each gigasector overlaps the I/O of the next ones, using SIO_PIPEBUFFS buffers
+typedef struct {
+	sioBuff* buff;
+	void* payload;
+	uint32_t count;
+	int stripes;  // submitted, -1 while submitting
+	int done;
+	int error;
+} sioChunk;
+
+static void sio_chunk_complete (void* arg, int error) {
+	sioChunk* c = (sioChunk*)arg;
+	if (error) {
+		c->error = 1;
 	}
+	c->done++;
+}
 
-	// check completations
-	for (i = 0; i < raid->numdisks; i++) {
-		spdk_nvme_qpair_process_completions (raid->disk[i].qpair, 0);
+static int sio_chunk_submit (nvmeRaid* restrict raid, sioChunk* c, uint64_t lba, int write) {
+	int rc;
+
+	c->stripes = -1;
+	c->done    = 0;
+	c->error   = 0;
+	rc = sio_rio (raid, c->buff->mem, lba, c->count, write, sio_chunk_complete, c);
+	if (rc < 0) {
+		// the stripes queued are done already
+		c->stripes = c->done;
+		return rc;
 	}
+	c->stripes = rc;
 	return 0;
 }
 
-// Copy into pinned memory
-int sio_rread_pinit (nvmeRaid* restrict raid,
-                     void* restrict payload,
-                     uint64_t lba,
-                     uint32_t lba_count) {
-	int ret   = 0;
-	void* mem = spdk_malloc (GIGASECTORLENGTH, SECTORLENGTH, NULL);
+static int sio_chunk_wait (nvmeRaid* restrict raid, sioChunk* c) {
+	while (c->done != c->stripes) {
+		sio_rpoll (raid);
+	}
+	return c->error ? -1 : 0;
+}
 
-	if (!mem) {
-		puts ("SIO: memory error");
-		exit (-1);
+static int sio_rpipe (
+    nvmeRaid* restrict raid, void* restrict payload, uint64_t lba, uint32_t lba_count, int write) {
+	sioChunk chunk[SIO_PIPEBUFFS];
+	uint32_t numchunks = (lba_count + GIGASECTORNUM - 1) / GIGASECTORNUM;
+	uint32_t numbuffs  = numchunks < SIO_PIPEBUFFS ? numchunks : SIO_PIPEBUFFS;
+	uint32_t head = 0, tail = 0, i;
+	int ret = 0;
+
+	for (i = 0; i < numbuffs; i++) {
+		chunk[i].buff = sio_getbuff (lba_count < GIGASECTORNUM ? lba_count * SECTORLENGTH
+		                                                       : GIGASECTORLENGTH);
+		if (!chunk[i].buff) {
+			puts ("SIO: memory error");
+			exit (-1);
+		}
+		chunk[i].stripes = chunk[i].done = 0;
 	}
 
-	while (lba_count >= GIGASECTORNUM) {
-		ret += sio_rread (raid, mem, lba, GIGASECTORNUM);
-		if (ret) {
-			return ret;
+	// head: next chunk to finish, tail: next chunk to submit
+	while (head < numchunks) {
+		while (tail < numchunks && tail - head < numbuffs) {
+			sioChunk* c = &chunk[tail % numbuffs];
+
+			c->count   = lba_count < GIGASECTORNUM ? lba_count : GIGASECTORNUM;
+			c->payload = payload;
+			if (write) {
+				memcpy (c->buff->mem, payload, c->count * SECTORLENGTH);
+			}
+			ret = sio_chunk_submit (raid, c, lba, write);
+			if (ret) {
+				goto out;
+			}
+
+			lba_count -= c->count;
+			lba += c->count;
+			payload += c->count * SECTORLENGTH;
+			tail++;
 		}
-		sio_waittasks (raid);
-		memcpy (payload, mem, GIGASECTORLENGTH);
 
-		lba_count -= GIGASECTORNUM;
-		lba += GIGASECTORNUM;
-		payload += GIGASECTORLENGTH;
-	}
-	if (lba_count) {
-		ret = sio_rread (raid, mem, lba, lba_count);
-		sio_waittasks (raid);
-		memcpy (payload, mem, lba_count * SECTORLENGTH);
+		sioChunk* c = &chunk[head % numbuffs];
+		ret         = sio_chunk_wait (raid, c);
 		if (ret) {
-			return ret;
+			goto out;
 		}
+		if (!write) {
+			memcpy (c->payload, c->buff->mem, c->count * SECTORLENGTH);
+		}
+		head++;
 	}
 
-	spdk_free (mem);
+out:
+	sio_waittasks (raid);
+	for (i = 0; i < numbuffs; i++) {
+		sio_putbuff (chunk[i].buff);
+	}
 	return ret;
 }
+
+int sio_rread_pinit (nvmeRaid* restrict raid,
+                     void* restrict payload,
+                     uint64_t lba,
+                     uint32_t lba_count) {
+	return sio_rpipe (raid, payload, lba, lba_count, 0);
+}
+
 int sio_rwrite_pinit (nvmeRaid* restrict raid,
                       void* restrict payload,
                       uint64_t lba,
                       uint32_t lba_count) {
-	int ret   = 0;
-	void* mem = spdk_malloc (GIGASECTORLENGTH, SECTORLENGTH, NULL);
+	return sio_rpipe (raid, payload, lba, lba_count, 1);
+}
 
-	if (!mem) {
-		puts ("SIO: memory error");
-		exit (-1);
+static void sio_trim_complete (void* arg, int error) {
+	if (error) {
+		*(int*)arg = -1;
 	}
+}
 
-	while (lba_count >= GIGASECTORNUM) {
-		memcpy (mem, payload, GIGASECTORLENGTH);
-		ret += sio_rwrite (raid, mem, lba, GIGASECTORNUM);
-		if (ret) {
-			return ret;
-		}
-		sio_waittasks (raid);
+int sio_rdeallocate (nvmeRaid* restrict raid, uint64_t lba, uint64_t lba_count) {
+	uint64_t moved = super_getsplit (raid, lba, lba + lba_count);
+	int i, rc, error = 0;
 
-		lba_count -= GIGASECTORNUM;
-		lba += GIGASECTORNUM;
-		payload += GIGASECTORLENGTH;
+	// while expanding, the stripes not moved yet use the old stripe map
+	if (moved < lba + lba_count) {
+		error = sio_rdeallocate (raid, lba, moved - lba);
+		rc    = sio_rdeallocate (raid, moved, lba + lba_count - moved);
+		return error ? error : rc;
 	}
-	if (lba_count) {
-		memcpy (mem, payload, lba_count * SECTORLENGTH);
-		ret = sio_rwrite (raid, mem, lba, lba_count);
-		sio_waittasks (raid);
-		if (ret) {
-			return ret;
+
+	// The sectors of the range in every disk are contiguous, one command (or a few) per disk
+	for (i = 0; i < raid->numdisks; i++) {
+		uint64_t start, stop;
+
+		if (!super_getrange (raid, lba, lba + lba_count, i, &start, &stop)) {
+			continue;
+		}
+		rc = sio_deallocate_async (&raid->disk[i], start, stop - start, sio_trim_complete, &error);
+		if (rc < 0) {
+			error = rc;
+			break;
 		}
 	}
 
-	spdk_free (mem);
-	return ret;
+	sio_waittasks (raid);
+	return error;
+}
+
+int sio_rflush (nvmeRaid* restrict raid) {
+	int i, rc, error = 0;
+
+	for (i = 0; i < raid->numdisks; i++) {
+		rc = sio_flush_async (&raid->disk[i], sio_trim_complete, &error);
+		if (rc < 0) {
+			error = rc;
+			break;
+		}
+	}
+
+	sio_waittasks (raid);
+	return error;
+}
+
+// Process completions of every disk
+int sio_rpoll (nvmeRaid* raid) {
+	int i, completed = 0;
+
+	for (i = 0; i < raid->numdisks; i++) {
+		completed += sio_poll (&raid->disk[i]);
+	}
+	return completed;
 }
 
 // Wait until all tasks finishes
 void sio_waittasks (nvmeRaid* raid) {
-	int i;
-	while (task_scheduled > task_completed) {
+	int i, pending;
+
+	// every disk progresses on its own, a slow one does not stop the others
+	do {
+		pending = 0;
 		for (i = 0; i < raid->numdisks; i++) {
-			spdk_nvme_qpair_process_completions (raid->disk[i].qpair, 0);
+			if (sio_queue (&raid->disk[i])->inflight) {
+				sio_poll (&raid->disk[i]);
+				pending = 1;
+			}
 		}
-	}
+	} while (pending);
 }
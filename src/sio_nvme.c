@@ -0,0 +1,109 @@
+#include <common.h>
+#include <siobackend.h>
+
+#include <errno.h>
+
+#include "spdk/nvme.h"
+#include "spdk/env.h"
+
+// SPDK backend: every queue is an I/O qpair of the controller
+static void sio_nvme_complete (void* restrict arg, const struct spdk_nvme_cpl* restrict completion) {
+	sio_complete ((sioTask*)arg, spdk_nvme_cpl_is_error (completion));
+}
+
+static void sio_nvme_sgl_reset (void* arg, uint32_t offset) {
+	sioTask* t = (sioTask*)arg;
+	t->sglReset (t->sglArg, offset);
+}
+
+static int sio_nvme_sgl_next (void* arg, void** address, uint32_t* length) {
+	sioTask* t = (sioTask*)arg;
+	return t->sglNext (t->sglArg, address, length);
+}
+
+static uint32_t sio_nvme_flags (idisk* dsk) {
+	uint32_t flags = spdk_nvme_ns_get_flags (dsk->ns), ret = 0;
+
+	if (flags & SPDK_NVME_NS_DEALLOCATE_SUPPORTED)
+		ret |= SIO_F_DEALLOCATE;
+	if (flags & SPDK_NVME_NS_WRITE_ZEROES_SUPPORTED)
+		ret |= SIO_F_WRITEZEROES;
+	return ret;
+}
+
+static int sio_nvme_newqueue (idisk* dsk, sioQueue* q) {
+	q->ctx = spdk_nvme_ctrlr_alloc_io_qpair (dsk->ctrlr, SPDK_NVME_QPRIO_URGENT);
+	if (q->ctx == NULL) {
+		fprintf (stderr, "ERROR: spdk_nvme_ctrlr_alloc_io_qpair() failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void sio_nvme_freequeue (idisk* dsk, sioQueue* q) {
+	UNUSED (dsk);
+	spdk_nvme_ctrlr_free_io_qpair (q->ctx);
+}
+
+static int sio_nvme_submit (idisk* dsk,
+                            sioQueue* q,
+                            sioTask* t,
+                            enum sioOp op,
+                            void* payload,
+                            uint64_t lba,
+                            uint32_t lba_count) {
+	struct spdk_nvme_qpair* qpair = q->ctx;
+	struct spdk_nvme_dsm_range range;
+
+	switch (op) {
+		case SIO_OP_READ:
+			return spdk_nvme_ns_cmd_read (
+			    dsk->ns, qpair, payload, lba, lba_count, sio_nvme_complete, t, 0);
+		case SIO_OP_WRITE:
+			return spdk_nvme_ns_cmd_write (
+			    dsk->ns, qpair, payload, lba, lba_count, sio_nvme_complete, t, 0);
+		case SIO_OP_READV:
+			return spdk_nvme_ns_cmd_readv (dsk->ns,
+			                               qpair,
+			                               lba,
+			                               lba_count,
+			                               sio_nvme_complete,
+			                               t,
+			                               0,
+			                               sio_nvme_sgl_reset,
+			                               sio_nvme_sgl_next);
+		case SIO_OP_DEALLOCATE:
+			// the ranges are copied by spdk when submitting
+			range.attributes   = 0;
+			range.length       = lba_count;
+			range.starting_lba = lba;
+			return spdk_nvme_ns_cmd_deallocate (dsk->ns, qpair, &range, 1, sio_nvme_complete, t);
+		case SIO_OP_WRITEZEROES:
+			return spdk_nvme_ns_cmd_write_zeroes (
+			    dsk->ns, qpair, lba, lba_count, sio_nvme_complete, t, 0);
+		case SIO_OP_FLUSH:
+			return spdk_nvme_ns_cmd_flush (dsk->ns, qpair, sio_nvme_complete, t);
+	}
+	return -EINVAL;
+}
+
+static int sio_nvme_poll (sioQueue* q) {
+	return spdk_nvme_qpair_process_completions (q->ctx, 0);
+}
+
+static const sioBackend sio_nvme = {.name      = "spdk",
+                                    .flags     = sio_nvme_flags,
+                                    .newQueue  = sio_nvme_newqueue,
+                                    .freeQueue = sio_nvme_freequeue,
+                                    .submit    = sio_nvme_submit,
+                                    .poll      = sio_nvme_poll};
+
+int sio_nvme_open (idisk* dsk, struct spdk_nvme_ctrlr* ctrlr, struct spdk_nvme_ns* ns) {
+	dsk->backend      = &sio_nvme;
+	dsk->ctrlr        = ctrlr;
+	dsk->ns           = ns;
+	dsk->fd           = -1;
+	dsk->sectorLength = spdk_nvme_ns_get_sector_size (ns);
+	dsk->numSectors   = spdk_nvme_ns_get_num_sectors (ns);
+	return 0;
+}
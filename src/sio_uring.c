@@ -0,0 +1,237 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // O_DIRECT
+#endif
+
+#include <common.h>
+#include <siobackend.h>
+
+#include <errno.h>
+
+#ifdef SIO_URING
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <liburing.h>
+
+// io_uring backend: O_DIRECT files or kernel block devices. Every queue is a ring
+#define SIO_URING_MAXIOV (MAXSTRIPELENGTH / 4096)  // vectored reads of page-sized pieces
+#define SIO_URING_BATCH 64
+
+typedef struct {
+	struct io_uring ring;
+	uint32_t pending;                    // prepared and not submitted
+	uint32_t expected[SIO_MAXQDEPTH];    // result of each task when everything goes fine
+	struct iovec* iov[SIO_MAXQDEPTH];    // of each task, allocated on its first readv
+} sioUring;
+
+static uint32_t sio_uring_flags (idisk* dsk) {
+	UNUSED (dsk);
+	return SIO_F_DEALLOCATE | SIO_F_WRITEZEROES;  // fallocate
+}
+
+static int sio_uring_newqueue (idisk* dsk, sioQueue* q) {
+	sioUring* u = calloc (1, sizeof (sioUring));
+	int rc;
+
+	UNUSED (dsk);
+	if (u == NULL) {
+		fprintf (stderr, "ERROR: not enough memory for a new ring\n");
+		return -1;
+	}
+
+	rc = io_uring_queue_init (SIO_MAXQDEPTH, &u->ring, 0);
+	if (rc < 0) {
+		fprintf (stderr, "ERROR: io_uring_queue_init() failed: %s\n", strerror (-rc));
+		free (u);
+		return -1;
+	}
+
+	q->ctx = u;
+	return 0;
+}
+
+static void sio_uring_freequeue (idisk* dsk, sioQueue* q) {
+	sioUring* u = q->ctx;
+	int i;
+
+	UNUSED (dsk);
+	io_uring_queue_exit (&u->ring);
+	for (i = 0; i < SIO_MAXQDEPTH; i++) {
+		free (u->iov[i]);
+	}
+	free (u);
+}
+
+// The SGL callbacks describe the payload, as spdk does
+static int sio_uring_iov (sioUring* u, uint32_t task, sioTask* t, uint64_t len) {
+	uint64_t covered = 0;
+	int n            = 0;
+
+	if (!u->iov[task]) {
+		u->iov[task] = malloc (SIO_URING_MAXIOV * sizeof (struct iovec));
+		if (!u->iov[task])
+			return -1;
+	}
+
+	t->sglReset (t->sglArg, 0);
+	while (covered < len) {
+		void* address;
+		uint32_t length;
+
+		if (n == SIO_URING_MAXIOV || t->sglNext (t->sglArg, &address, &length)) {
+			return -1;
+		}
+		if (covered + length > len) {
+			length = len - covered;
+		}
+		u->iov[task][n].iov_base = address;
+		u->iov[task][n].iov_len  = length;
+		covered += length;
+		n++;
+	}
+	return n;
+}
+
+static int sio_uring_submit (idisk* dsk,
+                             sioQueue* q,
+                             sioTask* t,
+                             enum sioOp op,
+                             void* payload,
+                             uint64_t lba,
+                             uint32_t lba_count) {
+	sioUring* u                = q->ctx;
+	uint32_t task              = t - q->tasks;
+	uint64_t offset            = lba * dsk->sectorLength;
+	uint64_t len               = (uint64_t)lba_count * dsk->sectorLength;
+	struct io_uring_sqe* sqe   = io_uring_get_sqe (&u->ring);
+	int n;
+
+	if (sqe == NULL) {  // the ring is full, let it make some room
+		io_uring_submit (&u->ring);
+		u->pending = 0;
+		return -ENOMEM;
+	}
+
+	u->expected[task] = len;
+	switch (op) {
+		case SIO_OP_READ:
+			io_uring_prep_read (sqe, dsk->fd, payload, len, offset);
+			break;
+		case SIO_OP_WRITE:
+			io_uring_prep_write (sqe, dsk->fd, payload, len, offset);
+			break;
+		case SIO_OP_READV:
+			n = sio_uring_iov (u, task, t, len);
+			if (n < 0) {
+				io_uring_prep_nop (sqe);  // the sqe is already taken
+				io_uring_sqe_set_data (sqe, NULL);
+				u->pending++;
+				return -EINVAL;
+			}
+			io_uring_prep_readv (sqe, dsk->fd, u->iov[task], n, offset);
+			break;
+		case SIO_OP_DEALLOCATE:
+			io_uring_prep_fallocate (
+			    sqe, dsk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+			u->expected[task] = 0;
+			break;
+		case SIO_OP_WRITEZEROES:
+			io_uring_prep_fallocate (
+			    sqe, dsk->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, len);
+			u->expected[task] = 0;
+			break;
+		case SIO_OP_FLUSH:
+			io_uring_prep_fsync (sqe, dsk->fd, IORING_FSYNC_DATASYNC);
+			u->expected[task] = 0;
+			break;
+	}
+	io_uring_sqe_set_data (sqe, t);
+	u->pending++;
+	return 0;
+}
+
+static int sio_uring_poll (sioQueue* q) {
+	sioUring* u = q->ctx;
+	struct io_uring_cqe* cqes[SIO_URING_BATCH];
+	sioTask* tasks[SIO_URING_BATCH];
+	int errors[SIO_URING_BATCH];
+	unsigned i, n, done = 0;
+
+	if (u->pending) {
+		io_uring_submit (&u->ring);
+		u->pending = 0;
+	}
+
+	// The completions are taken out of the ring before calling back, as the callbacks may poll
+	n = io_uring_peek_batch_cqe (&u->ring, cqes, SIO_URING_BATCH);
+	for (i = 0; i < n; i++) {
+		tasks[i] = io_uring_cqe_get_data (cqes[i]);
+		if (tasks[i]) {
+			errors[i] = cqes[i]->res != (int)u->expected[tasks[i] - q->tasks];
+		}
+	}
+	io_uring_cq_advance (&u->ring, n);
+
+	for (i = 0; i < n; i++) {
+		if (tasks[i]) {
+			sio_complete (tasks[i], errors[i]);
+			done++;
+		}
+	}
+	return done;
+}
+
+static const sioBackend sio_uring = {.name      = "io_uring",
+                                     .flags     = sio_uring_flags,
+                                     .newQueue  = sio_uring_newqueue,
+                                     .freeQueue = sio_uring_freequeue,
+                                     .submit    = sio_uring_submit,
+                                     .poll      = sio_uring_poll};
+
+int sio_uring_open (idisk* dsk, const char* path) {
+	struct stat st;
+	uint64_t size;
+	int fd = open (path, O_RDWR | O_DIRECT);
+
+	if (fd < 0 || fstat (fd, &st)) {
+		fprintf (stderr, "ERROR: can't open %s: %s\n", path, strerror (errno));
+		if (fd >= 0)
+			close (fd);
+		return -1;
+	}
+
+	if (S_ISBLK (st.st_mode)) {
+		int sectorLength;
+		if (ioctl (fd, BLKSSZGET, &sectorLength) || ioctl (fd, BLKGETSIZE64, &size)) {
+			fprintf (stderr, "ERROR: can't get the geometry of %s\n", path);
+			close (fd);
+			return -1;
+		}
+		dsk->sectorLength = sectorLength;
+	} else {
+		dsk->sectorLength = DEFAULTSECTORLENGTH;
+		size              = st.st_size;
+	}
+
+	dsk->backend    = &sio_uring;
+	dsk->ctrlr      = NULL;
+	dsk->ns         = NULL;
+	dsk->fd         = fd;
+	dsk->numSectors = size / dsk->sectorLength;
+	return 0;
+}
+
+#else
+
+int sio_uring_open (idisk* dsk, const char* path) {
+	UNUSED (dsk);
+	fprintf (stderr, "ERROR: can't open %s, compiled without io_uring (CONFIG_URING=y)\n", path);
+	return -1;
+}
+
+#endif
@@ -4,139 +4,403 @@
 #include "spdk/nvme.h"
 #include "spdk/env.h"
 
-#define BUFFSIZE (SUPERSECTORLENGTH * NUMBUFS)
-
 /*Common*/
-int initSpcap (spcap* restrict spcapf, nvmeRaid* restrict raid, metaFile* restrict file) {
-	int i;
-	bzero (spcapf, sizeof (spcap));  // set everything to 0
+static void spcapComplete (void* arg, int error) {
+	if (error) {
+		*(int*)arg = -1;
+	}
+}
 
-	spcapf->raid = raid;
-	spcapf->file = file;
-	for (i = 0; i < raid->numdisks; i++) {
-		uint64_t currentlba = super_getdisklba (raid, file->startBlock + i * SUPERSECTORNUM);
-		uint64_t currentDsk = super_getdisk (raid, file->startBlock + i * SUPERSECTORNUM);
+static void spcapBufComplete (void* arg, int error) {
+	spcap_buf* buf = (spcap_buf*)arg;
+
+	if (error) {
+		buf->error = 1;
+	}
+	buf->done++;
+}
+
+// Waits for the last write of the block of the ring, -1 if it failed
+static int spcapBufWait (spcap* spcapf, spcap_buf* buf) {
+	while (buf->done != buf->cmds) {
+		sio_rpoll (spcapf->raid);
+	}
+	return buf->error ? -1 : 0;
+}
+
+// Raid lba of the next block of the file, which grows when it has no more
+static int spcapNext (spcap* spcapf) {
+	nvmeRaid* raid  = spcapf->raid;
+	uint64_t offset = spcapf->seq * SUPERSECTORNUM, count;
+	int grown       = 0;
 
-		spcapf->currPtr[currentDsk] = spcapf->buffs[currentDsk] =
-		    spdk_zmalloc (BUFFSIZE, SUPERSECTORLENGTH, NULL);
-		if (!spcapf->currPtr[currentDsk])
+	while (fileMap (raid, spcapf->file, offset, &spcapf->lba, &count)) {
+		if (grown++ || growFile (raid, spcapf->file, GROWLENGTH / SECTORLENGTH)) {
 			return -1;
-		spcapf->dataWrote[currentDsk] = 0;
-		spcapf->curlba[currentDsk]    = currentlba;
+		}
+	}
+	// extents are whole cycles of the stripe map, so their blocks are whole stripes
+	if (spcapf->lba % SUPERSECTORNUM || count < SUPERSECTORNUM) {
+		printf ("Block %lu of the file is not a whole stripe\n", spcapf->seq);
+		return -1;
 	}
+	spcapf->disk = super_getdisk (raid, spcapf->lba);
 	return 0;
 }
-void freeSpcap (spcap* spcapf) {
-	int i;
-	for (i = 0; i < spcapf->raid->numdisks; i++) {
-		spcap_header header = {.nsw8 = 0, .size = 0, .esize = 0};
-		writeBuff (spcapf, i, sizeof (spcap_header), &header);  // write header
+
+// Entry of the block being written, in the index of the blocks
+static void spcapIndexBlock (spcap* spcapf) {
+	spcap_blockidx* blocks;
+
+	if (spcapf->blocks && spcapf->seq == spcapf->maxBlocks) {
+		blocks = realloc (spcapf->blocks, 2 * spcapf->maxBlocks * sizeof (spcap_blockidx));
+		if (blocks == NULL) {  // the file will have no index of its blocks
+			free (spcapf->blocks);
+			spcapf->stats.blocks = 0;
+		}
+		spcapf->blocks = blocks;
+		spcapf->maxBlocks *= 2;
 	}
-	flushBuffs (spcapf);
-	for (i = 0; i < spcapf->raid->numdisks; i++) {
-		if (spcapf->buffs[i])
-			spdk_free (spcapf->buffs[i]);
+	if (spcapf->blocks) {
+		spcapf->blocks[spcapf->seq].time   = spcapf->blockTime;
+		spcapf->blocks[spcapf->seq].packet = spcapf->stats.packets - spcapf->blockPackets;
+		spcapf->stats.blocks++;
 	}
-	// spcapf->file->endBlock = (spcapf->file->endBlock - spcapf->file->startBlock) % SUPERSECTORNUM
-	// *
-	//                         spcapf->raid->numdisks;
-	updateRaid (spcapf->raid);
 }
 
-/*utils*/
-inline uint_fast16_t spcapDstDisk (spcap* spcapf) {
-	uint_fast16_t diskId = 0;
-	uint64_t dw          = spcapf->dataWrote[0];
-	int i;
+// Queues the block being filled (and its replica), and starts the next one in the ring, once
+// the write of its last block is done
+static int spcapWrite (spcap* spcapf) {
+	nvmeRaid* raid     = spcapf->raid;
+	spcap_buf* buf     = &spcapf->ring[spcapf->cur];
+	spcap_block* block = (spcap_block*)buf->mem;
+	int rc;
 
-	// TODO: Make it full-preentive
-	for (i = 0; i < spcapf->raid->numdisks; i++) {
-		if (spcapf->dataWrote[i] < dw) {
-			dw     = spcapf->dataWrote[i];
-			diskId = i;
+	if (spcapf->full) {
+		return -1;
+	}
+	block->MAGIC    = SPCAPBLOCKMAGIC;
+	block->seq      = spcapf->seq;
+	block->used     = spcapf->used;
+	block->align    = SPCAPALIGN;
+	block->format   = SPCAP_FORMAT_VARINT;
+	block->time     = spcapf->blockTime;
+	block->packets  = spcapf->blockPackets;
+	block->reserved = 0;
+	block->bytes    = spcapf->blockBytes;
+	buf->cmds       = -1;
+	buf->done       = 0;
+	buf->error      = 0;
+	rc = sio_rwrite_async (raid, block, spcapf->lba, SUPERSECTORNUM, spcapBufComplete, buf);
+	if (rc < 0) {
+		buf->cmds = buf->done;  // the commands queued are done
+		printf ("Error writing block %lu of the file\n", spcapf->seq);
+		spcapf->full = 1;
+		return -1;
+	}
+	buf->cmds = rc;
+	if (spcapf->blockPackets) {
+		spcapIndexBlock (spcapf);
+	}
+	spcapf->blockPackets = 0;
+	spcapf->blockBytes   = 0;
+	spcapf->dataWrote[spcapf->disk] += SUPERSECTORLENGTH;
+	spcapf->seq++;
+	spcapf->used = SPCAPFIRST (SPCAPALIGN);
+	spcapf->cur  = (spcapf->cur + 1) % spcapf->numbufs;
+	if (spcapBufWait (spcapf, &spcapf->ring[spcapf->cur])) {
+		printf ("Error writing block %lu of the file\n", spcapf->seq - spcapf->numbufs);
+		spcapf->full = 1;
+		return -1;
+	}
+	if (spcapNext (spcapf)) {
+		printf ("The raid has no room left for the file\n");
+		spcapf->full = 1;
+	}
+	return 0;
+}
+
+// The block is written when the next length bytes don't fit. -1 if there is no room for them
+static inline int spcapRoom (spcap* spcapf, uint64_t length) {
+	nvmeRaid* raid = spcapf->raid;
+
+	if (spcapf->used + length > SUPERSECTORLENGTH && spcapWrite (spcapf)) {
+		return -1;
+	}
+	return spcapf->full ? -1 : 0;
+}
+
+// Captured bytes of a packet that fit in a block (a packet never spans two)
+static inline uint_fast16_t spcapFit (spcap* spcapf, uint_fast16_t esize) {
+	nvmeRaid* raid = spcapf->raid;
+	uint64_t room  = SUPERSECTORLENGTH - SPCAPFIRST (SPCAPALIGN) - SPCAPMAXHEADER;
+
+	return esize < room ? esize : room;
+}
+
+// Stats and time index of the packet about to be written
+static void spcapCount (spcap* spcapf, uint64_t time, uint_fast16_t size, uint_fast16_t esize) {
+	spcap_stats* stats = &spcapf->stats;
+
+	if (stats->packets == 0 ||
+	    time / SPCAPINDEXINTERVAL > stats->lastTime / SPCAPINDEXINTERVAL) {  // a new second
+		if (stats->entries == spcapf->maxIndex) {
+			uint32_t max = spcapf->maxIndex ? 2 * spcapf->maxIndex : 1024;
+			spcap_index* index = realloc (spcapf->index, max * sizeof (spcap_index));
+
+			if (index) {  // otherwise, seeking this second starts at the one before
+				spcapf->index    = index;
+				spcapf->maxIndex = max;
+			}
 		}
+		if (stats->entries < spcapf->maxIndex) {
+			spcap_index* entry = &spcapf->index[stats->entries++];
+
+			entry->time = time;
+			memcpy (entry->offset, spcapf->dataWrote, sizeof (entry->offset));
+			entry->offset[spcapf->disk] += spcapf->used;  // inside the block being filled
+		}
+		spcapf->secondBytes = 0;
+	}
+	if (stats->packets == 0) {
+		stats->firstTime = time;
 	}
+	if (time > stats->lastTime) {
+		stats->lastTime = time;
+	}
+	stats->packets++;
+	stats->bytes += size;
+	stats->stored += esize;
+	spcapf->secondBytes += size;
+	if (spcapf->secondBytes > stats->peakRate) {
+		stats->peakRate = spcapf->secondBytes;
+	}
+}
+
+// Bytes [pos, pos + length) of the index: the summary, and the entries of the seconds and the
+// blocks, one after the other
+static void spcapIndexBytes (spcap* spcapf, uint64_t pos, char* dst, uint64_t length) {
+	const void* part[3] = {&spcapf->stats, spcapf->index, spcapf->blocks};
+	uint64_t size[3]    = {sizeof (spcap_stats),
+                        spcapf->stats.entries * sizeof (spcap_index),
+                        spcapf->stats.blocks * sizeof (spcap_blockidx)};
+	uint64_t n;
+	int i;
 
-	return diskId;
+	for (i = 0; i < 3 && length; i++) {
+		if (pos >= size[i]) {
+			pos -= size[i];
+			continue;
+		}
+		n = size[i] - pos < length ? size[i] - pos : length;
+		memcpy (dst, (const char*)part[i] + pos, n);
+		dst += n;
+		length -= n;
+		pos = 0;
+	}
+	memset (dst, 0, length);
 }
 
-/*Write*/
-void flushBuffs (spcap* spcapf) {
-	int diskid;
-
-	for (diskid = 0; diskid < spcapf->raid->numdisks; diskid++) {
-		if (spcapf->dataWrote[diskid] % SUPERSECTORLENGTH) {  // If it is != 0, then not flushed
-			if (sio_write (&spcapf->raid->disk[diskid],
-			               spcapf->currPtr[diskid] - spcapf->dataWrote[diskid] % SUPERSECTORLENGTH,
-			               spcapf->curlba[diskid],
-			               SUPERSECTORNUM)) {
-				printf ("Error writing to raid PCAP packets\n");
+// The index goes after the data, in blocks of its own, written a stripe of every disk at a time
+static int spcapWriteIndex (spcap* spcapf, uint64_t blocks) {
+	nvmeRaid* raid = spcapf->raid;
+	metaFile* file = spcapf->file;
+	uint64_t length, count, chunk, done, lba, n, i;
+	sioBuff* buff;
+	int error = 0;
+
+	if (spcapf->stats.packets == 0 || spcapf->index == NULL) {
+		return 0;
+	}
+	spcapf->stats.MAGIC = SPCAPINDEXMAGIC;
+	length = sizeof (spcap_stats) + spcapf->stats.entries * sizeof (spcap_index) +
+	         spcapf->stats.blocks * sizeof (spcap_blockidx);
+	count = (length + SECTORLENGTH - 1) / SECTORLENGTH;
+	chunk = count < GIGASECTORNUM ? count : GIGASECTORNUM;
+	if (growFile (raid, file, count)) {
+		printf ("The raid has no room left for the index of the file\n");
+		return -1;
+	}
+	buff = sio_getbuff (chunk * SECTORLENGTH);
+	if (buff == NULL) {
+		printf ("Not enough pinned memory for the index of the file\n");
+		return -1;
+	}
+
+	for (done = 0; !error && done < count; done += chunk) {
+		if (chunk > count - done) {
+			chunk = count - done;
+		}
+		spcapIndexBytes (spcapf, done * SECTORLENGTH, buff->mem, chunk * SECTORLENGTH);
+		for (i = 0; !error && i < chunk; i += n) {
+			if (fileMap (raid, file, blocks + done + i, &lba, &n)) {
+				error = -1;
+				break;
 			}
-			spcapf->curlba[diskid] += SUPERSECTORNUM;
-			spcapf->file->endBlock += SUPERSECTORNUM;
-			if (spcapf->currPtr[diskid] == spcapf->buffs[diskid] + BUFFSIZE) {
-				spcapf->currPtr[diskid] = spcapf->buffs[diskid];
+			if (n > chunk - i) {
+				n = chunk - i;
+			}
+			if (sio_rwrite_async (
+			        raid, (char*)buff->mem + i * SECTORLENGTH, lba, n, spcapComplete, &error) < 0) {
+				error = -1;
 			}
 		}
+		sio_waittasks (raid);  // the buffer is filled again
+	}
+	sio_putbuff (buff);
+
+	if (error || truncFile (raid, file, blocks + count)) {
+		printf ("Error writing the index of the file\n");
+		return -1;
 	}
+	setFileIndex (raid, file, blocks, count);
+	return 0;
 }
 
-inline void writeBuff (spcap* restrict spcapf,
-                       uint_fast16_t diskid,
-                       uint_fast16_t size,
-                       void* restrict payload) {
-	// Write data
-	uint_fast16_t toWrite =
-	    (spcapf->dataWrote[diskid] % SUPERSECTORLENGTH + size) > SUPERSECTORLENGTH
-	        ? SUPERSECTORLENGTH - (spcapf->dataWrote[diskid] % SUPERSECTORLENGTH)
-	        : size;
-	size -= toWrite;
+int initSpcap (spcap* restrict spcapf, nvmeRaid* restrict raid, metaFile* restrict file) {
+	uint32_t i;
 
-	memcpy (spcapf->currPtr[diskid], payload, toWrite);
-	spcapf->dataWrote[diskid] += toWrite;
-	spcapf->currPtr[diskid] += toWrite;
+	bzero (spcapf, sizeof (spcap));  // set everything to 0
 
-	// Flush data, if necessary
-	if (!spcapf->dataWrote[diskid] % SUPERSECTORLENGTH) {
-		if (sio_write (&spcapf->raid->disk[diskid],
-		               spcapf->currPtr[diskid] - SUPERSECTORLENGTH,
-		               spcapf->curlba[diskid],
-		               SUPERSECTORNUM)) {
-			printf ("Error writing to raid PCAP packets\n");
-		}
-		spcapf->curlba[diskid] += SUPERSECTORNUM;
-		spcapf->file->endBlock += SUPERSECTORNUM;
-		if (spcapf->currPtr[diskid] == spcapf->buffs[diskid] + BUFFSIZE) {
-			spcapf->currPtr[diskid] = spcapf->buffs[diskid];
+	spcapf->raid = raid;
+	spcapf->file = file;
+	if (raid->expandDisks) {  // the index and the empty blocks follow a single stripe map
+		puts ("The raid is being expanded, run the expand tool until it ends");
+		return -1;
+	}
+	// a ring of blocks for each disk, in one buffer
+	spcapf->numbufs = raid->numdisks * SPCAPBUFS;
+	spcapf->ring    = calloc (spcapf->numbufs, sizeof (spcap_buf));
+	spcapf->pinned  = sio_getbuff ((uint64_t)spcapf->numbufs * SUPERSECTORLENGTH);
+	if (!spcapf->ring || !spcapf->pinned) {
+		free (spcapf->ring);
+		sio_putbuff (spcapf->pinned);
+		spcapf->ring   = NULL;
+		spcapf->pinned = NULL;
+		return -1;
+	}
+	for (i = 0; i < spcapf->numbufs; i++) {
+		spcapf->ring[i].mem = (char*)spcapf->pinned->mem + (uint64_t)i * SUPERSECTORLENGTH;
+	}
+	spcapf->used = SPCAPFIRST (SPCAPALIGN);
+	if (spcapNext (spcapf)) {
+		spcapf->full = 1;
+	}
+	spcapf->maxBlocks = 4096;  // without memory for them, the file has no index of its blocks
+	spcapf->blocks    = malloc (spcapf->maxBlocks * sizeof (spcap_blockidx));
+	setFileLayout (raid, file, SPCAP_LAYOUT_BLOCKS);
+	return 0;
+}
+void freeSpcap (spcap* spcapf) {
+	nvmeRaid* raid = spcapf->raid;
+	uint32_t i;
+
+	if (spcapf->pinned == NULL) {  // initSpcap failed, nothing was written
+		return;
+	}
+	flushBuffs (spcapf);
+	// the empty blocks, so every disk stream ends (a cycle of the stripe map has every disk)
+	for (i = 0; i < raid->stripeCycle && !spcapf->full; i++) {
+		spcapWrite (spcapf);
+	}
+	// the blocks still being written
+	sio_waittasks (raid);
+	for (i = 0; i < spcapf->numbufs; i++) {
+		if (spcapf->ring[i].error) {
+			printf ("Error writing the last blocks of the file\n");
+			spcapf->full = 1;
+			break;
 		}
 	}
+	sio_putbuff (spcapf->pinned);
+	free (spcapf->ring);
+	// the file keeps the blocks written, the rest is free again
+	if (truncFile (raid, spcapf->file, spcapf->seq * SUPERSECTORNUM)) {
+		printf ("Error releasing the blocks not used by the file\n");
+	} else {
+		spcapWriteIndex (spcapf, spcapf->seq * SUPERSECTORNUM);
+	}
+	free (spcapf->index);
+	free (spcapf->blocks);
+}
+
+/*Write*/
+void flushBuffs (spcap* spcapf) {
+	if (spcapf->pinned == NULL) {
+		return;
+	}
+	if (spcapf->used > SPCAPFIRST (SPCAPALIGN) && spcapWrite (spcapf)) {
+		printf ("Error writing to raid PCAP packets\n");
+	}
+}
+
+inline void writeBuff (spcap* restrict spcapf, uint_fast16_t size, void* restrict payload) {
+	memcpy (spcapf->ring[spcapf->cur].mem + spcapf->used, payload, size);
+	spcapf->used += size;
+}
+
+// Header of a packet (SPCAP_FORMAT_VARINT), its bytes
+static inline uint_fast8_t spcapVarint (uint8_t* p, uint64_t value) {
+	uint_fast8_t n = 0;
+
+	while (value >= 0x80) {
+		p[n++] = value | 0x80;
+		value >>= 7;
+	}
+	p[n++] = value;
+	return n;
+}
 
-	// Write left data
-	if (size)  // we'll asume that there wont be a packet that overflows 2 buffers...
-		writeBuff (spcapf, diskid, size, payload);
+static inline uint_fast8_t
+spcapEncode (uint8_t* p, int64_t delta, uint_fast16_t size, uint_fast16_t esize) {
+	uint_fast8_t n = spcapVarint (p, (uint64_t)size << 1 | (esize != size));
+
+	if (esize != size) {
+		n += spcapVarint (p + n, esize);
+	}
+	return n + spcapVarint (p + n, (uint64_t)delta << 1 ^ (uint64_t)(delta >> 63));  // zigzag
 }
 
 inline void writePkt (spcap* restrict spcapf,
-                      uint_fast32_t nsw8,
+                      uint64_t time,
                       uint_fast16_t size,
                       uint_fast16_t esize,
                       void* restrict payload) {
-	spcap_header header;
-	uint_fast16_t dstDisk;
+	uint8_t header[SPCAPMAXHEADER];
+	uint_fast8_t hsize;
 
-	header.nsw8  = nsw8;
-	header.size  = size;
-	header.esize = esize;
-	dstDisk      = spcapDstDisk (spcapf);
+	esize = spcapFit (spcapf, esize);
+	hsize = spcapEncode (header, time - spcapf->lastTime, size, esize);
+	if (spcapRoom (spcapf, SPCAPALIGNUP (hsize + esize, SPCAPALIGN))) {  // dropped
+		return;
+	}
+	if (spcapf->used == SPCAPFIRST (SPCAPALIGN)) {  // the first packet of the block
+		spcapf->blockTime = spcapf->lastTime = time;
+		hsize = spcapEncode (header, 0, size, esize);
+	}
+	spcapCount (spcapf, time, size, esize);
+	spcapf->lastTime = time;
+	spcapf->blockPackets++;
+	spcapf->blockBytes += size;
 
-	writeBuff (spcapf, dstDisk, sizeof (spcap_header), &header);  // write header
-	writeBuff (spcapf, dstDisk, size, payload);
+	writeBuff (spcapf, hsize, header);  // write header
+	writeBuff (spcapf, esize, payload);  // only the captured bytes are stored
+
+	// so the next packet starts aligned, and the stripe can be handed over as it is
+	memset (spcapf->ring[spcapf->cur].mem + spcapf->used,
+	        0,
+	        SPCAPALIGNUP (spcapf->used, SPCAPALIGN) - spcapf->used);
+	spcapf->used = SPCAPALIGNUP (spcapf->used, SPCAPALIGN);
 }
 
 inline void writePCAPPkt (spcap* restrict spcapf,
                           struct pcap_pkthdr* restrict hdr,
                           void* restrict payload) {
-	writePkt (spcapf, 0, hdr->len, hdr->caplen, payload);
+	writePkt (spcapf,
+	          hdr->ts.tv_sec * 1000000000lu + hdr->ts.tv_usec * 1000lu,
+	          hdr->len,
+	          hdr->caplen,
+	          payload);
 }
 
 void writePCAP2raid (spcap* spcapf, char* filename) {
@@ -145,14 +409,478 @@ void writePCAP2raid (spcap* spcapf, char* filename) {
 	struct pcap_pkthdr header;
 	void* packet;
 
-	pcap = pcap_open_offline (filename, errbuf);
+	// libpcap reads pcapng too, and gives the us of pcap files as ns
+	pcap = pcap_open_offline_with_tstamp_precision (filename, PCAP_TSTAMP_PRECISION_NANO, errbuf);
 	if (pcap == NULL) {
 		fprintf (stderr, "error reading pcap file: %s\n", errbuf);
 		exit (1);
 	}
 
 	while ((packet = (void*)pcap_next (pcap, &header)) != NULL)
-		writePCAPPkt (spcapf, &header, packet);
+		writePkt (spcapf,
+		          header.ts.tv_sec * 1000000000lu + header.ts.tv_usec,
+		          header.len,
+		          header.caplen,
+		          packet);
+}
+
+/*Read*/
+uint_fast8_t spcapParse (
+    const void* p, uint32_t length, uint16_t format, uint64_t* time, spcap_pkt* pkt) {
+	const uint8_t* b = p;
+	uint64_t value[3];
+	uint_fast8_t n = 0, i, shift;
+
+	if (format == SPCAP_FORMAT_FIXED) {
+		const spcap_header* header = p;
+
+		if (length < sizeof (spcap_header)) {
+			return 0;
+		}
+		pkt->len    = header->size;
+		pkt->caplen = header->esize;
+		pkt->nsw8   = header->nsw8;
+		pkt->time   = 0;
+		return sizeof (spcap_header);
+	}
+	if (format != SPCAP_FORMAT_VARINT) {
+		return 0;
+	}
+	for (i = 0; i < 3; i++) {
+		value[i] = 0;
+		for (shift = 0;; shift += 7) {
+			if (n == length || n == SPCAPMAXHEADER || shift > 63) {
+				return 0;
+			}
+			value[i] |= (uint64_t)(b[n] & 0x7f) << shift;
+			if (!(b[n++] & 0x80)) {
+				break;
+			}
+		}
+		if (i == 0 && !(value[0] & 1)) {  // all the bytes were captured
+			value[++i] = value[0] >> 1;
+		}
+	}
+	pkt->len    = value[0] >> 1;
+	pkt->caplen = value[1];
+	pkt->nsw8   = 0;
+	*time += (value[2] >> 1) ^ -(value[2] & 1);  // zigzag
+	pkt->time = *time;
+	return n;
+}
+
+uint32_t spcapBlockEnd (const spcap_block* block, uint64_t length) {
+	if (block->MAGIC != SPCAPBLOCKMAGIC || block->used <= SPCAPFIRST (block->align) ||
+	    block->used > length) {
+		return 0;
+	}
+	return block->used;
+}
+
+// Reads length bytes at byte pos of the index of the file
+static int spcapReadIndex (nvmeRaid* raid, metaFile* file, uint64_t pos, void* dst, uint64_t length) {
+	uint64_t first = pos / SECTORLENGTH, last = (pos + length + SECTORLENGTH - 1) / SECTORLENGTH;
+	uint64_t block, lba, n;
+	sioBuff* buff;
+	int error = 0;
+
+	if (file->indexBlocks == 0 || last > file->indexBlocks) {
+		return -1;
+	}
+	buff = sio_getbuff ((last - first) * SECTORLENGTH);
+	if (buff == NULL) {
+		return -1;
+	}
+	for (block = first; !error && block < last; block += n) {
+		if (fileMap (raid, file, file->indexBlock + block, &lba, &n)) {
+			error = -1;
+			break;
+		}
+		if (n > last - block) {
+			n = last - block;
+		}
+		if (sio_rread_async (raid,
+		                     (char*)buff->mem + (block - first) * SECTORLENGTH,
+		                     lba,
+		                     n,
+		                     spcapComplete,
+		                     &error) < 0) {
+			error = -1;
+		}
+	}
+	sio_waittasks (raid);
+	if (!error) {
+		memcpy (dst, (char*)buff->mem + pos % SECTORLENGTH, length);
+	}
+	sio_putbuff (buff);
+	return error;
+}
+
+int spcapStats (nvmeRaid* raid, metaFile* file, spcap_stats* stats) {
+	if (spcapReadIndex (raid, file, 0, stats, sizeof (spcap_stats)) ||
+	    stats->MAGIC != SPCAPINDEXMAGIC) {
+		return -1;
+	}
+	return 0;
+}
+
+int spcapSeek (nvmeRaid* raid, metaFile* file, uint64_t time, spcap_index* entry) {
+	spcap_stats stats;
+	uint32_t low = 0, high;
+
+	if (spcapStats (raid, file, &stats) || stats.entries == 0) {
+		return -1;
+	}
+	// the last entry at or before time is in [low, high)
+	high = stats.entries;
+	while (high - low > 1) {
+		uint32_t mid = low + (high - low) / 2;
+
+		if (spcapReadIndex (raid,
+		                    file,
+		                    sizeof (spcap_stats) + mid * sizeof (spcap_index),
+		                    entry,
+		                    sizeof (spcap_index))) {
+			return -1;
+		}
+		if (entry->time <= time) {
+			low = mid;
+		} else {
+			high = mid;
+		}
+	}
+	return spcapReadIndex (
+	    raid, file, sizeof (spcap_stats) + low * sizeof (spcap_index), entry, sizeof (spcap_index));
+}
+
+int spcapSeekBlock (nvmeRaid* raid,
+                    metaFile* file,
+                    uint64_t value,
+                    int packet,
+                    uint64_t* seq,
+                    spcap_blockidx* entry) {
+	uint64_t base, low = 0, high;
+	spcap_stats stats;
+
+	if (spcapStats (raid, file, &stats) || stats.blocks == 0) {
+		return -1;
+	}
+	base = sizeof (spcap_stats) + stats.entries * sizeof (spcap_index);
+	// the last block starting at or before value is in [low, high)
+	high = stats.blocks;
+	while (high - low > 1) {
+		uint64_t mid = low + (high - low) / 2;
+
+		if (spcapReadIndex (
+		        raid, file, base + mid * sizeof (spcap_blockidx), entry, sizeof (spcap_blockidx))) {
+			return -1;
+		}
+		if ((packet ? entry->packet : entry->time) <= value) {
+			low = mid;
+		} else {
+			high = mid;
+		}
+	}
+	*seq = low;
+	return spcapReadIndex (
+	    raid, file, base + low * sizeof (spcap_blockidx), entry, sizeof (spcap_blockidx));
+}
+
+int spcapBlockStart (nvmeRaid* raid, metaFile* file, uint64_t seq, spcap_index* start) {
+	uint64_t stripes = seq, first, end, part, split, disklba, disklast;
+	int n, i;
+
+	// the stripes of each disk in the extents before the block, as the disk streams take them
+	bzero (start, sizeof (spcap_index));
+	for (n = 0; stripes && fileExtent (raid, file, n, &first, &end) == 0; n++) {
+		if ((end - first) / SUPERSECTORNUM > stripes) {
+			end = first + stripes * SUPERSECTORNUM;
+		}
+		stripes -= (end - first) / SUPERSECTORNUM;
+		for (part = first; part < end; part = split) {  // as fileDiskExtent, while expanding
+			split = super_getsplit (raid, part, end);
+			for (i = 0; i < raid->numdisks; i++) {
+				if (super_getrange (raid, part, split, i, &disklba, &disklast)) {
+					start->offset[i] += (disklast - disklba) / SUPERSECTORNUM * SUPERSECTORLENGTH;
+				}
+			}
+		}
+	}
+	return stripes ? -1 : 0;
+}
+
+int spcapDiskOffset (nvmeRaid* raid,
+                     metaFile* file,
+                     uint8_t disk,
+                     uint64_t offset,
+                     int* n,
+                     uint64_t* first,
+                     uint64_t* last,
+                     uint32_t* skip) {
+	uint64_t stripes = offset / SUPERSECTORLENGTH;
+
+	// the stream takes every whole stripe of each extent, as spcapNext gives them
+	*n = -1;
+	while (fileDiskExtent (raid, file, disk, n, first, last) == 0) {
+		uint64_t room = (*last - *first) / SUPERSECTORNUM;
+
+		if (stripes < room) {
+			*first += stripes * SUPERSECTORNUM;
+			*skip = offset % SUPERSECTORLENGTH;
+			return 0;
+		}
+		stripes -= room;
+	}
+	return -1;
+}
+
+// Window of each disk stream, so the biggest packet fits with the stripes it spans
+static uint32_t spcapWindow (nvmeRaid* raid) {
+	uint32_t window = 2 + SPCAPMAXPKT / SUPERSECTORLENGTH;
+
+	return window > RSTREAM_DEFAULTWINDOW ? window : RSTREAM_DEFAULTWINDOW;
+}
+
+int spcapOpen (spcapReader* reader, nvmeRaid* raid, metaFile* file, const spcap_index* start) {
+	int i;
+
+	bzero (reader, sizeof (spcapReader));
+	reader->raid = raid;
+	reader->file = file;
+	reader->last = UINT64_MAX;
+	// the disk streams of the blocks follow the stripes moved and then the ones not moved yet, and
+	// their headers give the order. The ones written per disk do not survive the moves
+	if (raid->expandDisks && file->layout != SPCAP_LAYOUT_BLOCKS) {
+		puts ("The raid is being expanded, run the expand tool until it ends");
+		return -1;
+	}
+	for (i = 0; i < raid->numdisks; i++) {
+		uint64_t offset = start ? start->offset[i] : 0;
+		spcap_disk* d;
+
+		if (super_isreplica (raid, i)) {  // read along with its primary
+			continue;
+		}
+		d = malloc (sizeof (spcap_disk));
+		if (d == NULL) {
+			spcapClose (reader);
+			return -1;
+		}
+		reader->disk[i] = d;
+		d->offset       = offset % SUPERSECTORLENGTH;
+		d->finished     = 0;
+		d->blockend     = 0;
+		d->seq          = 0;
+		d->align        = 0;
+		d->format       = SPCAP_FORMAT_FIXED;
+		d->time         = 0;
+		// the packet of the index is in the middle of a block, after deltas not read
+		d->resync = offset % SUPERSECTORLENGTH ? start->time : 0;
+		if (rstream_opendisk (
+		        &d->st, raid, file, i, offset / SUPERSECTORLENGTH, spcapWindow (raid))) {
+			spcapClose (reader);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int spcapOpenBlocks (
+    spcapReader* reader, nvmeRaid* raid, metaFile* file, uint64_t first, uint64_t last) {
+	spcap_index start;
+
+	if (file->layout != SPCAP_LAYOUT_BLOCKS || spcapBlockStart (raid, file, first, &start) ||
+	    spcapOpen (reader, raid, file, &start)) {
+		return -1;
+	}
+	reader->last = last;
+	return 0;
 }
 
-/*Read*/
\ No newline at end of file
+void spcapClose (spcapReader* reader) {
+	int i;
+
+	for (i = 0; i < MAXDISKS; i++) {
+		if (reader->disk[i]) {
+			if (reader->disk[i]->st.pinned) {
+				rstream_close (&reader->disk[i]->st);
+			}
+			free (reader->disk[i]);
+			reader->disk[i] = NULL;
+		}
+	}
+}
+
+// length bytes at byte at of the disk stream (since the oldest held stripe), waiting for their
+// stripes. NULL if the stream ends before, or if they don't fit in the stripes not released yet
+static const char* spcapPeek (nvmeRaid* raid, spcap_disk* d, uint64_t at, uint64_t length) {
+	uint64_t ring = d->st.numslots * SUPERSECTORLENGTH, pos;
+
+	while (d->st.held * SUPERSECTORLENGTH < at + length) {
+		if (d->st.held == d->st.numslots || rstream_next (&d->st) == NULL) {
+			return NULL;
+		}
+	}
+	pos = (d->st.head * SUPERSECTORLENGTH + at) % ring;
+	if (pos + length <= ring) {
+		return (char*)d->st.pinned->mem + pos;
+	}
+	// the last stripe of the window is followed by the first one
+	memcpy (d->tail, (char*)d->st.pinned->mem + pos, ring - pos);
+	memcpy (d->tail + ring - pos, d->st.pinned->mem, length - (ring - pos));
+	return d->tail;
+}
+
+// The packets of one disk stream, in place
+static int spcapDecode (nvmeRaid* raid, spcap_disk* d, uint8_t disk, spcap_pkt* pkts, int max) {
+	const uint_fast8_t hsize = sizeof (spcap_header);
+	const char* p;
+	int n = 0;
+
+	while (n < max) {
+		p = spcapPeek (raid, d, d->offset, hsize);
+		if (p == NULL) {
+			break;
+		}
+		spcapParse (p, hsize, SPCAP_FORMAT_FIXED, &d->time, &pkts[n]);
+		if (pkts[n].len == 0 && pkts[n].caplen == 0) {  // end of the stream
+			d->finished = 1;
+			break;
+		}
+		p = spcapPeek (raid, d, d->offset, hsize + pkts[n].caplen);
+		if (p == NULL) {
+			break;
+		}
+		pkts[n].data = p + hsize;
+		pkts[n].disk = disk;
+		d->offset += hsize + pkts[n].caplen;
+		n++;
+	}
+	// nothing left to read (a full stream ends without the empty header)
+	if (n < max && !d->finished && d->st.held < d->st.numslots) {
+		d->finished = 1;
+	}
+	return d->st.error ? -1 : n;
+}
+
+// Header of the oldest held stripe of the disk, a block. An invalid or empty one ends the stream
+static int spcapBlock (nvmeRaid* raid, spcap_disk* d) {
+	const spcap_block* block = (const spcap_block*)spcapPeek (raid, d, 0, sizeof (spcap_block));
+
+	if (block == NULL) {
+		d->finished = 1;
+		return d->st.error ? -1 : 0;
+	}
+	d->blockend = spcapBlockEnd (block, SUPERSECTORLENGTH);
+	if (d->blockend == 0) {
+		d->finished = 1;
+		return 0;
+	}
+	d->seq      = block->seq;
+	d->align    = block->align;
+	d->format   = block->format;
+	if (d->offset < SPCAPFIRST (d->align)) {
+		d->offset = SPCAPFIRST (d->align);
+		d->time   = d->format == SPCAP_FORMAT_VARINT ? block->time : 0;
+	}
+	return 0;
+}
+
+// The packets of the block of a disk, in place. 0 once they were all read
+static int spcapDecodeBlock (nvmeRaid* raid, spcap_disk* d, uint8_t disk, spcap_pkt* pkts, int max) {
+	const char* p;
+	uint_fast8_t hsize;
+	int n = 0;
+
+	while (n < max && d->offset < d->blockend) {
+		// the block is within the oldest held stripe
+		p     = spcapPeek (raid, d, d->offset, d->blockend - d->offset);
+		hsize = p ? spcapParse (p, d->blockend - d->offset, d->format, &d->time, &pkts[n]) : 0;
+		if (hsize == 0 || d->offset + hsize + pkts[n].caplen > d->blockend) {
+			d->offset = d->blockend;  // a broken block, its other packets are lost
+			break;
+		}
+		if (d->resync) {  // the first packet after a seek, with the time of the index
+			pkts[n].time = d->time = d->resync;
+			d->resync    = 0;
+		}
+		pkts[n].data = p + hsize;
+		pkts[n].disk = disk;
+		d->offset    = SPCAPALIGNUP (d->offset + hsize + pkts[n].caplen, d->align);
+		n++;
+	}
+	return n;
+}
+
+// The blocks of every disk go back in the order they were written, the lowest seq first
+static int spcapReadBlocks (spcapReader* reader, spcap_pkt* pkts, int max) {
+	nvmeRaid* raid = reader->raid;
+	spcap_disk* next;
+	int i, n, disk = 0;
+
+	while (1) {
+		next = NULL;
+		for (i = 0; i < raid->numdisks; i++) {
+			spcap_disk* d = reader->disk[i];
+
+			if (d == NULL || d->finished) {
+				continue;
+			}
+			if (d->blockend == 0 && spcapBlock (raid, d)) {
+				return -1;
+			}
+			if (!d->finished && (next == NULL || d->seq < next->seq)) {
+				next = d;
+				disk = i;
+			}
+		}
+		if (next == NULL || next->seq >= reader->last) {
+			return 0;
+		}
+		n = spcapDecodeBlock (raid, next, disk, pkts, max);
+		if (n != 0) {
+			return n;
+		}
+		// none of its packets are in use, the next block of the disk can take its place
+		rstream_release (&next->st);
+		next->offset   = 0;
+		next->blockend = 0;
+	}
+}
+
+int spcapRead (spcapReader* reader, spcap_pkt* pkts, int max) {
+	nvmeRaid* raid = reader->raid;
+	int i, n;
+
+	// the packets of the last batch are not used anymore
+	for (i = 0; i < raid->numdisks; i++) {
+		spcap_disk* d = reader->disk[i];
+
+		if (d && d->blockend && d->offset >= d->blockend) {  // the rest of the stripe is unused
+			d->offset   = SUPERSECTORLENGTH;
+			d->blockend = 0;
+		}
+		while (d && d->st.held && d->offset >= SUPERSECTORLENGTH) {
+			rstream_release (&d->st);
+			d->offset -= SUPERSECTORLENGTH;
+		}
+	}
+	if (reader->file->layout == SPCAP_LAYOUT_BLOCKS) {
+		return spcapReadBlocks (reader, pkts, max);
+	}
+
+	for (i = 0; i < raid->numdisks; i++) {
+		int disk      = (reader->next + i) % raid->numdisks;
+		spcap_disk* d = reader->disk[disk];
+
+		if (d == NULL || d->finished) {
+			continue;
+		}
+		n            = spcapDecode (raid, d, disk, pkts, max);
+		reader->next = (disk + 1) % raid->numdisks;
+		if (n != 0) {
+			return n;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,226 @@
+#include <stream.h>
+#include <common.h>
+
+static void rstream_complete (void* arg, int error) {
+	rstreamSlot* s = (rstreamSlot*)arg;
+	s->error       = error ? 1 : 0;
+	s->ready       = 1;
+}
+
+// Whole stripes of a disk, from the replica with less work
+static void rstream_filldisk (raidStream* st) {
+	nvmeRaid* raid = st->raid;
+	int mirror     = super_getmirror (raid, st->disk);
+	idisk* replica = mirror >= 0 ? &raid->disk[mirror] : NULL;
+
+	while (st->held + st->inflight < st->numslots) {
+		rstreamSlot* s;
+
+		if (st->nextlba + SUPERSECTORNUM > st->endlba) {
+			if (st->error ||
+			    fileDiskExtent (
+			        raid, st->file, st->disk, &st->extent, &st->nextlba, &st->endlba)) {
+				st->nextlba = st->endlba;
+				break;
+			}
+			continue;
+		}
+
+		s         = &st->slot[(st->head + st->held + st->inflight) % st->numslots];
+		s->length = SUPERSECTORLENGTH;
+		s->lba    = st->nextlba;
+		s->ready  = 0;
+		s->error  = 0;
+		if (sio_read_async (sio_replica (&raid->disk[st->disk], replica),
+		                    s->data,
+		                    s->lba,
+		                    SUPERSECTORNUM,
+		                    rstream_complete,
+		                    s) < 0) {
+			st->error  = -1;
+			st->endlba = st->nextlba;
+			break;
+		}
+
+		st->nextlba += SUPERSECTORNUM;
+		st->inflight++;
+	}
+}
+
+// Keep the window full
+static void rstream_fill (raidStream* st) {
+	nvmeRaid* raid = st->raid;
+
+	if (st->disk >= 0) {
+		rstream_filldisk (st);
+		return;
+	}
+	while (st->held + st->inflight < st->numslots) {
+		rstreamSlot* s;
+		uint32_t count;
+
+		if (st->nextlba >= st->endlba) {
+			if (!st->file || st->error ||
+			    fileExtent (raid, st->file, ++st->extent, &st->nextlba, &st->endlba)) {
+				break;
+			}
+			continue;  // it may be empty
+		}
+
+		s     = &st->slot[(st->head + st->held + st->inflight) % st->numslots];
+		count = SUPERSECTORNUM - st->nextlba % SUPERSECTORNUM;
+
+		if (count > st->endlba - st->nextlba) {
+			count = st->endlba - st->nextlba;
+		}
+
+		s->length = count * SECTORLENGTH;
+		s->lba    = st->nextlba;
+		s->ready  = 0;
+		s->error  = 0;
+		if (sio_rread_async (raid, s->data, s->lba, count, rstream_complete, s) < 0) {
+			st->error  = -1;
+			st->endlba = st->nextlba;
+			break;
+		}
+
+		st->nextlba += count;
+		st->inflight++;
+	}
+}
+
+int rstream_openrange (
+    raidStream* st, nvmeRaid* raid, uint64_t startlba, uint64_t endlba, uint32_t window) {
+	uint32_t i;
+
+	bzero (st, sizeof (raidStream));
+	if (window == 0)
+		window = RSTREAM_DEFAULTWINDOW;
+	if (window > RSTREAM_MAXWINDOW)
+		window = RSTREAM_MAXWINDOW;
+
+	st->raid     = raid;
+	st->disk     = -1;
+	st->numslots = window * raid->numdisks;
+	st->nextlba  = startlba;
+	st->endlba   = endlba;
+	st->pinned   = sio_getbuff (st->numslots * SUPERSECTORLENGTH);
+	if (!st->pinned)
+		return -1;
+
+	for (i = 0; i < st->numslots; i++) {
+		st->slot[i].data = (char*)st->pinned->mem + i * SUPERSECTORLENGTH;
+	}
+
+	rstream_fill (st);
+	return st->error;
+}
+
+int rstream_open (raidStream* st, nvmeRaid* raid, metaFile* file, uint32_t window) {
+	if (rstream_openrange (st, raid, file->startBlock, file->endBlock, window)) {
+		return -1;
+	}
+
+	st->file = file;  // and then, the next extents
+	rstream_fill (st);
+	return st->error;
+}
+
+int rstream_opendisk (
+    raidStream* st, nvmeRaid* raid, metaFile* file, uint8_t disk, uint64_t skip, uint32_t window) {
+	uint32_t i;
+
+	bzero (st, sizeof (raidStream));
+	if (window == 0)
+		window = RSTREAM_DEFAULTWINDOW;
+	if (window > RSTREAM_MAXWINDOW * MAXDISKS)
+		window = RSTREAM_MAXWINDOW * MAXDISKS;
+
+	st->raid     = raid;
+	st->file     = file;
+	st->disk     = disk;
+	st->extent   = -1;
+	st->numslots = window;
+	st->pinned   = sio_getbuff (st->numslots * SUPERSECTORLENGTH);
+	if (!st->pinned)
+		return -1;
+
+	for (i = 0; i < st->numslots; i++) {
+		st->slot[i].data = (char*)st->pinned->mem + i * SUPERSECTORLENGTH;
+	}
+
+	// the stripes before, extent by extent
+	while (fileDiskExtent (raid, file, disk, &st->extent, &st->nextlba, &st->endlba) == 0) {
+		uint64_t stripes = (st->endlba - st->nextlba) / SUPERSECTORNUM;
+
+		if (skip < stripes) {
+			st->nextlba += skip * SUPERSECTORNUM;
+			break;
+		}
+		skip -= stripes;
+	}
+
+	rstream_fill (st);
+	return st->error;
+}
+
+void rstream_close (raidStream* st) {
+	nvmeRaid* raid = st->raid;
+
+	// the buffers can't be reused until the disks finish with them
+	while (st->inflight) {
+		rstreamSlot* s = &st->slot[(st->head + st->held) % st->numslots];
+		while (!s->ready) {
+			sio_rpoll (raid);
+		}
+		st->held++;
+		st->inflight--;
+	}
+	sio_putbuff (st->pinned);
+	st->pinned = NULL;
+}
+
+rstreamSlot* rstream_trynext (raidStream* st) {
+	rstreamSlot* s;
+
+	if (st->inflight == 0 || st->error) {
+		return NULL;
+	}
+
+	s = &st->slot[(st->head + st->held) % st->numslots];
+	if (!s->ready) {
+		sio_rpoll (st->raid);
+		if (!s->ready) {
+			return NULL;
+		}
+	}
+	if (s->error) {
+		st->error = -1;
+		return NULL;
+	}
+
+	st->held++;
+	st->inflight--;
+	return s;
+}
+
+rstreamSlot* rstream_next (raidStream* st) {
+	rstreamSlot* s;
+
+	while (st->inflight && !st->error) {
+		if ((s = rstream_trynext (st)) != NULL) {
+			return s;
+		}
+	}
+	return NULL;
+}
+
+void rstream_release (raidStream* st) {
+	if (st->held == 0) {
+		return;
+	}
+
+	st->head = (st->head + 1) % st->numslots;
+	st->held--;
+	rstream_fill (st);
+}